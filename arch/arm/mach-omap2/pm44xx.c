@@ -22,6 +22,7 @@
 #include <linux/delay.h>
 #include <linux/irq.h>
 #include <linux/regulator/machine.h>
+#include <linux/wakelock.h>
 
 #include <asm/hardware/gic.h>
 #include <mach/omap4-common.h>
@@ -515,6 +516,7 @@ static void _print_wakeirq(int irq)
 {
 	struct irq_desc *desc = irq_to_desc(irq);
 
+	suspend_profile_wakeup_irq(irq);
 	if (irq == OMAP44XX_IRQ_LOCALTIMER)
 		pr_info("Resume caused by IRQ %d, localtimer\n", irq);
 	else if (!desc || !desc->action || !desc->action->name)
@@ -657,12 +659,8 @@ static void _print_prcm_wakeirq(int irq)
 			prcm_irqs1, prcm_irqs2);
 }
 
-static void omap4_print_wakeirq(void)
+static void omap4_print_wakeirq(int irq)
 {
-	int irq;
-
-	irq = gic_cpu_read(GIC_CPU_HIGHPRI) & 0x3ff;
-
 	if ((irq == 1022) || (irq == 1023)) {
 		pr_info("GIC returns spurious interrupt for resume IRQ\n");
 		return;
@@ -677,11 +675,26 @@ static void omap4_print_wakeirq(void)
 		_print_wakeirq(irq);
 }
 #else
-static void omap4_print_wakeirq(void)
+static void omap4_print_wakeirq(int irq)
 {
 }
 #endif
 
+/*
+ * Reports the interrupt that woke us to the wakelock suspend profile.
+ * With PM_DEBUG a GPIO wakeup has already been recorded as its GPIO
+ * interrupt while it was printed, so the bank interrupt is a fallback.
+ */
+static void omap4_wakeirq(void)
+{
+	int irq;
+
+	irq = gic_cpu_read(GIC_CPU_HIGHPRI) & 0x3ff;
+	omap4_print_wakeirq(irq);
+	if ((irq != 1022) && (irq != 1023))
+		suspend_profile_wakeup_irq(irq);
+}
+
 /**
  * get_achievable_state() - Provide achievable state
  * @available_states:	what states are available
@@ -911,7 +924,7 @@ static int omap4_pm_suspend(void)
 	 * More details can be found in OMAP4430 TRM section 4.3.4.2.
 	 */
 	omap4_enter_sleep(0, PWRDM_POWER_OFF, true);
-	omap4_print_wakeirq();
+	omap4_wakeirq();
 	prcmdebug_dump(PRCMDEBUG_LASTSLEEP);
 
 	/* Disable Device OFF state*/
@@ -29,10 +29,15 @@
 #include <linux/seq_file.h>
 #include <linux/uaccess.h>
 #include <linux/debugfs.h>
+#include <linux/dma-mapping.h>
+#include <linux/spinlock.h>
 
 #include "ion_priv.h"
 #define DEBUG
 
+#define CREATE_TRACE_POINTS
+#include <trace/events/ion.h>
+
 /* this function should only be called while dev->lock is held */
 static void ion_buffer_add(struct ion_device *dev,
 			   struct ion_buffer *buffer)
@@ -83,22 +88,146 @@ static struct ion_buffer *ion_buffer_create(struct ion_heap *heap,
 	}
 	buffer->dev = dev;
 	buffer->size = len;
+	atomic_long_add(len, &heap->usage.allocated);
 	buffer->cached = false;
 	mutex_init(&buffer->lock);
+	INIT_LIST_HEAD(&buffer->mapping_lru);
 	ion_buffer_add(dev, buffer);
 	return buffer;
 }
 
+static bool ion_buffer_mapping_idle(struct ion_buffer *buffer)
+{
+	return (!buffer->kmap_cnt && buffer->vaddr) ||
+	       (!buffer->dmap_cnt && buffer->sglist);
+}
+
+/*
+ * Put the buffer on, or take it off, the device's list of buffers with idle
+ * mappings to match its map counts.  Must be called with buffer->lock held
+ * whenever kmap_cnt, dmap_cnt, vaddr or sglist change.
+ */
+static void ion_buffer_update_mapping_lru(struct ion_buffer *buffer)
+{
+	struct ion_device *dev = buffer->dev;
+	unsigned long pages = PAGE_ALIGN(buffer->size) / PAGE_SIZE;
+	bool idle = ion_buffer_mapping_idle(buffer);
+
+	spin_lock(&dev->mapping_lock);
+	if (idle && list_empty(&buffer->mapping_lru)) {
+		list_add_tail(&buffer->mapping_lru, &dev->mapping_lru);
+		dev->mapping_lru_pages += pages;
+	} else if (!idle && !list_empty(&buffer->mapping_lru)) {
+		list_del_init(&buffer->mapping_lru);
+		dev->mapping_lru_pages -= pages;
+	}
+	spin_unlock(&dev->mapping_lock);
+}
+
+/* buffer->lock must be held */
+static void ion_buffer_unmap_idle(struct ion_buffer *buffer)
+{
+	if (!buffer->kmap_cnt && buffer->vaddr) {
+		buffer->heap->ops->unmap_kernel(buffer->heap, buffer);
+		buffer->vaddr = NULL;
+	}
+	if (!buffer->dmap_cnt && buffer->sglist) {
+		buffer->heap->ops->unmap_dma(buffer->heap, buffer);
+		buffer->sglist = NULL;
+	}
+}
+
+/*
+ * Tear down idle mappings, least recently used first, until at least
+ * nr_pages worth of buffers have been unmapped.  Buffers whose lock is
+ * contended are skipped, so this is safe to call with another buffer's
+ * lock held and from reclaim.  Returns the number of pages still mapped
+ * by idle buffers.
+ */
+static unsigned long ion_device_unmap_idle(struct ion_device *dev,
+					   long nr_pages)
+{
+	struct ion_buffer *buffer;
+	bool found;
+
+	while (nr_pages > 0) {
+		found = false;
+		spin_lock(&dev->mapping_lock);
+		list_for_each_entry(buffer, &dev->mapping_lru, mapping_lru) {
+			if (mutex_trylock(&buffer->lock)) {
+				found = true;
+				break;
+			}
+		}
+		if (!found) {
+			spin_unlock(&dev->mapping_lock);
+			break;
+		}
+		list_del_init(&buffer->mapping_lru);
+		dev->mapping_lru_pages -= PAGE_ALIGN(buffer->size) / PAGE_SIZE;
+		spin_unlock(&dev->mapping_lock);
+
+		nr_pages -= PAGE_ALIGN(buffer->size) / PAGE_SIZE;
+		ion_buffer_unmap_idle(buffer);
+		mutex_unlock(&buffer->lock);
+	}
+
+	return dev->mapping_lru_pages;
+}
+
+static int ion_mapping_shrink(struct shrinker *shrinker,
+			      struct shrink_control *sc)
+{
+	struct ion_device *dev = container_of(shrinker, struct ion_device,
+					      mapping_shrinker);
+
+	return ion_device_unmap_idle(dev, sc->nr_to_scan);
+}
+
+void ion_buffer_release(struct ion_buffer *buffer)
+{
+	struct ion_device *dev = buffer->dev;
+
+	spin_lock(&dev->mapping_lock);
+	if (!list_empty(&buffer->mapping_lru)) {
+		list_del_init(&buffer->mapping_lru);
+		dev->mapping_lru_pages -= PAGE_ALIGN(buffer->size) / PAGE_SIZE;
+	}
+	spin_unlock(&dev->mapping_lock);
+
+	/* the shrinker may still be working on the buffer, wait for it */
+	mutex_lock(&buffer->lock);
+	if (buffer->vaddr)
+		buffer->heap->ops->unmap_kernel(buffer->heap, buffer);
+	if (buffer->sglist)
+		buffer->heap->ops->unmap_dma(buffer->heap, buffer);
+	mutex_unlock(&buffer->lock);
+
+	trace_ion_free(buffer->heap->name, buffer, buffer->size);
+	atomic_long_sub(buffer->size, &buffer->heap->usage.allocated);
+	buffer->heap->ops->free(buffer);
+	kfree(buffer);
+}
+
 static void ion_buffer_destroy(struct kref *kref)
 {
 	struct ion_buffer *buffer = container_of(kref, struct ion_buffer, ref);
 	struct ion_device *dev = buffer->dev;
+	struct ion_heap *heap = buffer->heap;
 
-	buffer->heap->ops->free(buffer);
 	mutex_lock(&dev->lock);
 	rb_erase(&buffer->node, &dev->buffers);
 	mutex_unlock(&dev->lock);
-	kfree(buffer);
+
+	mutex_lock(&buffer->lock);
+	if (buffer->orphaned)
+		atomic_long_sub(buffer->size, &heap->usage.orphaned);
+	mutex_unlock(&buffer->lock);
+
+	if (heap->flags & ION_HEAP_FLAG_DEFER_FREE)
+		ion_heap_freelist_add(heap, buffer);
+	else
+		ion_buffer_release(buffer);
 }
 
 static void ion_buffer_get(struct ion_buffer *buffer)
@@ -125,15 +254,80 @@ static struct ion_handle *ion_handle_create(struct ion_client *client,
 	ion_buffer_get(buffer);
 	handle->buffer = buffer;
 
+	atomic_long_add(buffer->size, &client->usage.allocated);
+	mutex_lock(&buffer->lock);
+	if (++buffer->handle_cnt == 2)
+		atomic_long_add(buffer->size, &buffer->heap->usage.shared);
+	if (buffer->orphaned) {
+		buffer->orphaned = false;
+		atomic_long_sub(buffer->size, &buffer->heap->usage.orphaned);
+	}
+	mutex_unlock(&buffer->lock);
+
 	return handle;
 }
 
+/*
+ * Account for a change of the handle's map counts.  Must be called with
+ * the client's lock and the buffer's lock held.
+ */
+static void ion_handle_update_mapped(struct ion_handle *handle)
+{
+	struct ion_buffer *buffer = handle->buffer;
+	struct ion_usage *heap_usage = &buffer->heap->usage;
+	struct ion_usage *client_usage = &handle->client->usage;
+	bool mapped = handle->kmap_cnt || handle->dmap_cnt ||
+		      handle->usermap_cnt;
+
+	if (mapped == handle->mapped)
+		return;
+	handle->mapped = mapped;
+
+	if (mapped) {
+		atomic_long_add(buffer->size, &client_usage->mapped);
+		if (buffer->mapped_handle_cnt++ == 0)
+			atomic_long_add(buffer->size, &heap_usage->mapped);
+	} else {
+		atomic_long_sub(buffer->size, &client_usage->mapped);
+		if (--buffer->mapped_handle_cnt == 0)
+			atomic_long_sub(buffer->size, &heap_usage->mapped);
+	}
+}
+
+/* drops the handle's share of the usage counters */
+static void ion_handle_unaccount(struct ion_handle *handle)
+{
+	struct ion_buffer *buffer = handle->buffer;
+	struct ion_client *client = handle->client;
+
+	atomic_long_sub(buffer->size, &client->usage.allocated);
+	if (handle->imported)
+		atomic_long_sub(buffer->size, &client->usage.shared);
+
+	mutex_lock(&buffer->lock);
+	if (handle->mapped) {
+		atomic_long_sub(buffer->size, &client->usage.mapped);
+		if (--buffer->mapped_handle_cnt == 0)
+			atomic_long_sub(buffer->size,
+					&buffer->heap->usage.mapped);
+	}
+	if (--buffer->handle_cnt == 1)
+		atomic_long_sub(buffer->size, &buffer->heap->usage.shared);
+	/* share fds or mappings still hold the buffer once we let go */
+	if (!buffer->handle_cnt && atomic_read(&buffer->ref.refcount) > 1) {
+		buffer->orphaned = true;
+		atomic_long_add(buffer->size, &buffer->heap->usage.orphaned);
+	}
+	mutex_unlock(&buffer->lock);
+}
+
 static void ion_handle_destroy(struct kref *kref)
 {
 	struct ion_handle *handle = container_of(kref, struct ion_handle, ref);
 	/* XXX Can a handle be destroyed while it's map count is non-zero?:
 	   if (handle->map_cnt) unmap
 	 */
+	ion_handle_unaccount(handle);
 	ion_buffer_put(handle->buffer);
 	mutex_lock(&handle->client->lock);
 	if (!RB_EMPTY_NODE(&handle->node))
@@ -284,6 +478,8 @@ struct ion_handle *ion_alloc(struct ion_client *client, size_t len,
 	mutex_lock(&client->lock);
 	ion_handle_add(client, handle);
 	mutex_unlock(&client->lock);
+	trace_ion_alloc(client->name, client->pid, buffer->heap->name, buffer,
+			len, flags);
 	return handle;
 
 end:
@@ -419,14 +615,23 @@ void *ion_map_kernel(struct ion_client *client, struct ion_handle *handle)
 		return ERR_PTR(-ENODEV);
 	}
 
-	if (_ion_map(&buffer->kmap_cnt, &handle->kmap_cnt)) {
+	if (_ion_map(&buffer->kmap_cnt, &handle->kmap_cnt) && !buffer->vaddr) {
 		vaddr = buffer->heap->ops->map_kernel(buffer->heap, buffer);
+		if (IS_ERR_OR_NULL(vaddr)) {
+			/* idle mappings may be what exhausted vmalloc space */
+			ion_device_unmap_idle(buffer->dev, LONG_MAX);
+			vaddr = buffer->heap->ops->map_kernel(buffer->heap,
+							      buffer);
+		}
 		if (IS_ERR_OR_NULL(vaddr))
 			_ion_unmap(&buffer->kmap_cnt, &handle->kmap_cnt);
-		buffer->vaddr = vaddr;
+		else
+			buffer->vaddr = vaddr;
 	} else {
 		vaddr = buffer->vaddr;
 	}
+	ion_buffer_update_mapping_lru(buffer);
+	ion_handle_update_mapped(handle);
 	mutex_unlock(&buffer->lock);
 	mutex_unlock(&client->lock);
 	return vaddr;
@@ -456,14 +661,17 @@ struct scatterlist *ion_map_dma(struct ion_client *client,
 		mutex_unlock(&client->lock);
 		return ERR_PTR(-ENODEV);
 	}
-	if (_ion_map(&buffer->dmap_cnt, &handle->dmap_cnt)) {
+	if (_ion_map(&buffer->dmap_cnt, &handle->dmap_cnt) && !buffer->sglist) {
 		sglist = buffer->heap->ops->map_dma(buffer->heap, buffer);
 		if (IS_ERR_OR_NULL(sglist))
 			_ion_unmap(&buffer->dmap_cnt, &handle->dmap_cnt);
-		buffer->sglist = sglist;
+		else
+			buffer->sglist = sglist;
 	} else {
 		sglist = buffer->sglist;
 	}
+	ion_buffer_update_mapping_lru(buffer);
+	ion_handle_update_mapped(handle);
 	mutex_unlock(&buffer->lock);
 	mutex_unlock(&client->lock);
 	return sglist;
@@ -477,10 +685,10 @@ void ion_unmap_kernel(struct ion_client *client, struct ion_handle *handle)
 	mutex_lock(&client->lock);
 	buffer = handle->buffer;
 	mutex_lock(&buffer->lock);
-	if (_ion_unmap(&buffer->kmap_cnt, &handle->kmap_cnt)) {
-		buffer->heap->ops->unmap_kernel(buffer->heap, buffer);
-		buffer->vaddr = NULL;
-	}
+	/* the mapping itself is kept around until the buffer goes idle */
+	if (_ion_unmap(&buffer->kmap_cnt, &handle->kmap_cnt))
+		ion_buffer_update_mapping_lru(buffer);
+	ion_handle_update_mapped(handle);
 	mutex_unlock(&buffer->lock);
 	mutex_unlock(&client->lock);
 }
@@ -493,10 +701,9 @@ void ion_unmap_dma(struct ion_client *client, struct ion_handle *handle)
 	mutex_lock(&client->lock);
 	buffer = handle->buffer;
 	mutex_lock(&buffer->lock);
-	if (_ion_unmap(&buffer->dmap_cnt, &handle->dmap_cnt)) {
-		buffer->heap->ops->unmap_dma(buffer->heap, buffer);
-		buffer->sglist = NULL;
-	}
+	if (_ion_unmap(&buffer->dmap_cnt, &handle->dmap_cnt))
+		ion_buffer_update_mapping_lru(buffer);
+	ion_handle_update_mapped(handle);
 	mutex_unlock(&buffer->lock);
 	mutex_unlock(&client->lock);
 }
@@ -539,6 +746,8 @@ struct ion_handle *ion_import(struct ion_client *client,
 	handle = ion_handle_create(client, buffer);
 	if (IS_ERR_OR_NULL(handle))
 		goto end;
+	handle->imported = true;
+	atomic_long_add(buffer->size, &client->usage.shared);
 	ion_handle_add(client, handle);
 end:
 	mutex_unlock(&client->lock);
@@ -597,6 +806,12 @@ static int ion_debug_client_show(struct seq_file *s, void *unused)
 		seq_printf(s, "%16.16s: %16u %d\n", names[i], sizes[i],
 			   atomic_read(&client->ref.refcount));
 	}
+	seq_printf(s, "%16.16s: %16lu\n", "allocated",
+		   atomic_long_read(&client->usage.allocated));
+	seq_printf(s, "%16.16s: %16lu\n", "mapped",
+		   atomic_long_read(&client->usage.mapped));
+	seq_printf(s, "%16.16s: %16lu\n", "shared",
+		   atomic_long_read(&client->usage.shared));
 	return 0;
 }
 
@@ -777,6 +992,19 @@ static int ion_share_release(struct inode *inode, struct file* file)
 	return 0;
 }
 
+static void ion_handle_usermap(struct ion_handle *handle, int delta)
+{
+	struct ion_client *client = handle->client;
+	struct ion_buffer *buffer = handle->buffer;
+
+	mutex_lock(&client->lock);
+	mutex_lock(&buffer->lock);
+	handle->usermap_cnt += delta;
+	ion_handle_update_mapped(handle);
+	mutex_unlock(&buffer->lock);
+	mutex_unlock(&client->lock);
+}
+
 static void ion_vma_open(struct vm_area_struct *vma)
 {
 
@@ -792,6 +1020,8 @@ static void ion_vma_open(struct vm_area_struct *vma)
 		vma->vm_private_data = NULL;
 		return;
 	}
+	if (handle)
+		ion_handle_usermap(handle, 1);
 	pr_debug("%s: %d client_cnt %d handle_cnt %d alloc_cnt %d\n",
 		 __func__, __LINE__,
 		 atomic_read(&client->ref.refcount),
@@ -815,6 +1045,7 @@ static void ion_vma_close(struct vm_area_struct *vma)
 		 atomic_read(&client->ref.refcount),
 		 atomic_read(&handle->ref.refcount),
 		 atomic_read(&buffer->ref.refcount));
+	ion_handle_usermap(handle, -1);
 	ion_handle_put(handle);
 	ion_client_put(client);
 	pr_debug("%s: %d client_cnt %d handle_cnt %d alloc_cnt %d\n",
@@ -884,6 +1115,7 @@ static int ion_share_mmap(struct file *file, struct vm_area_struct *vma)
 	/* move the handle into the vm_private_data so we can access it from
 	   vma_open/close */
 	vma->vm_private_data = handle;
+	ion_handle_usermap(handle, 1);
 	pr_debug("%s: %d client_cnt %d handle_cnt %d alloc_cnt %d\n",
 		 __func__, __LINE__,
 		 atomic_read(&client->ref.refcount),
@@ -954,12 +1186,115 @@ static int ion_inval_cached(struct ion_handle *handle, size_t size,
 	return 0;
 }
 
+static int ion_sync_cached(struct ion_client *client,
+			   struct ion_sync_data *data)
+{
+	struct ion_buffer *buffer;
+	enum cache_operation op;
+	int ret;
+
+	switch (data->op) {
+	case ION_SYNC_CLEAN:
+		op = CACHE_CLEAN;
+		break;
+	case ION_SYNC_INVALIDATE:
+		op = CACHE_INVALIDATE;
+		break;
+	case ION_SYNC_FLUSH:
+		op = CACHE_FLUSH;
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	mutex_lock(&client->lock);
+	if (!ion_handle_validate(client, data->handle)) {
+		pr_err("%s: invalid handle passed to sync ioctl.\n", __func__);
+		mutex_unlock(&client->lock);
+		return -EINVAL;
+	}
+	buffer = data->handle->buffer;
+	ion_buffer_get(buffer);
+	mutex_unlock(&client->lock);
+
+	if (!data->len && data->offset < buffer->size)
+		data->len = buffer->size - data->offset;
+	if (data->offset >= buffer->size ||
+	    data->len > buffer->size - data->offset) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	if (!buffer->heap->ops->sync) {
+		pr_err("%s: this heap does not define a method for syncing\n",
+		       __func__);
+		ret = -ENODEV;
+		goto out;
+	}
+
+	ret = buffer->heap->ops->sync(buffer->heap, buffer, data->offset,
+				      data->len, op);
+out:
+	ion_buffer_put(buffer);
+	return ret;
+}
+
 static const struct file_operations ion_share_fops = {
 	.owner		= THIS_MODULE,
 	.release	= ion_share_release,
 	.mmap		= ion_share_mmap,
 };
 
+static int ion_ioctl_usage(struct ion_client *client,
+			   struct ion_usage_data *data)
+{
+	struct ion_device *dev = client->dev;
+	struct ion_heap_usage_data *usage = NULL;
+	unsigned int num_heaps = 0, n = 0;
+	struct rb_node *node;
+	int ret = 0;
+
+	data->allocated = atomic_long_read(&client->usage.allocated);
+	data->mapped = atomic_long_read(&client->usage.mapped);
+	data->shared = atomic_long_read(&client->usage.shared);
+
+	read_lock(&dev->heap_lock);
+	for (node = rb_first(&dev->heaps); node; node = rb_next(node))
+		num_heaps++;
+	read_unlock(&dev->heap_lock);
+
+	n = min(data->num_heaps, num_heaps);
+	data->num_heaps = num_heaps;
+	if (!n)
+		return 0;
+
+	usage = kcalloc(n, sizeof(*usage), GFP_KERNEL);
+	if (!usage)
+		return -ENOMEM;
+
+	/* heaps are only ever added, so the first n are still there */
+	read_lock(&dev->heap_lock);
+	for (node = rb_first(&dev->heaps), num_heaps = 0; num_heaps < n;
+	     node = rb_next(node), num_heaps++) {
+		struct ion_heap *heap = rb_entry(node, struct ion_heap, node);
+		struct ion_heap_usage_data *u = &usage[num_heaps];
+
+		u->id = heap->id;
+		u->type = heap->type;
+		u->allocated = atomic_long_read(&heap->usage.allocated);
+		u->mapped = atomic_long_read(&heap->usage.mapped);
+		u->shared = atomic_long_read(&heap->usage.shared);
+		u->orphaned = atomic_long_read(&heap->usage.orphaned);
+	}
+	read_unlock(&dev->heap_lock);
+
+	if (copy_to_user((void __user *)data->heaps, usage,
+			 n * sizeof(*usage)))
+		ret = -EFAULT;
+	kfree(usage);
+	return ret;
+}
+
 static int ion_ioctl_share(struct file *parent, struct ion_client *client,
 			   struct ion_handle *handle)
 {
@@ -1113,6 +1448,30 @@ static long ion_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 		break;
 	}
 
+	case ION_IOC_SYNC:
+	{
+		struct ion_sync_data data;
+
+		if (copy_from_user(&data, (void __user *)arg, sizeof(data)))
+			return -EFAULT;
+		return ion_sync_cached(client, &data);
+	}
+
+	case ION_IOC_USAGE:
+	{
+		struct ion_usage_data data;
+		int ret;
+
+		if (copy_from_user(&data, (void __user *)arg, sizeof(data)))
+			return -EFAULT;
+		ret = ion_ioctl_usage(client, &data);
+		if (ret)
+			return ret;
+		if (copy_to_user((void __user *)arg, &data, sizeof(data)))
+			return -EFAULT;
+		break;
+	}
+
 	default:
 		return -ENOTTY;
 	}
@@ -1235,8 +1594,14 @@ void ion_device_add_heap(struct ion_device *dev, struct ion_heap *heap)
 		}
 	}
 
+	if ((heap->flags & ION_HEAP_FLAG_DEFER_FREE) &&
+	    ion_heap_init_deferred_free(heap))
+		heap->flags &= ~ION_HEAP_FLAG_DEFER_FREE;
+
+	write_lock(&dev->heap_lock);
 	rb_link_node(&heap->node, parent, p);
 	rb_insert_color(&heap->node, &dev->heaps);
+	write_unlock(&dev->heap_lock);
 	debugfs_create_file(heap->name, 0664, dev->debug_root, heap,
 			    &debug_heap_fops);
 end:
@@ -1273,13 +1638,20 @@ struct ion_device *ion_device_create(long (*custom_ioctl)
 	idev->buffers = RB_ROOT;
 	mutex_init(&idev->lock);
 	idev->heaps = RB_ROOT;
+	rwlock_init(&idev->heap_lock);
 	idev->user_clients = RB_ROOT;
 	idev->kernel_clients = RB_ROOT;
+	INIT_LIST_HEAD(&idev->mapping_lru);
+	spin_lock_init(&idev->mapping_lock);
+	idev->mapping_shrinker.shrink = ion_mapping_shrink;
+	idev->mapping_shrinker.seeks = DEFAULT_SEEKS;
+	register_shrinker(&idev->mapping_shrinker);
 	return idev;
 }
 
 void ion_device_destroy(struct ion_device *dev)
 {
+	unregister_shrinker(&dev->mapping_shrinker);
 	misc_deregister(&dev->dev);
 	/* XXX need to free the heaps and clients ? */
 	kfree(dev);
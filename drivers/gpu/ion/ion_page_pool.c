@@ -0,0 +1,186 @@
+/*
+ * drivers/gpu/ion/ion_page_pool.c
+ *
+ * Copyright (C) 2011 Google, Inc.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#include <linux/highmem.h>
+#include <linux/list.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/workqueue.h>
+#include "ion_priv.h"
+
+/*
+ * Every item in a pool is a chunk of 1 << pool->order physically contiguous
+ * pages.  Chunks are split with split_page() as soon as they come out of the
+ * page allocator so each page can be mapped and refcounted on its own; the
+ * first page stands for the whole chunk and links it into the pool through
+ * its lru field.
+ */
+
+static struct page *ion_page_pool_alloc_pages(struct ion_page_pool *pool)
+{
+	struct page *page = alloc_pages(pool->gfp_mask, pool->order);
+
+	if (!page)
+		return NULL;
+	if (pool->order)
+		split_page(page, pool->order);
+	return page;
+}
+
+static void ion_page_pool_free_pages(struct ion_page_pool *pool,
+				     struct page *page)
+{
+	int i;
+
+	for (i = 0; i < (1 << pool->order); i++)
+		__free_page(page + i);
+}
+
+static void ion_page_pool_zero(struct ion_page_pool *pool, struct page *page)
+{
+	int i;
+
+	for (i = 0; i < (1 << pool->order); i++)
+		clear_highpage(page + i);
+}
+
+static struct page *ion_page_pool_remove(struct ion_page_pool *pool,
+					 bool clean)
+{
+	struct list_head *list = clean ? &pool->clean_items : &pool->dirty_items;
+	struct page *page;
+
+	if (list_empty(list))
+		return NULL;
+
+	page = list_first_entry(list, struct page, lru);
+	list_del(&page->lru);
+	if (clean)
+		pool->clean_count--;
+	else
+		pool->dirty_count--;
+	return page;
+}
+
+/*
+ * Zero the chunks handed back by ion_page_pool_free in the background so
+ * that the next allocation does not have to.  The lock is dropped while a
+ * chunk is being cleared; allocators racing with us simply take a dirty
+ * chunk and clear it themselves.
+ */
+static void ion_page_pool_zero_work(struct work_struct *work)
+{
+	struct ion_page_pool *pool = container_of(work, struct ion_page_pool,
+						  zero_work);
+	struct page *page;
+
+	for (;;) {
+		mutex_lock(&pool->lock);
+		page = ion_page_pool_remove(pool, false);
+		mutex_unlock(&pool->lock);
+		if (!page)
+			break;
+
+		ion_page_pool_zero(pool, page);
+
+		mutex_lock(&pool->lock);
+		list_add_tail(&page->lru, &pool->clean_items);
+		pool->clean_count++;
+		mutex_unlock(&pool->lock);
+		cond_resched();
+	}
+}
+
+struct page *ion_page_pool_alloc(struct ion_page_pool *pool)
+{
+	struct page *page;
+	bool clean = true;
+
+	mutex_lock(&pool->lock);
+	page = ion_page_pool_remove(pool, true);
+	if (!page) {
+		page = ion_page_pool_remove(pool, false);
+		clean = false;
+	}
+	mutex_unlock(&pool->lock);
+
+	if (!page)
+		return ion_page_pool_alloc_pages(pool);
+	if (!clean)
+		ion_page_pool_zero(pool, page);
+	return page;
+}
+
+void ion_page_pool_free(struct ion_page_pool *pool, struct page *page)
+{
+	mutex_lock(&pool->lock);
+	list_add_tail(&page->lru, &pool->dirty_items);
+	pool->dirty_count++;
+	mutex_unlock(&pool->lock);
+
+	schedule_work(&pool->zero_work);
+}
+
+int ion_page_pool_shrink(struct ion_page_pool *pool, gfp_t gfp_mask,
+			 int nr_to_scan)
+{
+	struct page *page;
+	int freed = 0;
+
+	if (!nr_to_scan)
+		return (pool->clean_count + pool->dirty_count) << pool->order;
+
+	while (freed < nr_to_scan) {
+		mutex_lock(&pool->lock);
+		/* give back what still needs zeroing before what does not */
+		page = ion_page_pool_remove(pool, false);
+		if (!page)
+			page = ion_page_pool_remove(pool, true);
+		mutex_unlock(&pool->lock);
+		if (!page)
+			break;
+
+		ion_page_pool_free_pages(pool, page);
+		freed += 1 << pool->order;
+	}
+
+	return freed;
+}
+
+struct ion_page_pool *ion_page_pool_create(gfp_t gfp_mask, unsigned int order)
+{
+	struct ion_page_pool *pool;
+
+	pool = kzalloc(sizeof(struct ion_page_pool), GFP_KERNEL);
+	if (!pool)
+		return NULL;
+
+	INIT_LIST_HEAD(&pool->clean_items);
+	INIT_LIST_HEAD(&pool->dirty_items);
+	mutex_init(&pool->lock);
+	INIT_WORK(&pool->zero_work, ion_page_pool_zero_work);
+	pool->gfp_mask = gfp_mask;
+	pool->order = order;
+	return pool;
+}
+
+void ion_page_pool_destroy(struct ion_page_pool *pool)
+{
+	cancel_work_sync(&pool->zero_work);
+	ion_page_pool_shrink(pool, GFP_KERNEL, INT_MAX);
+	kfree(pool);
+}
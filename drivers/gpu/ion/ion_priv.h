@@ -18,14 +18,39 @@
 #define _ION_PRIV_H
 
 #include <linux/kref.h>
+#include <linux/mm.h>
 #include <linux/mm_types.h>
 #include <linux/mutex.h>
 #include <linux/rbtree.h>
+#include <linux/sched.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
 #include <linux/ion.h>
 #include <linux/miscdevice.h>
+#include <linux/workqueue.h>
 
 struct ion_mapping;
 
+/**
+ * struct ion_usage - byte counters kept for heaps and clients
+ * @allocated:		bytes of buffers allocated from a heap, or bytes of
+ *			buffers a client holds handles to
+ * @mapped:		bytes of buffers mapped by at least one handle, or
+ *			by one of the client's handles
+ * @shared:		bytes of buffers with more than one handle, or bytes
+ *			a client imported rather than allocated
+ * @orphaned:		bytes of buffers with no handle left (heaps only)
+ *
+ * Updated as the state of buffers and handles changes, so reading them
+ * needs no lock; see ION_IOC_USAGE.
+ */
+struct ion_usage {
+	atomic_long_t allocated;
+	atomic_long_t mapped;
+	atomic_long_t shared;
+	atomic_long_t orphaned;
+};
+
 struct ion_dma_mapping {
 	struct kref ref;
 	struct scatterlist *sglist;
@@ -42,18 +67,29 @@ struct ion_kernel_mapping {
  * @buffers:	an rb tree of all the existing buffers
  * @lock:		lock protecting the buffers & heaps trees
  * @heaps:		list of all the heaps in the system
+ * @heap_lock:		protects @heaps against ion_device_add_heap for
+ *			readers that must not wait on @lock
  * @user_clients:	list of all the clients created from userspace
+ * @mapping_lru:	buffers holding kernel or dma mappings nobody uses
+ * @mapping_lru_pages:	number of pages of the buffers on @mapping_lru
+ * @mapping_lock:	protects @mapping_lru and @mapping_lru_pages
+ * @mapping_shrinker:	tears down the mappings on @mapping_lru
  */
 struct ion_device {
 	struct miscdevice dev;
 	struct rb_root buffers;
 	struct mutex lock;
 	struct rb_root heaps;
+	rwlock_t heap_lock;
 	long (*custom_ioctl) (struct ion_client *client, unsigned int cmd,
 			      unsigned long arg);
 	struct rb_root user_clients;
 	struct rb_root kernel_clients;
 	struct dentry *debug_root;
+	struct list_head mapping_lru;
+	unsigned long mapping_lru_pages;
+	spinlock_t mapping_lock;
+	struct shrinker mapping_shrinker;
 };
 
 /**
@@ -66,6 +102,7 @@ struct ion_device {
  * @heap_mask:		mask of all supported heaps
  * @name:		used for debugging
  * @task:		used for debugging
+ * @usage:		usage counters of the client
  *
  * A client represents a list of buffers this client may access.
  * The mutex stored here is used to protect both handles tree
@@ -82,6 +119,7 @@ struct ion_client {
 	struct task_struct *task;
 	pid_t pid;
 	struct dentry *debug_root;
+	struct ion_usage usage;
 };
 
 /**
@@ -93,6 +131,8 @@ struct ion_client {
  * @kmap_cnt:		count of times this client has mapped to kernel
  * @dmap_cnt:		count of times this client has mapped for dma
  * @usermap_cnt:	count of times this client has mapped for userspace
+ * @mapped:		any of the map counts is non zero, for accounting
+ * @imported:		handle was created by ion_import, for accounting
  *
  * Modifications to node, map_cnt or mapping should be protected by the
  * lock in the client.  Other fields are never changed after initialization.
@@ -105,6 +145,8 @@ struct ion_handle {
 	unsigned int kmap_cnt;
 	unsigned int dmap_cnt;
 	unsigned int usermap_cnt;
+	bool mapped;
+	bool imported;
 };
 
 struct ion_buffer *ion_handle_buffer(struct ion_handle *handle);
@@ -113,6 +155,7 @@ struct ion_buffer *ion_handle_buffer(struct ion_handle *handle);
  * struct ion_buffer - metadata for a particular buffer
  * @ref:		refernce count
  * @node:		node in the ion_device buffers tree
+ * @list:		entry in the heap's deferred free list
  * @dev:		back pointer to the ion_device
  * @heap:		back pointer to the heap the buffer came from
  * @flags:		buffer specific flags
@@ -126,10 +169,20 @@ struct ion_buffer *ion_handle_buffer(struct ion_handle *handle);
  * @vaddr:		the kenrel mapping if kmap_cnt is not zero
  * @dmap_cnt:		number of times the buffer is mapped for dma
  * @sglist:		the scatterlist for the buffer is dmap_cnt is not zero
+ * @mapping_lru:	entry in the device's mapping_lru while @vaddr or
+ *			@sglist is set with the matching count at zero
+ * @handle_cnt:		number of handles to the buffer, in any client
+ * @mapped_handle_cnt:	number of those handles that map the buffer
+ * @orphaned:		the buffer outlived its last handle
+ *
+ * Kernel and dma mappings are not torn down when their count drops to
+ * zero; they are kept for the next user until the buffer is freed or
+ * the device's mapping shrinker reclaims them.
 */
 struct ion_buffer {
 	struct kref ref;
 	struct rb_node node;
+	struct list_head list;
 	struct ion_device *dev;
 	struct ion_heap *heap;
 	unsigned long flags;
@@ -143,9 +196,21 @@ struct ion_buffer {
 	void *vaddr;
 	int dmap_cnt;
 	struct scatterlist *sglist;
+	struct list_head mapping_lru;
+	int handle_cnt;
+	int mapped_handle_cnt;
+	bool orphaned;
 	bool cached;
 };
 
+void ion_buffer_release(struct ion_buffer *buffer);
+
+enum cache_operation {
+	CACHE_CLEAN		= 0x0,
+	CACHE_INVALIDATE	= 0x1,
+	CACHE_FLUSH		= 0x2,
+};
+
 /**
  * struct ion_heap_ops - ops to operate on a given heap
  * @allocate:		allocate memory
@@ -159,6 +224,8 @@ struct ion_buffer {
  * @map_user		map memory to userspace
  * @flush_user		flush memory if mapped as cacheable
  * @inval_user		invalidate memory if mapped as cacheable
+ * @sync		clean and/or invalidate a range of the buffer given
+ *			by offset, independent of any mapping
  */
 struct ion_heap_ops {
 	int (*allocate) (struct ion_heap *heap,
@@ -178,6 +245,8 @@ struct ion_heap_ops {
 			unsigned long vaddr);
 	int (*inval_user) (struct ion_buffer *buffer, size_t len,
 			unsigned long vaddr);
+	int (*sync) (struct ion_heap *heap, struct ion_buffer *buffer,
+		     size_t offset, size_t len, enum cache_operation op);
 };
 
 /**
@@ -190,6 +259,13 @@ struct ion_heap_ops {
  *			allocating.  These are specified by platform data and
  *			MUST be unique
  * @name:		used for debugging
+ * @flags:		ION_HEAP_FLAG_* flags, set by the heap's create function
+ * @free_list:		buffers waiting to be freed by @task
+ * @free_list_size:	total size of the buffers on @free_list, in bytes
+ * @free_lock:		protects @free_list and @free_list_size
+ * @waitqueue:		wakes @task when buffers are added to @free_list
+ * @task:		low priority thread tearing down deferred buffers
+ * @usage:		usage counters of the heap
  *
  * Represents a pool of memory from which buffers can be made.  In some
  * systems the only heap is regular system memory allocated via vmalloc.
@@ -203,8 +279,65 @@ struct ion_heap {
 	struct ion_heap_ops *ops;
 	int id;
 	const char *name;
+	unsigned long flags;
+	struct list_head free_list;
+	size_t free_list_size;
+	spinlock_t free_lock;
+	wait_queue_head_t waitqueue;
+	struct task_struct *task;
+	struct ion_usage usage;
 };
 
+/*
+ * Buffers released from a heap with this flag set are not freed in the
+ * context of the last ion_buffer_put but queued on the heap's free list
+ * and torn down by a SCHED_IDLE kernel thread.  A heap setting it must
+ * call ion_heap_freelist_init from its create function; the flag is
+ * cleared again if the thread cannot be started.
+ */
+#define ION_HEAP_FLAG_DEFER_FREE	(1 << 0)
+
+/**
+ * ion_heap_freelist_init - set up the deferred free list of a heap
+ * @heap:		the heap
+ *
+ * called by the heap's create function, before anything that may use the
+ * free list, such as the heap's shrinker, can run
+ */
+void ion_heap_freelist_init(struct ion_heap *heap);
+
+/**
+ * ion_heap_init_deferred_free - start the deferred free thread of a heap
+ * @heap:		the heap
+ *
+ * called by ion_device_add_heap for heaps with ION_HEAP_FLAG_DEFER_FREE
+ */
+int ion_heap_init_deferred_free(struct ion_heap *heap);
+
+/**
+ * ion_heap_freelist_add - queue a buffer for deferred freeing
+ * @heap:		the heap
+ * @buffer:		the buffer, no longer reachable from anywhere else
+ */
+void ion_heap_freelist_add(struct ion_heap *heap, struct ion_buffer *buffer);
+
+/**
+ * ion_heap_freelist_drain - free buffers queued for deferred freeing
+ * @heap:		the heap
+ * @size:		number of bytes to free, or 0 to empty the free list
+ *
+ * frees queued buffers synchronously, oldest first, until at least @size
+ * bytes have been released.  Meant to be called from the heap's shrinker.
+ * returns the number of bytes freed
+ */
+size_t ion_heap_freelist_drain(struct ion_heap *heap, size_t size);
+
+/**
+ * ion_heap_freelist_size - bytes waiting on the deferred free list
+ * @heap:		the heap
+ */
+size_t ion_heap_freelist_size(struct ion_heap *heap);
+
 /**
  * ion_device_create - allocates and returns an ion device
  * @custom_ioctl:	arch specific ioctl function if applicable
@@ -260,6 +393,50 @@ void ion_carveout_free(struct ion_heap *heap, ion_phys_addr_t addr,
  */
 #define ION_CARVEOUT_ALLOCATE_FAIL -1
 
+/**
+ * struct ion_page_pool - pool of zeroed chunks for a heap to allocate from
+ * @clean_count:	number of chunks on clean_items
+ * @dirty_count:	number of chunks on dirty_items
+ * @clean_items:	chunks that are ready to be handed out
+ * @dirty_items:	chunks freed back to the pool, not yet zeroed
+ * @lock:		protects the lists and counts
+ * @gfp_mask:		gfp mask used to refill the pool from the page allocator
+ * @order:		order of the chunks in this pool
+ * @zero_work:		zeroes dirty_items in the background
+ *
+ * Allocations are served from clean_items first, then from dirty_items
+ * (zeroed inline) and only then from the page allocator.  Freed chunks
+ * are queued on dirty_items and zeroed by zero_work.  Pools never give
+ * memory back on their own; the heap owning them is expected to call
+ * ion_page_pool_shrink from a shrinker.
+ */
+struct ion_page_pool {
+	int clean_count;
+	int dirty_count;
+	struct list_head clean_items;
+	struct list_head dirty_items;
+	struct mutex lock;
+	gfp_t gfp_mask;
+	unsigned int order;
+	struct work_struct zero_work;
+};
+
+struct ion_page_pool *ion_page_pool_create(gfp_t gfp_mask, unsigned int order);
+void ion_page_pool_destroy(struct ion_page_pool *);
+struct page *ion_page_pool_alloc(struct ion_page_pool *);
+void ion_page_pool_free(struct ion_page_pool *, struct page *);
+/**
+ * ion_page_pool_shrink - give pages in the pool back to the system
+ * @pool:		the pool
+ * @gfp_mask:		the mask of the allocation that triggered the shrink
+ * @nr_to_scan:		number of pages to free, or 0 to query
+ *
+ * returns the number of pages freed, or the number of pages held by the
+ * pool if @nr_to_scan is 0
+ */
+int ion_page_pool_shrink(struct ion_page_pool *pool, gfp_t gfp_mask,
+			 int nr_to_scan);
+
 /**
  * Flushing entire cache is more efficient than flushing virtual address
  * range of a buffer whose size is 200Kbytes or higher, since line by
@@ -267,10 +444,4 @@ void ion_carveout_free(struct ion_heap *heap, ion_phys_addr_t addr,
  */
 #define FULL_CACHE_FLUSH_THRESHOLD 200000
 
-enum cache_operation {
-	CACHE_CLEAN		= 0x0,
-	CACHE_INVALIDATE	= 0x1,
-	CACHE_FLUSH		= 0x2,
-};
-
 #endif /* _ION_PRIV_H */
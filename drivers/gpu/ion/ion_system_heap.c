@@ -14,7 +14,9 @@
  *
  */
 
+#include <linux/dma-mapping.h>
 #include <linux/err.h>
+#include <linux/highmem.h>
 #include <linux/ion.h>
 #include <linux/mm.h>
 #include <linux/scatterlist.h>
@@ -22,64 +24,175 @@
 #include <linux/vmalloc.h>
 #include "ion_priv.h"
 
+/*
+ * Buffers are built from the largest chunks that fit, 1M and 64K where
+ * the page allocator can provide them cheaply and single pages otherwise.
+ */
+static const unsigned int orders[] = {8, 4, 0};
+#define NUM_ORDERS ARRAY_SIZE(orders)
+
+static const gfp_t high_order_gfp_flags = (GFP_HIGHUSER | __GFP_ZERO |
+					   __GFP_NOWARN | __GFP_NORETRY) &
+					  ~__GFP_WAIT;
+static const gfp_t low_order_gfp_flags  = GFP_HIGHUSER | __GFP_ZERO |
+					  __GFP_NOWARN;
+
+struct ion_system_heap {
+	struct ion_heap heap;
+	struct ion_page_pool *pools[NUM_ORDERS];
+	struct shrinker shrinker;
+};
+
+/**
+ * struct ion_system_buffer_info - backing store of a system heap buffer
+ * @pages:		every page of the buffer, for mapping
+ * @chunks:		list of the chunks the pages came from; each chunk is
+ *			linked through the lru field of its first page, which
+ *			also holds the chunk order in page_private
+ * @nr_chunks:		number of entries on @chunks
+ * @writecombine:	allocated with ION_FLAG_WRITECOMBINE
+ */
+struct ion_system_buffer_info {
+	struct page **pages;
+	struct list_head chunks;
+	int nr_chunks;
+	bool writecombine;
+};
+
+static int order_to_index(unsigned int order)
+{
+	int i;
+
+	for (i = 0; i < NUM_ORDERS; i++)
+		if (order == orders[i])
+			return i;
+	BUG();
+	return -1;
+}
+
+static inline unsigned long order_to_size(unsigned int order)
+{
+	return PAGE_SIZE << order;
+}
+
+static struct page *alloc_largest_available(struct ion_system_heap *heap,
+					    unsigned long size,
+					    unsigned int max_order)
+{
+	struct page *page;
+	int i;
+
+	for (i = 0; i < NUM_ORDERS; i++) {
+		if (size < order_to_size(orders[i]))
+			continue;
+		if (max_order < orders[i])
+			continue;
+
+		page = ion_page_pool_alloc(heap->pools[i]);
+		if (!page)
+			continue;
+		set_page_private(page, orders[i]);
+		return page;
+	}
+	return NULL;
+}
+
+static void free_chunk(struct ion_system_heap *heap, struct page *page)
+{
+	unsigned int order = page_private(page);
+
+	set_page_private(page, 0);
+	ion_page_pool_free(heap->pools[order_to_index(order)], page);
+}
+
 static int ion_system_heap_allocate(struct ion_heap *heap,
 				    struct ion_buffer *buffer,
 				    unsigned long size, unsigned long align,
 				    unsigned long flags)
 {
+	struct ion_system_heap *sys_heap = container_of(heap,
+							struct ion_system_heap,
+							heap);
 	int n_pages = PAGE_ALIGN(size) / PAGE_SIZE;
-	struct page **page_list;
-	const int gfp_mask = GFP_KERNEL | __GFP_HIGHMEM | __GFP_ZERO;
+	unsigned long size_remaining = PAGE_ALIGN(size);
+	unsigned int max_order = orders[0];
+	struct ion_system_buffer_info *info;
+	struct page *page, *tmp;
 	int i = 0;
 
-	page_list = kmalloc(n_pages * sizeof(void *), GFP_KERNEL);
-
-	for (i = 0; i < n_pages; i++) {
-		page_list[i] = alloc_page(gfp_mask);
-		if (page_list[i] == NULL)
-			goto out;
+	info = kzalloc(sizeof(struct ion_system_buffer_info), GFP_KERNEL);
+	if (!info)
+		return -ENOMEM;
+	INIT_LIST_HEAD(&info->chunks);
+	info->writecombine = !!(flags & ION_FLAG_WRITECOMBINE);
+
+	info->pages = kmalloc(n_pages * sizeof(void *), GFP_KERNEL);
+	if (!info->pages)
+		goto err;
+
+	while (size_remaining > 0) {
+		int j;
+
+		page = alloc_largest_available(sys_heap, size_remaining,
+					       max_order);
+		if (!page)
+			goto err;
+		list_add_tail(&page->lru, &info->chunks);
+		info->nr_chunks++;
+		/* don't retry orders that have already failed us */
+		max_order = page_private(page);
+
+		for (j = 0; j < (1 << max_order); j++)
+			info->pages[i++] = page + j;
+		size_remaining -= order_to_size(max_order);
 	}
 
-	buffer->priv_virt = page_list;
+	buffer->priv_virt = info;
 	return 0;
 
-out:
-	/* failed on i, so go to i-1 */
-	i--;
-
-	for (; i >= 0; i--)
-		__free_page(page_list[i]);
-
-	kfree(page_list);
+err:
+	list_for_each_entry_safe(page, tmp, &info->chunks, lru) {
+		list_del(&page->lru);
+		free_chunk(sys_heap, page);
+	}
+	kfree(info->pages);
+	kfree(info);
 	return -ENOMEM;
 }
 
 void ion_system_heap_free(struct ion_buffer *buffer)
 {
-	int i;
-	int n_pages = PAGE_ALIGN(buffer->size) / PAGE_SIZE;
-	struct page **page_list = (struct page **)buffer->priv_virt;
-
-	for (i = 0; i < n_pages; i++)
-		__free_page(page_list[i]);
-	kfree(page_list);
+	struct ion_system_heap *sys_heap = container_of(buffer->heap,
+							struct ion_system_heap,
+							heap);
+	struct ion_system_buffer_info *info = buffer->priv_virt;
+	struct page *page, *tmp;
+
+	list_for_each_entry_safe(page, tmp, &info->chunks, lru) {
+		list_del(&page->lru);
+		free_chunk(sys_heap, page);
+	}
+	kfree(info->pages);
+	kfree(info);
 }
 
 struct scatterlist *ion_system_heap_map_dma(struct ion_heap *heap,
 					    struct ion_buffer *buffer)
 {
-	struct scatterlist *sglist;
-	struct page **page_list = (struct page **)buffer->priv_virt;
-	int i;
-	int n_pages = PAGE_ALIGN(buffer->size) / PAGE_SIZE;
+	struct ion_system_buffer_info *info = buffer->priv_virt;
+	struct scatterlist *sglist, *sg;
+	struct page *page;
 
-	sglist = vmalloc(n_pages * sizeof(struct scatterlist));
+	sglist = vmalloc(info->nr_chunks * sizeof(struct scatterlist));
 	if (!sglist)
 		return ERR_PTR(-ENOMEM);
-	memset(sglist, 0, n_pages * sizeof(struct scatterlist));
-	sg_init_table(sglist, n_pages);
-	for (i = 0; i < n_pages; i++)
-		sg_set_page(&sglist[i], page_list[i], PAGE_SIZE, 0);
+	memset(sglist, 0, info->nr_chunks * sizeof(struct scatterlist));
+	sg_init_table(sglist, info->nr_chunks);
+	sg = sglist;
+	list_for_each_entry(page, &info->chunks, lru) {
+		sg_set_page(sg, page, order_to_size(page_private(page)), 0);
+		sg = sg_next(sg);
+	}
 	/* XXX do cache maintenance for dma? */
 	return sglist;
 }
@@ -94,10 +207,10 @@ void ion_system_heap_unmap_dma(struct ion_heap *heap, struct ion_buffer *buffer)
 void *ion_system_heap_map_kernel(struct ion_heap *heap,
 				 struct ion_buffer *buffer)
 {
+	struct ion_system_buffer_info *info = buffer->priv_virt;
 	int n_pages = PAGE_ALIGN(buffer->size) / PAGE_SIZE;
-	struct page **page_list = (struct page **)buffer->priv_virt;
 
-	return vm_map_ram(page_list, n_pages, -1, PAGE_KERNEL);
+	return vm_map_ram(info->pages, n_pages, -1, PAGE_KERNEL);
 }
 
 void ion_system_heap_unmap_kernel(struct ion_heap *heap,
@@ -114,14 +227,22 @@ int ion_system_heap_map_user(struct ion_heap *heap, struct ion_buffer *buffer,
 	unsigned long uaddr = vma->vm_start;
 	unsigned long usize = vma->vm_end - vma->vm_start;
 	int n_pages = PAGE_ALIGN(buffer->size) / PAGE_SIZE;
-	struct page **page_list = (struct page **)buffer->priv_virt;
+	struct ion_system_buffer_info *info = buffer->priv_virt;
+	struct page **page_list = info->pages;
 	int i;
 
 	if (usize /* + pgoff << PAGE_SHIFT */  > (n_pages << PAGE_SHIFT))
 		return -EINVAL;
 
-	i = 0;
-	do {
+	/*
+	 * Mappings are cacheable, as they always were, and need ION_IOC_SYNC
+	 * around device access; write-combining has to be asked for.
+	 */
+	if (info->writecombine)
+		vma->vm_page_prot = pgprot_writecombine(vma->vm_page_prot);
+
+	/* each user page maps the buffer page at the same offset */
+	for (i = 0; usize > 0; i++) {
 		int ret;
 
 		ret = vm_insert_page(vma, uaddr, page_list[i]);
@@ -130,13 +251,57 @@ int ion_system_heap_map_user(struct ion_heap *heap, struct ion_buffer *buffer,
 
 		uaddr += PAGE_SIZE;
 		usize -= PAGE_SIZE;
-	} while (usize > 0);
+	}
 
 	vma->vm_flags |= VM_RESERVED;
 
 	return 0;
 }
 
+int ion_system_heap_sync(struct ion_heap *heap, struct ion_buffer *buffer,
+			 size_t offset, size_t len, enum cache_operation op)
+{
+	struct ion_system_buffer_info *info = buffer->priv_virt;
+	size_t chunk_start = 0, end = offset + len;
+	struct scatterlist sg;
+	struct page *page;
+
+	list_for_each_entry(page, &info->chunks, lru) {
+		size_t chunk_len = order_to_size(page_private(page));
+		size_t start_in_chunk, end_in_chunk;
+
+		if (chunk_start >= end)
+			break;
+		if (chunk_start + chunk_len <= offset) {
+			chunk_start += chunk_len;
+			continue;
+		}
+
+		start_in_chunk = max(offset, chunk_start) - chunk_start;
+		end_in_chunk = min(end, chunk_start + chunk_len) - chunk_start;
+		sg_init_table(&sg, 1);
+		sg_set_page(&sg, page, end_in_chunk - start_in_chunk,
+			    start_in_chunk);
+
+		switch (op) {
+		case CACHE_CLEAN:
+			dma_sync_sg_for_device(NULL, &sg, 1, DMA_TO_DEVICE);
+			break;
+		case CACHE_INVALIDATE:
+			dma_sync_sg_for_cpu(NULL, &sg, 1, DMA_FROM_DEVICE);
+			break;
+		case CACHE_FLUSH:
+			/* BIDIRECTIONAL for_device only cleans on ARMv7 */
+			dma_sync_sg_for_device(NULL, &sg, 1, DMA_TO_DEVICE);
+			dma_sync_sg_for_cpu(NULL, &sg, 1, DMA_FROM_DEVICE);
+			break;
+		}
+		chunk_start += chunk_len;
+	}
+
+	return 0;
+}
+
 static struct ion_heap_ops vmalloc_ops = {
 	.allocate = ion_system_heap_allocate,
 	.free = ion_system_heap_free,
@@ -145,23 +310,87 @@ static struct ion_heap_ops vmalloc_ops = {
 	.map_kernel = ion_system_heap_map_kernel,
 	.unmap_kernel = ion_system_heap_unmap_kernel,
 	.map_user = ion_system_heap_map_user,
+	.sync = ion_system_heap_sync,
 };
 
+static int ion_system_heap_shrink(struct shrinker *shrinker,
+				  struct shrink_control *sc)
+{
+	struct ion_system_heap *sys_heap = container_of(shrinker,
+							struct ion_system_heap,
+							shrinker);
+	/* ion_device_add_heap clears the flag if it cannot start the thread */
+	bool defer = ACCESS_ONCE(sys_heap->heap.flags) &
+		ION_HEAP_FLAG_DEFER_FREE;
+	int nr_to_scan = sc->nr_to_scan;
+	int nr_total = 0;
+	int i;
+
+	/* buffers still queued for freeing only turn into pool pages */
+	if (nr_to_scan > 0 && defer)
+		ion_heap_freelist_drain(&sys_heap->heap,
+					(size_t)nr_to_scan * PAGE_SIZE);
+
+	/* free the smallest chunks first, they are the cheapest to refill */
+	for (i = NUM_ORDERS - 1; i >= 0 && nr_to_scan > 0; i--)
+		nr_to_scan -= ion_page_pool_shrink(sys_heap->pools[i],
+						   sc->gfp_mask, nr_to_scan);
+
+	for (i = 0; i < NUM_ORDERS; i++)
+		nr_total += ion_page_pool_shrink(sys_heap->pools[i],
+						 sc->gfp_mask, 0);
+	if (defer)
+		nr_total += ion_heap_freelist_size(&sys_heap->heap) / PAGE_SIZE;
+	return nr_total;
+}
+
 struct ion_heap *ion_system_heap_create(struct ion_platform_heap *unused)
 {
-	struct ion_heap *heap;
+	struct ion_system_heap *heap;
+	int i;
 
-	heap = kzalloc(sizeof(struct ion_heap), GFP_KERNEL);
+	heap = kzalloc(sizeof(struct ion_system_heap), GFP_KERNEL);
 	if (!heap)
 		return ERR_PTR(-ENOMEM);
-	heap->ops = &vmalloc_ops;
-	heap->type = ION_HEAP_TYPE_SYSTEM;
-	return heap;
+	heap->heap.ops = &vmalloc_ops;
+	heap->heap.type = ION_HEAP_TYPE_SYSTEM;
+	heap->heap.flags = ION_HEAP_FLAG_DEFER_FREE;
+	/* the shrinker may drain the free list before the heap is added */
+	ion_heap_freelist_init(&heap->heap);
+
+	for (i = 0; i < NUM_ORDERS; i++) {
+		gfp_t gfp_flags = low_order_gfp_flags;
+
+		if (orders[i])
+			gfp_flags = high_order_gfp_flags;
+		heap->pools[i] = ion_page_pool_create(gfp_flags, orders[i]);
+		if (!heap->pools[i])
+			goto err;
+	}
+
+	heap->shrinker.shrink = ion_system_heap_shrink;
+	heap->shrinker.seeks = DEFAULT_SEEKS;
+	register_shrinker(&heap->shrinker);
+	return &heap->heap;
+
+err:
+	while (--i >= 0)
+		ion_page_pool_destroy(heap->pools[i]);
+	kfree(heap);
+	return ERR_PTR(-ENOMEM);
 }
 
 void ion_system_heap_destroy(struct ion_heap *heap)
 {
-	kfree(heap);
+	struct ion_system_heap *sys_heap = container_of(heap,
+							struct ion_system_heap,
+							heap);
+	int i;
+
+	unregister_shrinker(&sys_heap->shrinker);
+	for (i = 0; i < NUM_ORDERS; i++)
+		ion_page_pool_destroy(sys_heap->pools[i]);
+	kfree(sys_heap);
 }
 
 static int ion_system_contig_heap_allocate(struct ion_heap *heap,
@@ -203,6 +432,17 @@ struct scatterlist *ion_system_contig_heap_map_dma(struct ion_heap *heap,
 	return sglist;
 }
 
+void *ion_system_contig_heap_map_kernel(struct ion_heap *heap,
+					struct ion_buffer *buffer)
+{
+	return buffer->priv_virt;
+}
+
+void ion_system_contig_heap_unmap_kernel(struct ion_heap *heap,
+					 struct ion_buffer *buffer)
+{
+}
+
 int ion_system_contig_heap_map_user(struct ion_heap *heap,
 				    struct ion_buffer *buffer,
 				    struct vm_area_struct *vma)
@@ -219,8 +459,8 @@ static struct ion_heap_ops kmalloc_ops = {
 	.phys = ion_system_contig_heap_phys,
 	.map_dma = ion_system_contig_heap_map_dma,
 	.unmap_dma = ion_system_heap_unmap_dma,
-	.map_kernel = ion_system_heap_map_kernel,
-	.unmap_kernel = ion_system_heap_unmap_kernel,
+	.map_kernel = ion_system_contig_heap_map_kernel,
+	.unmap_kernel = ion_system_contig_heap_unmap_kernel,
 	.map_user = ion_system_contig_heap_map_user,
 };
 
@@ -19,39 +19,65 @@
 
 #include <linux/sched.h>
 #include <linux/module.h>
+#include <linux/compat.h>
 #include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
 #include <linux/miscdevice.h>
 #include <linux/uaccess.h>
 #include <linux/poll.h>
 #include <linux/slab.h>
 #include <linux/time.h>
+#include <linux/percpu.h>
+#include <linux/spinlock.h>
 #include "logger.h"
 
 #include <asm/ioctls.h>
 
+#define LOGGER_ENTRY_MAX_LEN \
+	(sizeof(struct logger_entry) + LOGGER_ENTRY_MAX_PAYLOAD)
+
 /*
  * struct logger_log - represents a specific log, such as 'main' or 'radio'
  *
  * This structure lives from module insertion until module removal, so it does
  * not need additional reference counting. The structure is protected by the
- * mutex 'mutex'.
+ * spinlock 'lock', except for 'c_off' which writers advance without it.
+ *
+ * Writers reserve space under 'lock' by advancing 'w_off' and writing the
+ * entry header, then copy the payload in without the lock and commit by
+ * advancing 'c_off' in reservation order.  Readers only see entries below
+ * 'c_off'.  Nothing between reserve and commit can sleep.
  */
 struct logger_log {
 	unsigned char 		*buffer;/* the ring buffer itself */
 	struct miscdevice	misc;	/* misc device representing the log */
 	wait_queue_head_t	wq;	/* wait queue for readers */
 	struct list_head	readers; /* this log's readers */
-	struct mutex		mutex;	/* mutex protecting buffer */
-	size_t			w_off;	/* current write head offset */
+	spinlock_t		lock;	/* lock protecting buffer */
+	size_t			w_off;	/* current write (reserve) head offset */
+	size_t			c_off;	/* entries before this are committed */
 	size_t			head;	/* new readers start here */
 	size_t			size;	/* size of the log */
+	struct logger_mmap_index *index; /* positions exported to mmap() */
+	bool			compact; /* may store compact records */
+	bool			last_valid; /* 'last' may be compacted against */
+	int			compact_run; /* compact records since full one */
+	struct logger_entry	last;	/* header of the last record reserved */
 };
 
+/*
+ * At most this many compact records follow a full one, which bounds how
+ * much a reader that lost its place has to skip before it can decode.
+ */
+#define LOGGER_COMPACT_RUN	32
+
 /*
  * struct logger_reader - a logging device open for reading
  *
  * This object lives from open to release, so we don't need additional
- * reference counting. The structure is protected by log->mutex.
+ * reference counting. The structure is protected by log->lock, except
+ * for r_buf, which r_mutex keeps to one read() at a time.
  */
 struct logger_reader {
 	struct logger_log	*log;	/* associated log */
@@ -59,7 +85,17 @@ struct logger_reader {
 	size_t			r_off;	/* current read head offset */
 	bool			r_all;	/* reader can read all entries */
 	int			r_ver;	/* reader ABI version */
+	unsigned char		*r_buf;	/* entry being copied to userspace */
+	struct mutex		r_mutex; /* serialises users of r_buf */
+	bool			r_synced; /* r_last may decode compact records */
+	struct logger_entry	r_last;	/* header of the last record passed */
+};
+
+/* per-cpu staging area for a payload on its way from userspace */
+struct logger_scratch {
+	unsigned char		buf[LOGGER_ENTRY_MAX_PAYLOAD];
 };
+static DEFINE_PER_CPU(struct logger_scratch, logger_scratch);
 
 /* logger_offset - returns index 'n' into the log via (optimized) modulus */
 #define logger_offset(n)	((n) & (log->size - 1))
@@ -109,18 +145,81 @@ static struct logger_entry *get_entry_header(struct logger_log *log,
 }
 
 /*
- * get_entry_msg_len - Grabs the length of the message of the entry
+ * get_entry_len - Grabs the length of the record, header and message,
  * starting from from 'off'.
  *
- * Caller needs to hold log->mutex.
+ * Caller needs to hold log->lock.
  */
-static __u32 get_entry_msg_len(struct logger_log *log, size_t off)
+static size_t get_entry_len(struct logger_log *log, size_t off)
 {
 	struct logger_entry scratch;
 	struct logger_entry *entry;
 
 	entry = get_entry_header(log, off, &scratch);
-	return entry->len;
+	return entry->hdr_size + entry->len;
+}
+
+/*
+ * decode_entry - fills 'entry' with the full header of the record at the
+ * reader's offset, expanding a compact record against the last record the
+ * reader passed.  Returns false for a compact record the reader has lost
+ * the context of.
+ *
+ * Caller needs to hold log->lock.
+ */
+static bool decode_entry(struct logger_log *log, struct logger_reader *reader,
+			 struct logger_entry *entry)
+{
+	struct logger_entry scratch;
+	struct logger_entry *hdr;
+	struct logger_compact_entry *compact;
+	u64 nsec;
+	u32 rem;
+
+	hdr = get_entry_header(log, reader->r_off, &scratch);
+	if (hdr->hdr_size != sizeof(struct logger_compact_entry)) {
+		*entry = *hdr;
+		return true;
+	}
+	if (!reader->r_synced)
+		return false;
+
+	compact = (struct logger_compact_entry *) hdr;
+	*entry = reader->r_last;
+	entry->len = compact->len;
+	nsec = (u64) entry->nsec + compact->delta_nsec;
+	entry->sec += div_u64_rem(nsec, NSEC_PER_SEC, &rem);
+	entry->nsec = rem;
+	return true;
+}
+
+/*
+ * pass_entry - moves the reader past the record at its offset, whose header
+ * decode_entry() returned as 'entry', or NULL if it could not be decoded.
+ *
+ * Caller needs to hold log->lock.
+ */
+static void pass_entry(struct logger_log *log, struct logger_reader *reader,
+		       struct logger_entry *entry)
+{
+	if (entry) {
+		reader->r_last = *entry;
+		reader->r_synced = true;
+	}
+	reader->r_off = logger_offset(reader->r_off +
+				      get_entry_len(log, reader->r_off));
+}
+
+/*
+ * logger_committed - returns the offset up to which entries are committed.
+ * Entry data below the returned offset may be read after this.
+ */
+static inline size_t logger_committed(struct logger_log *log)
+{
+	size_t c_off = ACCESS_ONCE(log->c_off);
+
+	smp_rmb();
+	return c_off;
 }
 
 static size_t get_user_hdr_len(int ver)
@@ -156,78 +255,79 @@ static ssize_t copy_header_to_user(int ver, struct logger_entry *entry,
 }
 
 /*
- * do_read_log_to_user - reads exactly 'count' bytes from 'log' into the
- * user-space buffer 'buf'. Returns 'count' on success.
+ * do_read_log - copies the entry at the reader's offset to reader->r_buf,
+ * as the full header 'entry' followed by its payload, and moves the reader
+ * past it.
  *
- * Caller must hold log->mutex.
+ * Caller must hold log->lock.
  */
-static ssize_t do_read_log_to_user(struct logger_log *log,
-				   struct logger_reader *reader,
-				   char __user *buf,
-				   size_t count)
+static void do_read_log(struct logger_log *log, struct logger_reader *reader,
+			struct logger_entry *entry)
 {
-	struct logger_entry scratch;
-	struct logger_entry *entry;
-	size_t len;
 	size_t msg_start;
+	size_t len;
 
-	/*
-	 * First, copy the header to userspace, using the version of
-	 * the header requested
-	 */
-	entry = get_entry_header(log, reader->r_off, &scratch);
-	if (copy_header_to_user(reader->r_ver, entry, buf))
-		return -EFAULT;
+	memcpy(reader->r_buf, entry, sizeof(struct logger_entry));
 
-	count -= get_user_hdr_len(reader->r_ver);
-	buf += get_user_hdr_len(reader->r_ver);
-	msg_start = logger_offset(reader->r_off + sizeof(struct logger_entry));
+	msg_start = logger_offset(reader->r_off +
+				  get_entry_len(log, reader->r_off) -
+				  entry->len);
+	len = min_t(size_t, entry->len, log->size - msg_start);
+	memcpy(reader->r_buf + sizeof(struct logger_entry),
+	       log->buffer + msg_start, len);
+	if (entry->len != len)
+		memcpy(reader->r_buf + sizeof(struct logger_entry) + len,
+		       log->buffer, entry->len - len);
 
-	/*
-	 * We read from the msg in two disjoint operations. First, we read from
-	 * the current msg head offset up to 'count' bytes or to the end of
-	 * the log, whichever comes first.
-	 */
-	len = min(count, log->size - msg_start);
-	if (copy_to_user(buf, log->buffer + msg_start, len))
-		return -EFAULT;
+	pass_entry(log, reader, entry);
+}
 
-	/*
-	 * Second, we read any remaining bytes, starting back at the head of
-	 * the log.
-	 */
-	if (count != len)
-		if (copy_to_user(buf + len, log->buffer, count - len))
-			return -EFAULT;
+/*
+ * do_read_log_to_user - copies the entry in reader->r_buf, with a payload
+ * of 'count' bytes, to the user-space buffer 'buf' using the header version
+ * the reader asked for.  Returns the number of bytes copied on success.
+ */
+static ssize_t do_read_log_to_user(struct logger_reader *reader,
+				   char __user *buf, size_t count)
+{
+	struct logger_entry *entry = (struct logger_entry *) reader->r_buf;
+	size_t hdr_len = get_user_hdr_len(reader->r_ver);
 
-	reader->r_off = logger_offset(reader->r_off +
-		sizeof(struct logger_entry) + count);
+	if (copy_header_to_user(reader->r_ver, entry, buf))
+		return -EFAULT;
+	if (copy_to_user(buf + hdr_len, entry->msg, count))
+		return -EFAULT;
 
-	return count + get_user_hdr_len(reader->r_ver);
+	return hdr_len + count;
 }
 
 /*
- * get_next_entry_by_uid - Starting at 'off', returns an offset into
- * 'log->buffer' which contains the first entry readable by 'euid'
+ * get_next_entry_by_uid - Starting at the reader's offset, moves the reader
+ * to the first entry it can decode that is readable by 'euid', or to any
+ * entry it can decode if it may read all entries.  Returns false if there
+ * is no such entry yet, with 'entry' holding the decoded header otherwise.
+ *
+ * Caller must hold log->lock.
  */
-static size_t get_next_entry_by_uid(struct logger_log *log,
-		size_t off, uid_t euid)
+static bool get_next_entry_by_uid(struct logger_log *log,
+		struct logger_reader *reader, uid_t euid,
+		struct logger_entry *entry)
 {
-	while (off != log->w_off) {
-		struct logger_entry *entry;
-		struct logger_entry scratch;
-		size_t next_len;
+	size_t c_off = logger_committed(log);
 
-		entry = get_entry_header(log, off, &scratch);
+	while (reader->r_off != c_off) {
+		if (!decode_entry(log, reader, entry)) {
+			pass_entry(log, reader, NULL);
+			continue;
+		}
 
-		if (entry->euid == euid)
-			return off;
+		if (reader->r_all || entry->euid == euid)
+			return true;
 
-		next_len = sizeof(struct logger_entry) + entry->len;
-		off = logger_offset(off + next_len);
+		pass_entry(log, reader, entry);
 	}
 
-	return off;
+	return false;
 }
 
 /*
@@ -240,13 +340,16 @@ static size_t get_next_entry_by_uid(struct logger_log *log,
  * 	- Atomically reads exactly one log entry
  *
  * Will set errno to EINVAL if read
- * buffer is insufficient to hold next entry.
+ * buffer is insufficient to hold next entry.  The entry is copied out of
+ * the log under log->lock and to userspace without it, so an entry that
+ * faults on the way to userspace is consumed.
  */
 static ssize_t logger_read(struct file *file, char __user *buf,
 			   size_t count, loff_t *pos)
 {
 	struct logger_reader *reader = file->private_data;
 	struct logger_log *log = reader->log;
+	struct logger_entry entry;
 	ssize_t ret;
 	DEFINE_WAIT(wait);
 
@@ -254,9 +357,9 @@ start:
 	while (1) {
 		prepare_to_wait(&log->wq, &wait, TASK_INTERRUPTIBLE);
 
-		mutex_lock(&log->mutex);
-		ret = (log->w_off == reader->r_off);
-		mutex_unlock(&log->mutex);
+		spin_lock(&log->lock);
+		ret = (logger_committed(log) == reader->r_off);
+		spin_unlock(&log->lock);
 		if (!ret)
 			break;
 
@@ -277,31 +380,32 @@ start:
 	if (ret)
 		return ret;
 
-	mutex_lock(&log->mutex);
-
-	if (!reader->r_all)
-		reader->r_off = get_next_entry_by_uid(log,
-			reader->r_off, current_euid());
+	/* r_buf is filled under log->lock but copied out without it */
+	mutex_lock(&reader->r_mutex);
+	spin_lock(&log->lock);
 
 	/* is there still something to read or did we race? */
-	if (unlikely(log->w_off == reader->r_off)) {
-		mutex_unlock(&log->mutex);
+	if (unlikely(!get_next_entry_by_uid(log, reader, current_euid(),
+					    &entry))) {
+		spin_unlock(&log->lock);
+		mutex_unlock(&reader->r_mutex);
 		goto start;
 	}
 
 	/* get the size of the next entry */
-	ret = get_user_hdr_len(reader->r_ver) +
-		get_entry_msg_len(log, reader->r_off);
-	if (count < ret) {
-		ret = -EINVAL;
-		goto out;
+	if (count < get_user_hdr_len(reader->r_ver) + entry.len) {
+		spin_unlock(&log->lock);
+		mutex_unlock(&reader->r_mutex);
+		return -EINVAL;
 	}
 
 	/* get exactly one entry from the log */
-	ret = do_read_log_to_user(log, reader, buf, ret);
+	do_read_log(log, reader, &entry);
 
-out:
-	mutex_unlock(&log->mutex);
+	spin_unlock(&log->lock);
+
+	ret = do_read_log_to_user(reader, buf, entry.len);
+	mutex_unlock(&reader->r_mutex);
 
 	return ret;
 }
@@ -310,15 +414,14 @@ out:
  * get_next_entry - return the offset of the first valid entry at least 'len'
  * bytes after 'off'.
  *
- * Caller must hold log->mutex.
+ * Caller must hold log->lock.
  */
 static size_t get_next_entry(struct logger_log *log, size_t off, size_t len)
 {
 	size_t count = 0;
 
 	do {
-		size_t nr = sizeof(struct logger_entry) +
-			get_entry_msg_len(log, off);
+		size_t nr = get_entry_len(log, off);
 		off = logger_offset(off + nr);
 		count += nr;
 	} while (count < len);
@@ -343,13 +446,26 @@ static inline int clock_interval(size_t a, size_t b, size_t c)
 	return 0;
 }
 
+/*
+ * set_log_head - moves the log's head to 'head', keeping the head position
+ * exported to mmap() readers in step.
+ *
+ * The caller needs to hold log->lock.
+ */
+static void set_log_head(struct logger_log *log, size_t head)
+{
+	log->index->head_pos += logger_offset(head - log->head);
+	log->head = head;
+}
+
 /*
  * fix_up_readers - walk the list of all readers and "fix up" any who were
  * lapped by the writer; also do the same for the default "start head".
  * We do this by "pulling forward" the readers and start head to the first
- * entry after the new write head.
+ * entry after the new write head.  Reserved entries always have a valid
+ * header, so the walk never depends on an uncommitted payload.
  *
- * The caller needs to hold log->mutex.
+ * The caller needs to hold log->lock.
  */
 static void fix_up_readers(struct logger_log *log, size_t len)
 {
@@ -357,57 +473,191 @@ static void fix_up_readers(struct logger_log *log, size_t len)
 	size_t new = logger_offset(old + len);
 	struct logger_reader *reader;
 
-	if (clock_interval(old, new, log->head))
-		log->head = get_next_entry(log, log->head, len);
+	if (clock_interval(old, new, log->head)) {
+		set_log_head(log, get_next_entry(log, log->head, len));
+		/* mmap readers must see the new head before the overwrite */
+		smp_wmb();
+	}
 
 	list_for_each_entry(reader, &log->readers, list)
-		if (clock_interval(old, new, reader->r_off))
+		if (clock_interval(old, new, reader->r_off)) {
 			reader->r_off = get_next_entry(log, reader->r_off, len);
+			reader->r_synced = false;
+		}
 }
 
 /*
- * do_write_log - writes 'len' bytes from 'buf' to 'log'
+ * compact_header - decides whether the record described by 'header' can be
+ * stored compactly against the last record reserved, filling 'compact' if
+ * so, and returns the size of the header to store.
  *
- * The caller needs to hold log->mutex.
+ * The caller needs to hold log->lock.
  */
-static void do_write_log(struct logger_log *log, const void *buf, size_t count)
+static size_t compact_header(struct logger_log *log,
+			     struct logger_entry *header,
+			     struct logger_compact_entry *compact)
+{
+	struct logger_entry *last = &log->last;
+	s64 delta;
+
+	delta = (s64) (header->sec - last->sec) * NSEC_PER_SEC +
+		header->nsec - last->nsec;
+
+	if (!log->compact || !log->last_valid ||
+	    log->compact_run >= LOGGER_COMPACT_RUN ||
+	    header->pid != last->pid || header->tid != last->tid ||
+	    header->euid != last->euid ||
+	    delta < 0 || delta > (u32) ~0) {
+		log->compact_run = 0;
+		log->last = *header;
+		log->last_valid = true;
+		return sizeof(struct logger_entry);
+	}
+
+	compact->len = header->len;
+	compact->hdr_size = sizeof(struct logger_compact_entry);
+	compact->delta_nsec = delta;
+	log->compact_run++;
+	log->last = *header;
+	return sizeof(struct logger_compact_entry);
+}
+
+/*
+ * do_write_log - writes 'count' bytes from 'buf' to 'log' at offset 'off'
+ */
+static void do_write_log(struct logger_log *log, size_t off,
+			 const void *buf, size_t count)
 {
 	size_t len;
 
-	len = min(count, log->size - log->w_off);
-	memcpy(log->buffer + log->w_off, buf, len);
+	len = min(count, log->size - off);
+	memcpy(log->buffer + off, buf, len);
 
 	if (count != len)
 		memcpy(log->buffer, buf + len, count - len);
+}
+
+/*
+ * logger_copy_iov - gathers 'count' bytes of payload from the user-space
+ * vector 'iov' into 'buf'.  With 'atomic' set page faults are not served,
+ * and -EFAULT is returned if one was needed.
+ */
+static int logger_copy_iov(void *buf, const struct iovec *iov,
+			   unsigned long nr_segs, size_t count, bool atomic)
+{
+	size_t done = 0;
+
+	while (nr_segs-- > 0 && done < count) {
+		size_t len = min_t(size_t, iov->iov_len, count - done);
+		unsigned long left;
+
+		if (atomic) {
+			if (!access_ok(VERIFY_READ, iov->iov_base, len))
+				return -EFAULT;
+			left = __copy_from_user_inatomic(buf + done,
+							 iov->iov_base, len);
+		} else
+			left = copy_from_user(buf + done, iov->iov_base, len);
+		if (left)
+			return -EFAULT;
 
-	log->w_off = logger_offset(log->w_off + count);
+		iov++;
+		done += len;
+	}
 
+	return 0;
 }
 
 /*
- * do_write_log_user - writes 'len' bytes from the user-space buffer 'buf' to
- * the log 'log'
+ * do_write_entry - writes one entry with a payload of 'count' bytes taken
+ * from the user-space vector 'iov' to 'log'.  Does not wake up readers.
  *
- * The caller needs to hold log->mutex.
+ * The payload is staged in a per-cpu buffer with preemption disabled, so
+ * that reserving, copying into the log and committing never sleep and a
+ * writer waiting to commit behind another one only spins for a memcpy.
+ * If staging needs a page fault, the payload is copied into a temporary
+ * buffer first instead.
  *
  * Returns 'count' on success, negative error code on failure.
  */
-static ssize_t do_write_log_from_user(struct logger_log *log,
-				      const void __user *buf, size_t count)
+static ssize_t do_write_entry(struct logger_log *log, const struct iovec *iov,
+			      unsigned long nr_segs, size_t count)
 {
-	size_t len;
+	struct logger_entry header;
+	struct logger_compact_entry compact;
+	struct timespec now;
+	unsigned char *payload;
+	unsigned char *slow = NULL;
+	size_t start, off, end, hdr_len;
+	int ret;
 
-	len = min(count, log->size - log->w_off);
-	if (len && copy_from_user(log->buffer + log->w_off, buf, len))
-		return -EFAULT;
+	header.pid = current->tgid;
+	header.tid = current->pid;
+	header.euid = current_euid();
+	header.len = count;
+	header.hdr_size = sizeof(struct logger_entry);
 
-	if (count != len)
-		if (copy_from_user(log->buffer, buf + len, count - len))
-			return -EFAULT;
+	preempt_disable();
+	payload = __get_cpu_var(logger_scratch).buf;
+	pagefault_disable();
+	ret = logger_copy_iov(payload, iov, nr_segs, header.len, true);
+	pagefault_enable();
+	if (unlikely(ret)) {
+		preempt_enable();
+		slow = kmalloc(header.len, GFP_KERNEL);
+		if (!slow)
+			return -ENOMEM;
+		ret = logger_copy_iov(slow, iov, nr_segs, header.len, false);
+		if (ret) {
+			kfree(slow);
+			return ret;
+		}
+		payload = slow;
+		preempt_disable();
+	}
+
+	spin_lock(&log->lock);
 
-	log->w_off = logger_offset(log->w_off + count);
+	/*
+	 * Stamp the entry under the lock, so that the order entries are
+	 * reserved in, which is the order readers see them in, is also
+	 * timestamp order.
+	 */
+	now = current_kernel_time();
+	header.sec = now.tv_sec;
+	header.nsec = now.tv_nsec;
+	hdr_len = compact_header(log, &header, &compact);
+
+	/*
+	 * Fix up any readers, pulling them forward to the first readable
+	 * entry after (what will be) the new write offset.
+	 */
+	fix_up_readers(log, hdr_len + header.len);
 
-	return count;
+	start = log->w_off;
+	if (hdr_len == sizeof(struct logger_entry))
+		do_write_log(log, start, &header, hdr_len);
+	else
+		do_write_log(log, start, &compact, hdr_len);
+	off = logger_offset(start + hdr_len);
+	end = logger_offset(off + header.len);
+	log->w_off = end;
+
+	spin_unlock(&log->lock);
+
+	do_write_log(log, off, payload, header.len);
+
+	/* commit in reservation order, behind any writer still copying */
+	while (ACCESS_ONCE(log->c_off) != start)
+		cpu_relax();
+	smp_wmb();
+	log->index->c_pos += hdr_len + header.len;
+	ACCESS_ONCE(log->c_off) = end;
+
+	preempt_enable();
+	kfree(slow);
+
+	return header.len;
 }
 
 /*
@@ -419,62 +669,89 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 			 unsigned long nr_segs, loff_t ppos)
 {
 	struct logger_log *log = file_get_log(iocb->ki_filp);
-	size_t orig = log->w_off;
-	struct logger_entry header;
-	struct timespec now;
-	ssize_t ret = 0;
-
-	now = current_kernel_time();
-
-	header.pid = current->tgid;
-	header.tid = current->pid;
-	header.sec = now.tv_sec;
-	header.nsec = now.tv_nsec;
-	header.euid = current_euid();
-	header.len = min_t(size_t, iocb->ki_left, LOGGER_ENTRY_MAX_PAYLOAD);
-	header.hdr_size = sizeof(struct logger_entry);
+	size_t count = min_t(size_t, iocb->ki_left, LOGGER_ENTRY_MAX_PAYLOAD);
+	ssize_t ret;
 
 	/* null writes succeed, return zero */
-	if (unlikely(!header.len))
+	if (unlikely(!count))
 		return 0;
 
-	mutex_lock(&log->mutex);
-
-	/*
-	 * Fix up any readers, pulling them forward to the first readable
-	 * entry after (what will be) the new write offset. We do this now
-	 * because if we partially fail, we can end up with clobbered log
-	 * entries that encroach on readable buffer.
-	 */
-	fix_up_readers(log, sizeof(struct logger_entry) + header.len);
+	ret = do_write_entry(log, iov, nr_segs, count);
 
-	do_write_log(log, &header, sizeof(struct logger_entry));
+	/* wake up any blocked readers */
+	if (ret > 0)
+		wake_up_interruptible(&log->wq);
 
-	while (nr_segs-- > 0) {
-		size_t len;
-		ssize_t nr;
+	return ret;
+}
 
-		/* figure out how much of this vector we can keep */
-		len = min_t(size_t, iov->iov_len, header.len - ret);
+/* the most entries a single LOGGER_WRITE_BATCH takes */
+#define LOGGER_BATCH_MAX	64
 
-		/* write out this segment's payload */
-		nr = do_write_log_from_user(log, iov->iov_base, len);
-		if (unlikely(nr < 0)) {
-			log->w_off = orig;
-			mutex_unlock(&log->mutex);
-			return nr;
+/*
+ * logger_copy_batch_iov - copies the 'nr' iovecs at 'uptr' in from a
+ * caller that may be a 32-bit task on a 64-bit kernel.
+ */
+static int logger_copy_batch_iov(struct iovec *iov, __u64 uptr,
+				 unsigned int nr)
+{
+#ifdef CONFIG_COMPAT
+	if (is_compat_task()) {
+		struct compat_iovec __user *uiov = compat_ptr(uptr);
+		compat_uptr_t base;
+		compat_size_t len;
+		unsigned int i;
+
+		for (i = 0; i < nr; i++) {
+			if (get_user(base, &uiov[i].iov_base) ||
+			    get_user(len, &uiov[i].iov_len))
+				return -EFAULT;
+			iov[i].iov_base = compat_ptr(base);
+			iov[i].iov_len = len;
 		}
-
-		iov++;
-		ret += nr;
+		return 0;
 	}
+#endif
+	if (copy_from_user(iov, (void __user *)(unsigned long)uptr,
+			   nr * sizeof(struct iovec)))
+		return -EFAULT;
+	return 0;
+}
+
+/*
+ * logger_write_batch - writes up to LOGGER_BATCH_MAX entries, one per
+ * iovec, with a single wakeup of the readers.  Returns the number of
+ * entries written, or an error if the first one failed.
+ */
+static long logger_write_batch(struct logger_log *log, void __user *arg)
+{
+	struct logger_batch batch;
+	struct iovec iov[LOGGER_BATCH_MAX];
+	unsigned int i;
+	ssize_t ret = 0;
 
-	mutex_unlock(&log->mutex);
+	if (copy_from_user(&batch, arg, sizeof(batch)))
+		return -EFAULT;
+	if (batch.nr > LOGGER_BATCH_MAX)
+		return -EINVAL;
+	if (logger_copy_batch_iov(iov, batch.iov, batch.nr))
+		return -EFAULT;
 
-	/* wake up any blocked readers */
-	wake_up_interruptible(&log->wq);
+	for (i = 0; i < batch.nr; i++) {
+		size_t count = min_t(size_t, iov[i].iov_len,
+				     LOGGER_ENTRY_MAX_PAYLOAD);
 
-	return ret;
+		if (unlikely(!count))
+			continue;
+		ret = do_write_entry(log, &iov[i], 1, count);
+		if (ret < 0)
+			break;
+	}
+
+	if (i)
+		wake_up_interruptible(&log->wq);
+
+	return i ? i : ret;
 }
 
 static struct logger_log *get_log_from_minor(int);
@@ -504,17 +781,25 @@ static int logger_open(struct inode *inode, struct file *file)
 		if (!reader)
 			return -ENOMEM;
 
+		reader->r_buf = kmalloc(LOGGER_ENTRY_MAX_LEN, GFP_KERNEL);
+		if (!reader->r_buf) {
+			kfree(reader);
+			return -ENOMEM;
+		}
+
 		reader->log = log;
+		mutex_init(&reader->r_mutex);
 		reader->r_ver = 1;
+		reader->r_synced = false;
 		reader->r_all = in_egroup_p(inode->i_gid) ||
 			capable(CAP_SYSLOG);
 
 		INIT_LIST_HEAD(&reader->list);
 
-		mutex_lock(&log->mutex);
+		spin_lock(&log->lock);
 		reader->r_off = log->head;
 		list_add_tail(&reader->list, &log->readers);
-		mutex_unlock(&log->mutex);
+		spin_unlock(&log->lock);
 
 		file->private_data = reader;
 	} else
@@ -534,10 +819,11 @@ static int logger_release(struct inode *ignored, struct file *file)
 		struct logger_reader *reader = file->private_data;
 		struct logger_log *log = reader->log;
 
-		mutex_lock(&log->mutex);
+		spin_lock(&log->lock);
 		list_del(&reader->list);
-		mutex_unlock(&log->mutex);
+		spin_unlock(&log->lock);
 
+		kfree(reader->r_buf);
 		kfree(reader);
 	}
 
@@ -557,6 +843,7 @@ static unsigned int logger_poll(struct file *file, poll_table *wait)
 {
 	struct logger_reader *reader;
 	struct logger_log *log;
+	struct logger_entry entry;
 	unsigned int ret = POLLOUT | POLLWRNORM;
 
 	if (!(file->f_mode & FMODE_READ))
@@ -567,18 +854,55 @@ static unsigned int logger_poll(struct file *file, poll_table *wait)
 
 	poll_wait(file, &log->wq, wait);
 
-	mutex_lock(&log->mutex);
-	if (!reader->r_all)
-		reader->r_off = get_next_entry_by_uid(log,
-			reader->r_off, current_euid());
-
-	if (log->w_off != reader->r_off)
+	spin_lock(&log->lock);
+	if (get_next_entry_by_uid(log, reader, current_euid(), &entry))
 		ret |= POLLIN | POLLRDNORM;
-	mutex_unlock(&log->mutex);
+	spin_unlock(&log->lock);
 
 	return ret;
 }
 
+/*
+ * logger_mmap - the log's mmap file operation
+ *
+ * Maps the struct logger_mmap_index page followed by the ring buffer
+ * read-only.  The mapping bypasses the per-uid filtering of read(), so it
+ * is only available to readers that may read all entries.
+ */
+static int logger_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct logger_reader *reader;
+	struct logger_log *log;
+	unsigned long len = vma->vm_end - vma->vm_start;
+	int ret;
+
+	if (!(file->f_mode & FMODE_READ))
+		return -EBADF;
+
+	reader = file->private_data;
+	log = reader->log;
+
+	if (!reader->r_all)
+		return -EPERM;
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	if (vma->vm_pgoff || len > PAGE_SIZE + log->size)
+		return -EINVAL;
+
+	vma->vm_flags &= ~VM_MAYWRITE;
+	vma->vm_flags |= VM_DONTEXPAND | VM_RESERVED;
+
+	ret = remap_pfn_range(vma, vma->vm_start,
+			      virt_to_phys(log->index) >> PAGE_SHIFT,
+			      PAGE_SIZE, vma->vm_page_prot);
+	if (ret || len == PAGE_SIZE)
+		return ret;
+
+	return remap_pfn_range(vma, vma->vm_start + PAGE_SIZE,
+			       virt_to_phys(log->buffer) >> PAGE_SHIFT,
+			       len - PAGE_SIZE, vma->vm_page_prot);
+}
+
 static long logger_set_version(struct logger_reader *reader, void __user *arg)
 {
 	int version;
@@ -598,8 +922,8 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 	struct logger_reader *reader;
 	long ret = -EINVAL;
 	void __user *argp = (void __user *) arg;
-
-	mutex_lock(&log->mutex);
+	struct logger_entry entry;
+	size_t c_off;
 
 	switch (cmd) {
 	case LOGGER_GET_LOG_BUF_SIZE:
@@ -611,10 +935,13 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			break;
 		}
 		reader = file->private_data;
-		if (log->w_off >= reader->r_off)
-			ret = log->w_off - reader->r_off;
+		spin_lock(&log->lock);
+		c_off = logger_committed(log);
+		if (c_off >= reader->r_off)
+			ret = c_off - reader->r_off;
 		else
-			ret = (log->size - reader->r_off) + log->w_off;
+			ret = (log->size - reader->r_off) + c_off;
+		spin_unlock(&log->lock);
 		break;
 	case LOGGER_GET_NEXT_ENTRY_LEN:
 		if (!(file->f_mode & FMODE_READ)) {
@@ -623,24 +950,28 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 		}
 		reader = file->private_data;
 
-		if (!reader->r_all)
-			reader->r_off = get_next_entry_by_uid(log,
-				reader->r_off, current_euid());
-
-		if (log->w_off != reader->r_off)
-			ret = get_user_hdr_len(reader->r_ver) +
-				get_entry_msg_len(log, reader->r_off);
+		spin_lock(&log->lock);
+		if (get_next_entry_by_uid(log, reader, current_euid(),
+					  &entry))
+			ret = get_user_hdr_len(reader->r_ver) + entry.len;
 		else
 			ret = 0;
+		spin_unlock(&log->lock);
 		break;
 	case LOGGER_FLUSH_LOG:
 		if (!(file->f_mode & FMODE_WRITE)) {
 			ret = -EBADF;
 			break;
 		}
-		list_for_each_entry(reader, &log->readers, list)
-			reader->r_off = log->w_off;
-		log->head = log->w_off;
+		spin_lock(&log->lock);
+		c_off = logger_committed(log);
+		list_for_each_entry(reader, &log->readers, list) {
+			reader->r_off = c_off;
+			reader->r_synced = false;
+		}
+		set_log_head(log, c_off);
+		log->last_valid = false;
+		spin_unlock(&log->lock);
 		ret = 0;
 		break;
 	case LOGGER_GET_VERSION:
@@ -659,10 +990,15 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 		reader = file->private_data;
 		ret = logger_set_version(reader, argp);
 		break;
+	case LOGGER_WRITE_BATCH:
+		if (!(file->f_mode & FMODE_WRITE)) {
+			ret = -EBADF;
+			break;
+		}
+		ret = logger_write_batch(log, argp);
+		break;
 	}
 
-	mutex_unlock(&log->mutex);
-
 	return ret;
 }
 
@@ -671,6 +1007,7 @@ static const struct file_operations logger_fops = {
 	.read = logger_read,
 	.aio_write = logger_aio_write,
 	.poll = logger_poll,
+	.mmap = logger_mmap,
 	.unlocked_ioctl = logger_ioctl,
 	.compat_ioctl = logger_ioctl,
 	.open = logger_open,
@@ -679,11 +1016,12 @@ static const struct file_operations logger_fops = {
 
 /*
  * Defines a log structure with name 'NAME' and a size of 'SIZE' bytes, which
- * must be a power of two, and greater than
- * (LOGGER_ENTRY_MAX_PAYLOAD + sizeof(struct logger_entry)).
+ * must be a power of two, a multiple of PAGE_SIZE so it can be mapped, and
+ * greater than (LOGGER_ENTRY_MAX_PAYLOAD + sizeof(struct logger_entry)).
+ * With 'COMPACT' set, entries may be stored as struct logger_compact_entry.
  */
-#define DEFINE_LOGGER_DEVICE(VAR, NAME, SIZE) \
-static unsigned char _buf_ ## VAR[SIZE]; \
+#define DEFINE_LOGGER_DEVICE(VAR, NAME, SIZE, COMPACT) \
+static unsigned char _buf_ ## VAR[SIZE] __aligned(PAGE_SIZE); \
 static struct logger_log VAR = { \
 	.buffer = _buf_ ## VAR, \
 	.misc = { \
@@ -694,16 +1032,18 @@ static struct logger_log VAR = { \
 	}, \
 	.wq = __WAIT_QUEUE_HEAD_INITIALIZER(VAR .wq), \
 	.readers = LIST_HEAD_INIT(VAR .readers), \
-	.mutex = __MUTEX_INITIALIZER(VAR .mutex), \
+	.lock = __SPIN_LOCK_UNLOCKED(VAR .lock), \
 	.w_off = 0, \
+	.c_off = 0, \
 	.head = 0, \
 	.size = SIZE, \
+	.compact = COMPACT, \
 };
 
-DEFINE_LOGGER_DEVICE(log_main, LOGGER_LOG_MAIN, 256*1024)
-DEFINE_LOGGER_DEVICE(log_events, LOGGER_LOG_EVENTS, 256*1024)
-DEFINE_LOGGER_DEVICE(log_radio, LOGGER_LOG_RADIO, 256*1024)
-DEFINE_LOGGER_DEVICE(log_system, LOGGER_LOG_SYSTEM, 256*1024)
+DEFINE_LOGGER_DEVICE(log_main, LOGGER_LOG_MAIN, 256*1024, false)
+DEFINE_LOGGER_DEVICE(log_events, LOGGER_LOG_EVENTS, 256*1024, true)
+DEFINE_LOGGER_DEVICE(log_radio, LOGGER_LOG_RADIO, 256*1024, false)
+DEFINE_LOGGER_DEVICE(log_system, LOGGER_LOG_SYSTEM, 256*1024, true)
 
 static struct logger_log *get_log_from_minor(int minor)
 {
@@ -722,10 +1062,20 @@ static int __init init_log(struct logger_log *log)
 {
 	int ret;
 
+	log->index = (struct logger_mmap_index *) get_zeroed_page(GFP_KERNEL);
+	if (unlikely(!log->index))
+		return -ENOMEM;
+	log->index->version = LOGGER_MMAP_VERSION;
+	log->index->size = log->size;
+	if (log->compact)
+		log->index->flags |= LOGGER_MMAP_COMPACT;
+
 	ret = misc_register(&log->misc);
 	if (unlikely(ret)) {
 		printk(KERN_ERR "logger: failed to register misc "
 		       "device for log '%s'!\n", log->misc.name);
+		free_page((unsigned long) log->index);
+		log->index = NULL;
 		return ret;
 	}
 
@@ -19,6 +19,7 @@
 
 #include <linux/types.h>
 #include <linux/ioctl.h>
+#include <linux/uio.h>
 
 /*
  * The userspace structure for version 1 of the logger_entry ABI.
@@ -51,6 +52,54 @@ struct logger_entry {
 	char		msg[0];		/* the entry's payload */
 };
 
+/*
+ * The first page of a log mapped read-only with mmap(); the log itself
+ * follows at offset PAGE_SIZE as a ring of struct logger_entry records.
+ *
+ * Positions count the bytes written to the log modulo 2^32 and the ring
+ * offset of a position is pos & (size - 1).  Entries from head_pos up to
+ * c_pos are committed and readable.  Writers move head_pos forward before
+ * they overwrite the oldest entries, so after copying entries out of the
+ * ring a reader must check that head_pos has not passed the position it
+ * started copying from.
+ */
+struct logger_mmap_index {
+	__u32		version;	/* LOGGER_MMAP_VERSION */
+	__u32		size;		/* size of the ring in bytes */
+	__u32		head_pos;	/* position of the oldest entry */
+	__u32		c_pos;		/* position after the newest entry */
+	__u32		flags;		/* LOGGER_MMAP_* */
+};
+
+#define LOGGER_MMAP_VERSION	2	/* 2 added flags */
+#define LOGGER_MMAP_COMPACT	0x1	/* may hold logger_compact_entry */
+
+/*
+ * Logs created in compact mode may store a record as this header followed
+ * by the payload when it comes from the same pid, tid and euid as the
+ * record before it and within 2^32 nanoseconds of it.  Records are told
+ * apart by hdr_size, which is at the same place in both headers.  read()
+ * always returns full logger_entry headers; only mmap() readers see
+ * compact records, and must skip them until they have seen a full one.
+ */
+struct logger_compact_entry {
+	__u16		len;		/* length of the payload */
+	__u16		hdr_size;	/* sizeof(struct logger_compact_entry) */
+	__u32		delta_nsec;	/* nanoseconds since the previous record */
+	char		msg[0];		/* the entry's payload */
+};
+
+/*
+ * Writes several entries in one call, each iovec holds one payload.  The
+ * layout is the same for 32-bit and 64-bit callers; the kernel reads the
+ * iovec array in the caller's own layout.
+ */
+struct logger_batch {
+	__u32		nr;		/* number of entries */
+	__u32		__pad;
+	__u64		iov;		/* const struct iovec *, nr payloads */
+};
+
 #define LOGGER_LOG_RADIO	"log_radio"	/* radio-related messages */
 #define LOGGER_LOG_EVENTS	"log_events"	/* system/hardware events */
 #define LOGGER_LOG_SYSTEM	"log_system"	/* system/framework messages */
@@ -66,5 +115,6 @@ struct logger_entry {
 #define LOGGER_FLUSH_LOG		_IO(__LOGGERIO, 4) /* flush log */
 #define LOGGER_GET_VERSION		_IO(__LOGGERIO, 5) /* abi version */
 #define LOGGER_SET_VERSION		_IO(__LOGGERIO, 6) /* abi version */
+#define LOGGER_WRITE_BATCH		_IOW(__LOGGERIO, 7, struct logger_batch)
 
 #endif /* _LINUX_LOGGER_H */
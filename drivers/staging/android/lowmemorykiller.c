@@ -16,6 +16,10 @@
  * percentage of the cached memory is locked this can be very inaccurate
  * and processes may not get killed until the normal oom killer is triggered.
  *
+ * Processes are kept on per-oom_adj lists, so picking a victim does not walk
+ * the task list.  Of the processes at the highest qualifying oom_adj, the one
+ * that has been at that level the longest is killed first.
+ *
  * Copyright (C) 2007-2008 Google, Inc.
  *
  * This software is licensed under the terms of the GNU General Public
@@ -35,6 +39,14 @@
 #include <linux/oom.h>
 #include <linux/sched.h>
 #include <linux/notifier.h>
+#include <linux/spinlock.h>
+#include <linux/miscdevice.h>
+#include <linux/fs.h>
+#include <linux/poll.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+#include <linux/vmstat.h>
+#include <linux/workqueue.h>
 
 static uint32_t lowmem_debug_level = 2;
 static int lowmem_adj[6] = {
@@ -52,8 +64,30 @@ static size_t lowmem_minfree[6] = {
 };
 static int lowmem_minfree_size = 4;
 
-static struct task_struct *lowmem_deathpending;
-static unsigned long lowmem_deathpending_timeout;
+/*
+ * Several kills may be in flight at once: the further free memory has
+ * dropped through the minfree levels, the more slots are usable.  A slot
+ * is released when its task is freed or after its timeout.
+ */
+#define LOWMEM_DEATHPENDING_MAX	4
+
+static struct lowmem_deathpending {
+	struct task_struct *task;
+	unsigned long timeout;
+	int busy;
+} lowmem_deathpending[LOWMEM_DEATHPENDING_MAX];
+static DEFINE_SPINLOCK(lowmem_deathpending_lock);
+
+/*
+ * Thread group leaders with an mm, on one list per oom_adj value.  A
+ * process is moved to the tail of its list whenever its oom_adj is
+ * written, so the head of a list is the process that has been at that
+ * level the longest.
+ */
+#define LOWMEM_ADJ_BUCKETS	(OOM_ADJUST_MAX - OOM_DISABLE + 1)
+
+static struct list_head lowmem_adj_buckets[LOWMEM_ADJ_BUCKETS];
+static DEFINE_SPINLOCK(lowmem_adj_lock);
 
 #define lowmem_print(level, x...)			\
 	do {						\
@@ -61,6 +95,144 @@ static unsigned long lowmem_deathpending_timeout;
 			printk(x);			\
 	} while (0)
 
+static struct list_head *lowmem_adj_bucket(int oom_adj)
+{
+	if (oom_adj < OOM_DISABLE)
+		oom_adj = OOM_DISABLE;
+	if (oom_adj > OOM_ADJUST_MAX)
+		oom_adj = OOM_ADJUST_MAX;
+	return &lowmem_adj_buckets[oom_adj - OOM_DISABLE];
+}
+
+/* Called with tasklist_lock held for writing */
+void lowmem_adj_add(struct task_struct *p)
+{
+	/* kernel threads are never candidates */
+	if (!p->mm)
+		return;
+	spin_lock(&lowmem_adj_lock);
+	list_add_tail(&p->lowmem_adj_node,
+		      lowmem_adj_bucket(p->signal->oom_adj));
+	spin_unlock(&lowmem_adj_lock);
+}
+
+/* Called with tasklist_lock held for writing */
+void lowmem_adj_del(struct task_struct *p)
+{
+	spin_lock(&lowmem_adj_lock);
+	list_del_init(&p->lowmem_adj_node);
+	spin_unlock(&lowmem_adj_lock);
+}
+
+/* Called with the sighand lock of p held */
+void lowmem_adj_update(struct task_struct *p)
+{
+	struct task_struct *leader;
+
+	spin_lock(&lowmem_adj_lock);
+	leader = p->group_leader;
+	list_move_tail(&leader->lowmem_adj_node,
+		       lowmem_adj_bucket(p->signal->oom_adj));
+	spin_unlock(&lowmem_adj_lock);
+}
+
+/*
+ * Called from de_thread() when new takes over as group leader, with
+ * tasklist_lock held for writing and the sighand lock held so that
+ * lowmem_adj_update() cannot act on the old leader in between.
+ */
+void lowmem_adj_replace(struct task_struct *old, struct task_struct *new)
+{
+	spin_lock(&lowmem_adj_lock);
+	if (!list_empty(&old->lowmem_adj_node))
+		list_replace_init(&old->lowmem_adj_node,
+				  &new->lowmem_adj_node);
+	spin_unlock(&lowmem_adj_lock);
+}
+
+/*
+ * Returns the first process with an oom_adj of min_adj or higher and a
+ * non-empty mm, with a reference held and its rss in tasksize.  Processes
+ * stay on their lists until they exit; ones that are already exiting or
+ * have been sent a kill are skipped, as are ones whose task lock is busy,
+ * since the oom_adj writers take lowmem_adj_lock under it.
+ */
+static struct task_struct *lowmem_select(int min_adj, int *oom_adj,
+					 int *tasksize)
+{
+	struct task_struct *p;
+	int adj;
+	int rss;
+
+	spin_lock(&lowmem_adj_lock);
+	for (adj = OOM_ADJUST_MAX; adj >= min_adj; adj--) {
+		list_for_each_entry(p, lowmem_adj_bucket(adj),
+				    lowmem_adj_node) {
+			if ((p->flags & PF_EXITING) ||
+			    test_tsk_thread_flag(p, TIF_MEMDIE))
+				continue;
+			if (!spin_trylock(&p->alloc_lock))
+				continue;
+			rss = p->mm ? get_mm_rss(p->mm) : 0;
+			task_unlock(p);
+			if (rss <= 0)
+				continue;
+			get_task_struct(p);
+			spin_unlock(&lowmem_adj_lock);
+			*oom_adj = adj;
+			*tasksize = rss;
+			return p;
+		}
+	}
+	spin_unlock(&lowmem_adj_lock);
+	return NULL;
+}
+
+static struct lowmem_deathpending *lowmem_deathpending_get(int allowed)
+{
+	struct lowmem_deathpending *slot = NULL;
+	unsigned long flags;
+	int i, busy = 0;
+
+	spin_lock_irqsave(&lowmem_deathpending_lock, flags);
+	for (i = 0; i < LOWMEM_DEATHPENDING_MAX; i++) {
+		struct lowmem_deathpending *d = &lowmem_deathpending[i];
+
+		if (d->busy && time_after(jiffies, d->timeout)) {
+			d->busy = 0;
+			d->task = NULL;
+		}
+		if (d->busy)
+			busy++;
+		else if (!slot)
+			slot = d;
+	}
+	if (busy >= allowed)
+		slot = NULL;
+	if (slot) {
+		slot->busy = 1;
+		slot->task = NULL;
+		slot->timeout = jiffies + HZ;
+	}
+	spin_unlock_irqrestore(&lowmem_deathpending_lock, flags);
+	return slot;
+}
+
+static void lowmem_deathpending_set(struct lowmem_deathpending *slot,
+				    struct task_struct *task)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&lowmem_deathpending_lock, flags);
+	if (task) {
+		slot->task = task;
+		slot->timeout = jiffies + HZ;
+	} else {
+		slot->busy = 0;
+	}
+	spin_unlock_irqrestore(&lowmem_deathpending_lock, flags);
+}
+
 static int
 task_notify_func(struct notifier_block *self, unsigned long val, void *data);
 
@@ -72,54 +244,292 @@ static int
 task_notify_func(struct notifier_block *self, unsigned long val, void *data)
 {
 	struct task_struct *task = data;
+	unsigned long flags;
+	int i;
 
-	if (task == lowmem_deathpending)
-		lowmem_deathpending = NULL;
+	spin_lock_irqsave(&lowmem_deathpending_lock, flags);
+	for (i = 0; i < LOWMEM_DEATHPENDING_MAX; i++) {
+		if (lowmem_deathpending[i].task == task) {
+			lowmem_deathpending[i].task = NULL;
+			lowmem_deathpending[i].busy = 0;
+		}
+	}
+	spin_unlock_irqrestore(&lowmem_deathpending_lock, flags);
 
 	return NOTIFY_OK;
 }
 
-static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
+/*
+ * Returns the index of the first minfree level that both free and file
+ * pages are below, or -1, and the number of usable levels in array_size.
+ */
+static int lowmem_minfree_index(int other_free, int other_file,
+				int *array_size)
 {
-	struct task_struct *p;
-	struct task_struct *selected = NULL;
-	int rem = 0;
-	int tasksize;
 	int i;
-	int min_adj = OOM_ADJUST_MAX + 1;
-	int selected_tasksize = 0;
-	int selected_oom_adj;
-	int array_size = ARRAY_SIZE(lowmem_adj);
+
+	*array_size = ARRAY_SIZE(lowmem_adj);
+	if (lowmem_adj_size < *array_size)
+		*array_size = lowmem_adj_size;
+	if (lowmem_minfree_size < *array_size)
+		*array_size = lowmem_minfree_size;
+	for (i = 0; i < *array_size; i++) {
+		if (other_free < lowmem_minfree[i] &&
+		    other_file < lowmem_minfree[i])
+			return i;
+	}
+	return -1;
+}
+
+/*
+ * /dev/lowmem_pressure lets a userspace memory manager act on memory
+ * pressure before anything is killed.  The level is the worse of two
+ * signals: how far free and file pages have dropped through the minfree
+ * levels (the last level is low, the first is critical, anything in
+ * between medium), and how many of the pages vmscan scanned it failed to
+ * reclaim (pressure_medium and pressure_critical percent).
+ *
+ * The first read after open returns the current level as "none", "low",
+ * "medium" or "critical"; later reads return it only if it has changed
+ * since the last read, and end of file otherwise.  poll() reports POLLIN
+ * once the level has changed since the last read, if either the old or
+ * the new level is at least the level last written to the file, "low" by
+ * default.
+ */
+enum lowmem_pressure_level {
+	LOWMEM_PRESSURE_NONE,
+	LOWMEM_PRESSURE_LOW,
+	LOWMEM_PRESSURE_MEDIUM,
+	LOWMEM_PRESSURE_CRITICAL,
+	LOWMEM_PRESSURE_LEVELS
+};
+
+static const char * const lowmem_pressure_names[LOWMEM_PRESSURE_LEVELS] = {
+	"none", "low", "medium", "critical"
+};
+
+/* pages vmscan must have scanned before reclaim efficiency is sampled */
+#define LOWMEM_PRESSURE_WINDOW	512
+
+static int lowmem_pressure_medium = 60;
+static int lowmem_pressure_critical = 95;
+
+static int lowmem_pressure_level;
+static int lowmem_pressure_vmscan_level;
+static unsigned long lowmem_pressure_scanned;
+static unsigned long lowmem_pressure_reclaimed;
+static unsigned long lowmem_pressure_sampled;
+static unsigned long lowmem_pressure_events[NR_VM_EVENT_ITEMS];
+static DEFINE_MUTEX(lowmem_pressure_lock);
+static DECLARE_WAIT_QUEUE_HEAD(lowmem_pressure_wait);
+
+struct lowmem_pressure_reader {
+	int last_level;
+	int min_level;
+	bool read_once;
+};
+
+static int lowmem_pressure_vmscan(void)
+{
+	unsigned long *events = lowmem_pressure_events;
+	unsigned long scanned = 0;
+	unsigned long reclaimed = 0;
+	unsigned long delta_scanned, delta_reclaimed;
+	int pressure;
+	int i;
+
+	memset(events, 0, sizeof(lowmem_pressure_events));
+	all_vm_events(events);
+	for (i = 0; i < MAX_NR_ZONES; i++) {
+		scanned += events[PGSCAN_KSWAPD_NORMAL - ZONE_NORMAL + i];
+		scanned += events[PGSCAN_DIRECT_NORMAL - ZONE_NORMAL + i];
+		reclaimed += events[PGSTEAL_NORMAL - ZONE_NORMAL + i];
+	}
+
+	delta_scanned = scanned - lowmem_pressure_scanned;
+	if (delta_scanned < LOWMEM_PRESSURE_WINDOW) {
+		/* no sample for a second means vmscan has gone quiet */
+		if (time_after(jiffies, lowmem_pressure_sampled + HZ)) {
+			lowmem_pressure_scanned = scanned;
+			lowmem_pressure_reclaimed = reclaimed;
+			lowmem_pressure_sampled = jiffies;
+			lowmem_pressure_vmscan_level = LOWMEM_PRESSURE_NONE;
+		}
+		return lowmem_pressure_vmscan_level;
+	}
+
+	delta_reclaimed = min(reclaimed - lowmem_pressure_reclaimed,
+			      delta_scanned);
+	pressure = 100 - delta_reclaimed * 100 / delta_scanned;
+	if (pressure >= lowmem_pressure_critical)
+		lowmem_pressure_vmscan_level = LOWMEM_PRESSURE_CRITICAL;
+	else if (pressure >= lowmem_pressure_medium)
+		lowmem_pressure_vmscan_level = LOWMEM_PRESSURE_MEDIUM;
+	else
+		lowmem_pressure_vmscan_level = LOWMEM_PRESSURE_LOW;
+
+	lowmem_pressure_scanned = scanned;
+	lowmem_pressure_reclaimed = reclaimed;
+	lowmem_pressure_sampled = jiffies;
+	return lowmem_pressure_vmscan_level;
+}
+
+static void lowmem_pressure_update(struct work_struct *work);
+static DECLARE_WORK(lowmem_pressure_work, lowmem_pressure_update);
+static DECLARE_DELAYED_WORK(lowmem_pressure_recheck, lowmem_pressure_update);
+
+static void lowmem_pressure_update(struct work_struct *work)
+{
 	int other_free = global_page_state(NR_FREE_PAGES);
 	int other_file = global_page_state(NR_FILE_PAGES) -
 						global_page_state(NR_SHMEM);
+	int array_size;
+	int index;
+	int level;
 
-	/*
-	 * If we already have a death outstanding, then
-	 * bail out right away; indicating to vmscan
-	 * that we have nothing further to offer on
-	 * this pass.
-	 *
-	 */
-	if (lowmem_deathpending &&
-	    time_before_eq(jiffies, lowmem_deathpending_timeout))
+	mutex_lock(&lowmem_pressure_lock);
+	index = lowmem_minfree_index(other_free, other_file, &array_size);
+	if (index < 0)
+		level = LOWMEM_PRESSURE_NONE;
+	else if (index == 0)
+		level = LOWMEM_PRESSURE_CRITICAL;
+	else if (index == array_size - 1)
+		level = LOWMEM_PRESSURE_LOW;
+	else
+		level = LOWMEM_PRESSURE_MEDIUM;
+	level = max(level, lowmem_pressure_vmscan());
+
+	if (level != lowmem_pressure_level) {
+		lowmem_print(3, "lowmem pressure %s -> %s, ofree %d %d\n",
+			     lowmem_pressure_names[lowmem_pressure_level],
+			     lowmem_pressure_names[level],
+			     other_free, other_file);
+		lowmem_pressure_level = level;
+		wake_up_interruptible(&lowmem_pressure_wait);
+	}
+	mutex_unlock(&lowmem_pressure_lock);
+
+	/* the shrinker stops calling us once pressure is gone, so recheck */
+	if (level != LOWMEM_PRESSURE_NONE)
+		schedule_delayed_work(&lowmem_pressure_recheck, HZ);
+}
+
+static int lowmem_pressure_open(struct inode *inode, struct file *file)
+{
+	struct lowmem_pressure_reader *reader;
+
+	reader = kzalloc(sizeof(*reader), GFP_KERNEL);
+	if (!reader)
+		return -ENOMEM;
+	reader->last_level = LOWMEM_PRESSURE_NONE;
+	reader->min_level = LOWMEM_PRESSURE_LOW;
+	file->private_data = reader;
+	return nonseekable_open(inode, file);
+}
+
+static int lowmem_pressure_release(struct inode *inode, struct file *file)
+{
+	kfree(file->private_data);
+	return 0;
+}
+
+static ssize_t lowmem_pressure_read(struct file *file, char __user *buf,
+				    size_t count, loff_t *pos)
+{
+	struct lowmem_pressure_reader *reader = file->private_data;
+	int level = ACCESS_ONCE(lowmem_pressure_level);
+	char str[16];
+	size_t len;
+
+	if (reader->read_once && level == reader->last_level)
 		return 0;
+	len = snprintf(str, sizeof(str), "%s\n", lowmem_pressure_names[level]);
+	if (count < len)
+		return -EINVAL;
+	if (copy_to_user(buf, str, len))
+		return -EFAULT;
+	reader->last_level = level;
+	reader->read_once = true;
+	return len;
+}
 
-	if (lowmem_adj_size < array_size)
-		array_size = lowmem_adj_size;
-	if (lowmem_minfree_size < array_size)
-		array_size = lowmem_minfree_size;
-	for (i = 0; i < array_size; i++) {
-		if (other_free < lowmem_minfree[i] &&
-		    other_file < lowmem_minfree[i]) {
-			min_adj = lowmem_adj[i];
-			break;
+static ssize_t lowmem_pressure_write(struct file *file,
+				     const char __user *buf,
+				     size_t count, loff_t *pos)
+{
+	struct lowmem_pressure_reader *reader = file->private_data;
+	char str[16];
+	int i;
+
+	if (count >= sizeof(str))
+		return -EINVAL;
+	if (copy_from_user(str, buf, count))
+		return -EFAULT;
+	str[count] = '\0';
+	for (i = LOWMEM_PRESSURE_LOW; i < LOWMEM_PRESSURE_LEVELS; i++) {
+		if (sysfs_streq(str, lowmem_pressure_names[i])) {
+			reader->min_level = i;
+			return count;
 		}
 	}
-	if (sc->nr_to_scan > 0)
+	return -EINVAL;
+}
+
+static unsigned int lowmem_pressure_poll(struct file *file,
+					 struct poll_table_struct *wait)
+{
+	struct lowmem_pressure_reader *reader = file->private_data;
+	int level;
+
+	poll_wait(file, &lowmem_pressure_wait, wait);
+	level = ACCESS_ONCE(lowmem_pressure_level);
+	if (level != reader->last_level &&
+	    (level >= reader->min_level ||
+	     reader->last_level >= reader->min_level))
+		return POLLIN | POLLRDNORM;
+	return 0;
+}
+
+static const struct file_operations lowmem_pressure_fops = {
+	.owner = THIS_MODULE,
+	.open = lowmem_pressure_open,
+	.release = lowmem_pressure_release,
+	.read = lowmem_pressure_read,
+	.write = lowmem_pressure_write,
+	.poll = lowmem_pressure_poll,
+	.llseek = no_llseek,
+};
+
+static struct miscdevice lowmem_pressure_miscdev = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = "lowmem_pressure",
+	.fops = &lowmem_pressure_fops,
+};
+
+static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
+{
+	struct task_struct *selected;
+	struct lowmem_deathpending *slot;
+	int rem = 0;
+	int i;
+	int min_adj = OOM_ADJUST_MAX + 1;
+	int selected_tasksize;
+	int selected_oom_adj;
+	int array_size;
+	int other_free = global_page_state(NR_FREE_PAGES);
+	int other_file = global_page_state(NR_FILE_PAGES) -
+						global_page_state(NR_SHMEM);
+
+	i = lowmem_minfree_index(other_free, other_file, &array_size);
+	if (i >= 0)
+		min_adj = lowmem_adj[i];
+	if (sc->nr_to_scan > 0) {
+		/* vmscan is reclaiming, let the pressure level catch up */
+		schedule_work(&lowmem_pressure_work);
 		lowmem_print(3, "lowmem_shrink %lu, %x, ofree %d %d, ma %d\n",
 			     sc->nr_to_scan, sc->gfp_mask, other_free, other_file,
 			     min_adj);
+	}
 	rem = global_page_state(NR_ACTIVE_ANON) +
 		global_page_state(NR_ACTIVE_FILE) +
 		global_page_state(NR_INACTIVE_ANON) +
@@ -129,55 +539,34 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 			     sc->nr_to_scan, sc->gfp_mask, rem);
 		return rem;
 	}
-	selected_oom_adj = min_adj;
-
-	read_lock(&tasklist_lock);
-	for_each_process(p) {
-		struct mm_struct *mm;
-		struct signal_struct *sig;
-		int oom_adj;
-
-		task_lock(p);
-		mm = p->mm;
-		sig = p->signal;
-		if (!mm || !sig) {
-			task_unlock(p);
-			continue;
-		}
-		oom_adj = sig->oom_adj;
-		if (oom_adj < min_adj) {
-			task_unlock(p);
-			continue;
-		}
-		tasksize = get_mm_rss(mm);
-		task_unlock(p);
-		if (tasksize <= 0)
-			continue;
-		if (selected) {
-			if (oom_adj < selected_oom_adj)
-				continue;
-			if (oom_adj == selected_oom_adj &&
-			    tasksize <= selected_tasksize)
-				continue;
-		}
-		selected = p;
-		selected_tasksize = tasksize;
-		selected_oom_adj = oom_adj;
-		lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
-			     p->pid, p->comm, oom_adj, tasksize);
-	}
+
+	/*
+	 * If as many deaths as this level allows are outstanding, then
+	 * bail out right away; indicating to vmscan that we have nothing
+	 * further to offer on this pass.
+	 */
+	slot = lowmem_deathpending_get(min_t(int, array_size - i,
+					     LOWMEM_DEATHPENDING_MAX));
+	if (!slot)
+		return 0;
+
+	selected = lowmem_select(min_adj, &selected_oom_adj,
+				  &selected_tasksize);
 	if (selected) {
 		lowmem_print(1, "send sigkill to %d (%s), adj %d, size %d\n",
 			     selected->pid, selected->comm,
 			     selected_oom_adj, selected_tasksize);
-		lowmem_deathpending = selected;
-		lowmem_deathpending_timeout = jiffies + HZ;
-		force_sig(SIGKILL, selected);
+		lowmem_deathpending_set(slot, selected);
+		/* let the victim dip into the reserves to exit quickly */
+		set_tsk_thread_flag(selected, TIF_MEMDIE);
+		send_sig(SIGKILL, selected, 0);
+		put_task_struct(selected);
 		rem -= selected_tasksize;
+	} else {
+		lowmem_deathpending_set(slot, NULL);
 	}
 	lowmem_print(4, "lowmem_shrink %lu, %x, return %d\n",
 		     sc->nr_to_scan, sc->gfp_mask, rem);
-	read_unlock(&tasklist_lock);
 	return rem;
 }
 
@@ -186,8 +575,23 @@ static struct shrinker lowmem_shrinker = {
 	.seeks = DEFAULT_SEEKS * 16
 };
 
+static int __init lowmem_adj_init(void)
+{
+	int i;
+
+	for (i = 0; i < LOWMEM_ADJ_BUCKETS; i++)
+		INIT_LIST_HEAD(&lowmem_adj_buckets[i]);
+	return 0;
+}
+core_initcall(lowmem_adj_init);
+
 static int __init lowmem_init(void)
 {
+	int ret;
+
+	ret = misc_register(&lowmem_pressure_miscdev);
+	if (ret)
+		return ret;
 	task_free_register(&task_nb);
 	register_shrinker(&lowmem_shrinker);
 	return 0;
@@ -197,6 +601,9 @@ static void __exit lowmem_exit(void)
 {
 	unregister_shrinker(&lowmem_shrinker);
 	task_free_unregister(&task_nb);
+	cancel_work_sync(&lowmem_pressure_work);
+	cancel_delayed_work_sync(&lowmem_pressure_recheck);
+	misc_deregister(&lowmem_pressure_miscdev);
 }
 
 module_param_named(cost, lowmem_shrinker.seeks, int, S_IRUGO | S_IWUSR);
@@ -205,6 +612,10 @@ module_param_array_named(adj, lowmem_adj, int, &lowmem_adj_size,
 module_param_array_named(minfree, lowmem_minfree, uint, &lowmem_minfree_size,
 			 S_IRUGO | S_IWUSR);
 module_param_named(debug_level, lowmem_debug_level, uint, S_IRUGO | S_IWUSR);
+module_param_named(pressure_medium, lowmem_pressure_medium, int,
+		   S_IRUGO | S_IWUSR);
+module_param_named(pressure_critical, lowmem_pressure_critical, int,
+		   S_IRUGO | S_IWUSR);
 
 module_init(lowmem_init);
 module_exit(lowmem_exit);
@@ -22,15 +22,20 @@
 #include <linux/module.h>
 #include <linux/kernel.h>
 #include <linux/bio.h>
+#include <linux/bitmap.h>
 #include <linux/bitops.h>
 #include <linux/blkdev.h>
 #include <linux/buffer_head.h>
+#include <linux/cpumask.h>
+#include <linux/crypto.h>
 #include <linux/device.h>
 #include <linux/genhd.h>
 #include <linux/highmem.h>
+#include <linux/jhash.h>
+#include <linux/log2.h>
 #include <linux/slab.h>
-#include <linux/lzo.h>
 #include <linux/string.h>
+#include <linux/time.h>
 #include <linux/vmalloc.h>
 
 #include "zram_drv.h"
@@ -39,6 +44,9 @@
 static int zram_major;
 struct zram *devices;
 
+/* Serves reads of written back pages, which have to wait for I/O */
+static struct workqueue_struct *zram_wb_wq;
+
 /* Module params (documentation at end) */
 unsigned int num_devices;
 
@@ -89,18 +97,35 @@ static void zram_clear_flag(struct zram *zram, u32 index,
 	zram->table[index].flags &= ~BIT(flag);
 }
 
-static int page_zero_filled(void *ptr)
+/*
+ * Readers update ac_time holding table_lock only for reading, so they may
+ * race with each other and with zram_wb_candidate().  A single aligned
+ * 32-bit store cannot tear and concurrent readers store nearly the same
+ * time, so it is enough that every access is a single load or store; the
+ * store is skipped when the time has not changed, which also spares the
+ * table's cache lines on hot reads.
+ */
+static void zram_touch_read(struct zram *zram, u32 index)
+{
+	u32 now = get_seconds();
+
+	if (ACCESS_ONCE(zram->table[index].ac_time) != now)
+		ACCESS_ONCE(zram->table[index].ac_time) = now;
+}
+
+static int page_same_filled(void *ptr, unsigned long *element)
 {
 	unsigned int pos;
 	unsigned long *page;
 
 	page = (unsigned long *)ptr;
 
-	for (pos = 0; pos != PAGE_SIZE / sizeof(*page); pos++) {
-		if (page[pos])
+	for (pos = 1; pos != PAGE_SIZE / sizeof(*page); pos++) {
+		if (page[pos] != page[0])
 			return 0;
 	}
 
+	*element = page[0];
 	return 1;
 }
 
@@ -133,56 +158,205 @@ static void zram_set_disksize(struct zram *zram, size_t totalram_bytes)
 	zram->disksize &= PAGE_MASK;
 }
 
+/*
+ * Compression streams are handed out from a per-device idle list. There
+ * is one stream per online CPU, so a writer only has to wait when every
+ * other CPU is compressing for this device at the same time. Readers
+ * need one for the tfm too, but only take it once they find a page that
+ * has to be decompressed, so pages that need no decompression do not
+ * compete with writers for streams.
+ */
+static struct zram_stream *zram_stream_get(struct zram *zram)
+{
+	struct zram_stream *zstrm;
+
+	spin_lock(&zram->stream_lock);
+	while (list_empty(&zram->idle_streams)) {
+		spin_unlock(&zram->stream_lock);
+		wait_event(zram->stream_wait,
+			!list_empty(&zram->idle_streams));
+		spin_lock(&zram->stream_lock);
+	}
+
+	zstrm = list_first_entry(&zram->idle_streams,
+				struct zram_stream, list);
+	list_del(&zstrm->list);
+	spin_unlock(&zram->stream_lock);
+
+	return zstrm;
+}
+
+static void zram_stream_put(struct zram *zram, struct zram_stream *zstrm)
+{
+	spin_lock(&zram->stream_lock);
+	list_add(&zstrm->list, &zram->idle_streams);
+	spin_unlock(&zram->stream_lock);
+
+	wake_up(&zram->stream_wait);
+}
+
+static void zram_free_streams(struct zram *zram)
+{
+	struct zram_stream *zstrm, *tmp;
+
+	list_for_each_entry_safe(zstrm, tmp, &zram->idle_streams, list) {
+		list_del(&zstrm->list);
+		if (zstrm->tfm)
+			crypto_free_comp(zstrm->tfm);
+		free_pages((unsigned long)zstrm->buffer, 1);
+		kfree(zstrm);
+	}
+	zram->num_streams = 0;
+}
+
+static int zram_alloc_streams(struct zram *zram)
+{
+	int i;
+	struct zram_stream *zstrm;
+
+	for (i = 0; i < num_online_cpus(); i++) {
+		zstrm = kzalloc(sizeof(*zstrm), GFP_KERNEL);
+		if (!zstrm)
+			return -ENOMEM;
+
+		/* Queued first so that zram_free_streams() can undo it */
+		list_add(&zstrm->list, &zram->idle_streams);
+
+		zstrm->tfm = crypto_alloc_comp(zram->compressor, 0, 0);
+		if (IS_ERR(zstrm->tfm)) {
+			int ret = PTR_ERR(zstrm->tfm);
+
+			zstrm->tfm = NULL;
+			return ret;
+		}
+
+		/* Compressed data can be larger than a page */
+		zstrm->buffer = (void *)__get_free_pages(GFP_KERNEL |
+							__GFP_ZERO, 1);
+		if (!zstrm->buffer)
+			return -ENOMEM;
+
+		zram->num_streams++;
+	}
+
+	return 0;
+}
+
+/*
+ * Look for a stored object with the same compressed contents.
+ * Called with zram->table_lock held for writing.
+ */
+static struct zram_obj *zram_dedup_find(struct zram *zram,
+				void *src, u32 clen, u32 checksum)
+{
+	int match;
+	unsigned char *cmem;
+	struct zram_obj *obj;
+	struct hlist_node *pos;
+	struct hlist_head *head;
+
+	head = &zram->dedup_hash[checksum & zram->dedup_mask];
+	hlist_for_each_entry(obj, pos, head, hnode) {
+		if (obj->checksum != checksum || obj->size != clen)
+			continue;
+
+		cmem = zs_map_object(zram->mem_pool, obj->handle, ZS_MM_RO);
+		match = !memcmp(cmem + sizeof(struct zobj_header), src, clen);
+		zs_unmap_object(zram->mem_pool, obj->handle);
+
+		if (match)
+			return obj;
+	}
+
+	return NULL;
+}
+
+/*
+ * Drop a table reference to a compressed object, freeing it with the
+ * last one. Called with zram->table_lock held for writing.
+ */
+static void zram_obj_put(struct zram *zram, struct zram_obj *obj)
+{
+	if (--obj->count) {
+		zram_stat_dec(&zram->stats.pages_dup);
+		zram_stat64_sub(zram, &zram->stats.dup_size, obj->size);
+		return;
+	}
+
+	hlist_del(&obj->hnode);
+	zs_free(zram->mem_pool, obj->handle);
+	zram_stat64_sub(zram, &zram->stats.compr_size, obj->size);
+	kfree(obj);
+}
+
+/*
+ * Called with zram->table_lock held for writing.
+ */
 static void zram_free_page(struct zram *zram, size_t index)
 {
 	u32 clen;
-	void *obj;
+	struct table *entry = &zram->table[index];
 
-	struct page *page = zram->table[index].page;
-	u32 offset = zram->table[index].offset;
+	/* Tells a writeback in progress that the page has changed */
+	zram_clear_flag(zram, index, ZRAM_UNDER_WB);
 
-	if (unlikely(!page)) {
-		/*
-		 * No memory is allocated for zero filled pages.
-		 * Simply clear zero page flag.
-		 */
-		if (zram_test_flag(zram, index, ZRAM_ZERO)) {
-			zram_clear_flag(zram, index, ZRAM_ZERO);
+	/* The page only holds a backing device slot */
+	if (unlikely(zram_test_flag(zram, index, ZRAM_WB))) {
+		clear_bit(entry->blk_idx, zram->wb_bitmap);
+		zram_clear_flag(zram, index, ZRAM_WB);
+		zram_stat_dec(&zram->stats.pages_wb);
+		entry->blk_idx = 0;
+		return;
+	}
+
+	/*
+	 * No memory is allocated for same element filled pages.
+	 * Simply clear same page flag.
+	 */
+	if (zram_test_flag(zram, index, ZRAM_SAME)) {
+		zram_clear_flag(zram, index, ZRAM_SAME);
+		if (entry->element)
+			zram_stat_dec(&zram->stats.pages_same);
+		else
 			zram_stat_dec(&zram->stats.pages_zero);
-		}
+		entry->element = 0;
 		return;
 	}
 
+	if (unlikely(!entry->page))
+		return;
+
 	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
-		clen = PAGE_SIZE;
-		__free_page(page);
+		__free_page(entry->page);
 		zram_clear_flag(zram, index, ZRAM_UNCOMPRESSED);
 		zram_stat_dec(&zram->stats.pages_expand);
+		zram_stat64_sub(zram, &zram->stats.compr_size, PAGE_SIZE);
 		goto out;
 	}
 
-	obj = kmap_atomic(page, KM_USER0) + offset;
-	clen = xv_get_object_size(obj) - sizeof(struct zobj_header);
-	kunmap_atomic(obj, KM_USER0);
-
-	xv_free(zram->mem_pool, page, offset);
+	clen = entry->obj->size;
+	zram_obj_put(zram, entry->obj);
 	if (clen <= PAGE_SIZE / 2)
 		zram_stat_dec(&zram->stats.good_compress);
 
 out:
-	zram_stat64_sub(zram, &zram->stats.compr_size, clen);
 	zram_stat_dec(&zram->stats.pages_stored);
 
-	zram->table[index].page = NULL;
-	zram->table[index].offset = 0;
+	entry->page = NULL;
 }
 
-static void handle_zero_page(struct page *page)
+static void handle_same_page(struct page *page, unsigned long element)
 {
-	void *user_mem;
+	unsigned int pos;
+	unsigned long *user_mem;
 
 	user_mem = kmap_atomic(page, KM_USER0);
-	memset(user_mem, 0, PAGE_SIZE);
+	if (!element) {
+		memset(user_mem, 0, PAGE_SIZE);
+	} else {
+		for (pos = 0; pos != PAGE_SIZE / sizeof(*user_mem); pos++)
+			user_mem[pos] = element;
+	}
 	kunmap_atomic(user_mem, KM_USER0);
 
 	flush_dcache_page(page);
@@ -194,8 +368,7 @@ static void handle_uncompressed_page(struct zram *zram,
 	unsigned char *user_mem, *cmem;
 
 	user_mem = kmap_atomic(page, KM_USER0);
-	cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-			zram->table[index].offset;
+	cmem = kmap_atomic(zram->table[index].page, KM_USER1);
 
 	memcpy(user_mem, cmem, PAGE_SIZE);
 	kunmap_atomic(user_mem, KM_USER0);
@@ -204,36 +377,148 @@ static void handle_uncompressed_page(struct zram *zram,
 	flush_dcache_page(page);
 }
 
-static void zram_read(struct zram *zram, struct bio *bio)
+/*
+ * Called with zram->table_lock held.
+ */
+static int zram_decompress_page(struct zram *zram, struct zram_stream *zstrm,
+				struct page *page, u32 index)
+{
+	int ret;
+	unsigned int clen = PAGE_SIZE;
+	struct zram_obj *obj = zram->table[index].obj;
+	struct zobj_header *zheader;
+	unsigned char *user_mem, *cmem;
+
+	user_mem = kmap_atomic(page, KM_USER0);
+	cmem = zs_map_object(zram->mem_pool, obj->handle, ZS_MM_RO);
+
+	ret = crypto_comp_decompress(zstrm->tfm,
+		cmem + sizeof(*zheader), obj->size,
+		user_mem, &clen);
+
+	zs_unmap_object(zram->mem_pool, obj->handle);
+	kunmap_atomic(user_mem, KM_USER0);
+
+	if (!ret && clen != PAGE_SIZE)
+		ret = -EINVAL;
+
+	return ret;
+}
+
+static void zram_bdev_end_io(struct bio *bio, int err)
+{
+	complete(bio->bi_private);
+}
+
+/*
+ * Synchronously read or write one page of the backing device.
+ */
+static int zram_bdev_rw(struct zram *zram, int rw, struct page *page,
+			unsigned long blk_idx)
+{
+	int ret;
+	struct bio *bio;
+	DECLARE_COMPLETION_ONSTACK(done);
+
+	bio = bio_alloc(GFP_NOIO, 1);
+	if (!bio)
+		return -ENOMEM;
+
+	bio->bi_bdev = zram->bdev;
+	bio->bi_sector = blk_idx << SECTORS_PER_PAGE_SHIFT;
+	bio->bi_private = &done;
+	bio->bi_end_io = zram_bdev_end_io;
+	if (!bio_add_page(bio, page, PAGE_SIZE, 0)) {
+		bio_put(bio);
+		return -EIO;
+	}
+
+	submit_bio(rw | REQ_SYNC, bio);
+	wait_for_completion(&done);
+
+	ret = test_bit(BIO_UPTODATE, &bio->bi_flags) ? 0 : -EIO;
+	bio_put(bio);
+
+	return ret;
+}
+
+/*
+ * Reads normally complete in the submitter's context, which must not
+ * wait for another device. Reads that find a written back page are
+ * restarted from zram_wb_wq, where may_sleep is set.
+ */
+static void __zram_read(struct zram *zram, struct bio *bio, int may_sleep)
 {
 
 	int i;
 	u32 index;
 	struct bio_vec *bvec;
+	struct zram_stream *zstrm = NULL;
 
-	zram_stat64_inc(zram, &zram->stats.num_reads);
 	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
 
 	bio_for_each_segment(bvec, bio, i) {
 		int ret;
-		size_t clen;
 		struct page *page;
-		struct zobj_header *zheader;
-		unsigned char *user_mem, *cmem;
+		unsigned long element, blk_idx;
 
 		page = bvec->bv_page;
+again:
+		/*
+		 * Readers only exclude writers of the same device while
+		 * an entry is looked up and decompressed.
+		 */
+		read_lock(&zram->table_lock);
+		zram_touch_read(zram, index);
 
-		if (zram_test_flag(zram, index, ZRAM_ZERO)) {
-			handle_zero_page(page);
+		if (zram_test_flag(zram, index, ZRAM_SAME)) {
+			element = zram->table[index].element;
+			read_unlock(&zram->table_lock);
+			handle_same_page(page, element);
+			index++;
+			continue;
+		}
+
+		if (unlikely(zram_test_flag(zram, index, ZRAM_WB))) {
+			blk_idx = zram->table[index].blk_idx;
+			read_unlock(&zram->table_lock);
+
+			if (!may_sleep) {
+				if (zstrm)
+					zram_stream_put(zram, zstrm);
+				spin_lock(&zram->wb_bio_lock);
+				bio_list_add(&zram->wb_bios, bio);
+				spin_unlock(&zram->wb_bio_lock);
+				queue_work(zram_wb_wq, &zram->wb_work);
+				return;
+			}
+
+			/* do not hold up writers for the backing device */
+			if (zstrm) {
+				zram_stream_put(zram, zstrm);
+				zstrm = NULL;
+			}
+			ret = zram_bdev_rw(zram, READ, page, blk_idx);
+			if (unlikely(ret)) {
+				pr_err("Backing device read failed! "
+					"err=%d, page=%u\n", ret, index);
+				zram_stat64_inc(zram,
+					&zram->stats.failed_reads);
+				goto out;
+			}
+
+			zram_stat64_inc(zram, &zram->stats.wb_reads);
+			flush_dcache_page(page);
 			index++;
 			continue;
 		}
 
 		/* Requested page is not present in compressed area */
 		if (unlikely(!zram->table[index].page)) {
+			read_unlock(&zram->table_lock);
 			pr_debug("Read before write: sector=%lu, size=%u",
 				(ulong)(bio->bi_sector), bio->bi_size);
-			handle_zero_page(page);
+			handle_same_page(page, 0);
 			index++;
 			continue;
 		}
@@ -241,26 +526,27 @@ static void zram_read(struct zram *zram, struct bio *bio)
 		/* Page is stored uncompressed since it's incompressible */
 		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
 			handle_uncompressed_page(zram, page, index);
+			read_unlock(&zram->table_lock);
 			index++;
 			continue;
 		}
 
-		user_mem = kmap_atomic(page, KM_USER0);
-		clen = PAGE_SIZE;
-
-		cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-				zram->table[index].offset;
-
-		ret = lzo1x_decompress_safe(
-			cmem + sizeof(*zheader),
-			xv_get_object_size(cmem) - sizeof(*zheader),
-			user_mem, &clen);
+		/*
+		 * Waiting for a stream may sleep, so take one without
+		 * table_lock and look the entry up again.  It is kept for
+		 * the rest of the bio.
+		 */
+		if (!zstrm) {
+			read_unlock(&zram->table_lock);
+			zstrm = zram_stream_get(zram);
+			goto again;
+		}
 
-		kunmap_atomic(user_mem, KM_USER0);
-		kunmap_atomic(cmem, KM_USER1);
+		ret = zram_decompress_page(zram, zstrm, page, index);
+		read_unlock(&zram->table_lock);
 
 		/* Should NEVER happen. Return bio error if it does. */
-		if (unlikely(ret != LZO_E_OK)) {
+		if (unlikely(ret)) {
 			pr_err("Decompression failed! err=%d, page=%u\n",
 				ret, index);
 			zram_stat64_inc(zram, &zram->stats.failed_reads);
@@ -271,14 +557,42 @@ static void zram_read(struct zram *zram, struct bio *bio)
 		index++;
 	}
 
+	if (zstrm)
+		zram_stream_put(zram, zstrm);
 	set_bit(BIO_UPTODATE, &bio->bi_flags);
 	bio_endio(bio, 0);
 	return;
 
 out:
+	if (zstrm)
+		zram_stream_put(zram, zstrm);
 	bio_io_error(bio);
 }
 
+static void zram_read(struct zram *zram, struct bio *bio)
+{
+	zram_stat64_inc(zram, &zram->stats.num_reads);
+	__zram_read(zram, bio, 0);
+}
+
+static void zram_wb_read_work(struct work_struct *work)
+{
+	struct bio *bio;
+	struct zram *zram = container_of(work, struct zram, wb_work);
+
+	spin_lock(&zram->wb_bio_lock);
+	while ((bio = bio_list_pop(&zram->wb_bios))) {
+		spin_unlock(&zram->wb_bio_lock);
+
+		down_read(&zram->wb_sem);
+		__zram_read(zram, bio, 1);
+		up_read(&zram->wb_sem);
+
+		spin_lock(&zram->wb_bio_lock);
+	}
+	spin_unlock(&zram->wb_bio_lock);
+}
+
 static void zram_write(struct zram *zram, struct bio *bio)
 {
 	int i;
@@ -289,43 +603,53 @@ static void zram_write(struct zram *zram, struct bio *bio)
 	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
 
 	bio_for_each_segment(bvec, bio, i) {
-		int ret;
-		u32 offset;
-		size_t clen;
+		int ret, same;
+		u32 checksum;
+		unsigned int clen;
+		unsigned long element;
 		struct zobj_header *zheader;
+		struct zram_stream *zstrm;
+		struct zram_obj *obj;
 		struct page *page, *page_store;
+		unsigned long handle;
 		unsigned char *user_mem, *cmem, *src;
 
 		page = bvec->bv_page;
-		src = zram->compress_buffer;
-
-		/*
-		 * System overwrites unused sectors. Free memory associated
-		 * with this sector now.
-		 */
-		if (zram->table[index].page ||
-				zram_test_flag(zram, index, ZRAM_ZERO))
-			zram_free_page(zram, index);
-
-		mutex_lock(&zram->lock);
 
 		user_mem = kmap_atomic(page, KM_USER0);
-		if (page_zero_filled(user_mem)) {
-			kunmap_atomic(user_mem, KM_USER0);
-			mutex_unlock(&zram->lock);
-			zram_stat_inc(&zram->stats.pages_zero);
-			zram_set_flag(zram, index, ZRAM_ZERO);
+		same = page_same_filled(user_mem, &element);
+		kunmap_atomic(user_mem, KM_USER0);
+
+		if (same) {
+			/*
+			 * System overwrites unused sectors. Free memory
+			 * associated with this sector now.
+			 */
+			write_lock(&zram->table_lock);
+			zram_free_page(zram, index);
+			if (element)
+				zram_stat_inc(&zram->stats.pages_same);
+			else
+				zram_stat_inc(&zram->stats.pages_zero);
+			zram->table[index].element = element;
+			zram->table[index].ac_time = get_seconds();
+			zram_set_flag(zram, index, ZRAM_SAME);
+			write_unlock(&zram->table_lock);
 			index++;
 			continue;
 		}
 
-		ret = lzo1x_1_compress(user_mem, PAGE_SIZE, src, &clen,
-					zram->compress_workmem);
+		zstrm = zram_stream_get(zram);
+		src = zstrm->buffer;
 
+		user_mem = kmap_atomic(page, KM_USER0);
+		clen = 2 * PAGE_SIZE;
+		ret = crypto_comp_compress(zstrm->tfm, user_mem, PAGE_SIZE,
+					src, &clen);
 		kunmap_atomic(user_mem, KM_USER0);
 
-		if (unlikely(ret != LZO_E_OK)) {
-			mutex_unlock(&zram->lock);
+		if (unlikely(ret)) {
+			zram_stream_put(zram, zstrm);
 			pr_err("Compression failed! err=%d\n", ret);
 			zram_stat64_inc(zram, &zram->stats.failed_writes);
 			goto out;
@@ -337,10 +661,10 @@ static void zram_write(struct zram *zram, struct bio *bio)
 		 * errors which has side effect of hanging the system.
 		 */
 		if (unlikely(clen > max_zpage_size)) {
-			clen = PAGE_SIZE;
+			zram_stream_put(zram, zstrm);
+
 			page_store = alloc_page(GFP_NOIO | __GFP_HIGHMEM);
 			if (unlikely(!page_store)) {
-				mutex_unlock(&zram->lock);
 				pr_info("Error allocating memory for "
 					"incompressible page: %u\n", index);
 				zram_stat64_inc(zram,
@@ -348,52 +672,101 @@ static void zram_write(struct zram *zram, struct bio *bio)
 				goto out;
 			}
 
-			offset = 0;
+			user_mem = kmap_atomic(page, KM_USER0);
+			cmem = kmap_atomic(page_store, KM_USER1);
+			memcpy(cmem, user_mem, PAGE_SIZE);
+			kunmap_atomic(cmem, KM_USER1);
+			kunmap_atomic(user_mem, KM_USER0);
+
+			write_lock(&zram->table_lock);
+			zram_free_page(zram, index);
+			zram->table[index].page = page_store;
+			zram->table[index].ac_time = get_seconds();
 			zram_set_flag(zram, index, ZRAM_UNCOMPRESSED);
 			zram_stat_inc(&zram->stats.pages_expand);
-			zram->table[index].page = page_store;
-			src = kmap_atomic(page, KM_USER0);
-			goto memstore;
+			zram_stat_inc(&zram->stats.pages_stored);
+			zram_stat64_add(zram, &zram->stats.compr_size,
+					PAGE_SIZE);
+			write_unlock(&zram->table_lock);
+			index++;
+			continue;
 		}
 
-		if (xv_malloc(zram->mem_pool, clen + sizeof(*zheader),
-				&zram->table[index].page, &offset,
-				GFP_NOIO | __GFP_HIGHMEM)) {
-			mutex_unlock(&zram->lock);
-			pr_info("Error allocating memory for compressed "
-				"page: %u, size=%zu\n", index, clen);
+		/* Share an identical object if one is already stored */
+		checksum = jhash(src, clen, 0);
+		write_lock(&zram->table_lock);
+		obj = zram_dedup_find(zram, src, clen, checksum);
+		if (obj) {
+			obj->count++;
+			zram_stat_inc(&zram->stats.pages_dup);
+			zram_stat64_add(zram, &zram->stats.dup_size, clen);
+			zram_stat64_inc(zram, &zram->stats.dup_hits);
+			zram_stream_put(zram, zstrm);
+			goto install;
+		}
+		write_unlock(&zram->table_lock);
+
+		obj = kmalloc(sizeof(*obj), GFP_NOIO);
+		if (unlikely(!obj)) {
+			zram_stream_put(zram, zstrm);
+			pr_info("Error allocating object descriptor for "
+				"page: %u\n", index);
 			zram_stat64_inc(zram, &zram->stats.failed_writes);
 			goto out;
 		}
 
-memstore:
-		zram->table[index].offset = offset;
+		handle = zs_malloc(zram->mem_pool, clen + sizeof(*zheader),
+				GFP_NOIO | __GFP_HIGHMEM);
+		if (!handle) {
+			kfree(obj);
+			zram_stream_put(zram, zstrm);
+			pr_info("Error allocating memory for compressed "
+				"page: %u, size=%u\n", index, clen);
+			zram_stat64_inc(zram, &zram->stats.failed_writes);
+			goto out;
+		}
 
-		cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-				zram->table[index].offset;
+		cmem = zs_map_object(zram->mem_pool, handle, ZS_MM_WO);
 
 #if 0
 		/* Back-reference needed for memory defragmentation */
-		if (!zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)) {
-			zheader = (struct zobj_header *)cmem;
-			zheader->table_idx = index;
-			cmem += sizeof(*zheader);
-		}
+		zheader = (struct zobj_header *)cmem;
+		zheader->table_idx = index;
 #endif
+		memcpy(cmem + sizeof(*zheader), src, clen);
 
-		memcpy(cmem, src, clen);
+		zs_unmap_object(zram->mem_pool, handle);
+		zram_stream_put(zram, zstrm);
 
-		kunmap_atomic(cmem, KM_USER1);
-		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)))
-			kunmap_atomic(src, KM_USER0);
+		obj->handle = handle;
+		obj->size = clen;
+		obj->checksum = checksum;
+		obj->count = 1;
 
-		/* Update stats */
+		/*
+		 * The old object is released and the new one installed in
+		 * a single critical section, so a concurrent reader sees
+		 * either the old or the new contents of this sector.
+		 */
+		write_lock(&zram->table_lock);
+		hlist_add_head(&obj->hnode,
+			&zram->dedup_hash[checksum & zram->dedup_mask]);
 		zram_stat64_add(zram, &zram->stats.compr_size, clen);
+install:
+		/*
+		 * obj already carries this entry's reference, so it
+		 * survives even if the old entry pointed to it too.
+		 */
+		zram_free_page(zram, index);
+		zram->table[index].obj = obj;
+		zram->table[index].ac_time = get_seconds();
+
+		/* Update stats */
 		zram_stat_inc(&zram->stats.pages_stored);
 		if (clen <= PAGE_SIZE / 2)
 			zram_stat_inc(&zram->stats.good_compress);
+		write_unlock(&zram->table_lock);
 
-		mutex_unlock(&zram->lock);
 		index++;
 	}
 
@@ -405,6 +778,206 @@ out:
 	bio_io_error(bio);
 }
 
+/*
+ * Reserve a free page sized slot on the backing device.
+ */
+static long zram_wb_alloc_slot(struct zram *zram)
+{
+	unsigned long blk_idx;
+
+	do {
+		blk_idx = find_first_zero_bit(zram->wb_bitmap,
+					zram->wb_nr_pages);
+		if (blk_idx >= zram->wb_nr_pages)
+			return -ENOSPC;
+	} while (test_and_set_bit(blk_idx, zram->wb_bitmap));
+
+	return blk_idx;
+}
+
+/*
+ * Called with zram->table_lock held.
+ */
+static int zram_wb_candidate(struct zram *zram, u32 index,
+			enum zram_wb_mode mode, u32 now)
+{
+	if (zram_test_flag(zram, index, ZRAM_SAME) ||
+			zram_test_flag(zram, index, ZRAM_WB) ||
+			!zram->table[index].page)
+		return 0;
+
+	if (mode == ZRAM_WB_HUGE)
+		return zram_test_flag(zram, index, ZRAM_UNCOMPRESSED);
+
+	return zram->wb_idle_age &&
+		now - ACCESS_ONCE(zram->table[index].ac_time) >=
+			zram->wb_idle_age;
+}
+
+/*
+ * Write back one page to blk_idx. Returns 1 if the page now lives on
+ * the backing device, 0 if it changed meanwhile, or a negative error.
+ */
+static int zram_writeback_page(struct zram *zram, u32 index,
+			enum zram_wb_mode mode, u32 now,
+			struct page *page, unsigned long blk_idx)
+{
+	int ret = 0, in_flight = 0;
+	struct zram_stream *zstrm;
+
+	/* Take a copy of the contents and mark the page in flight */
+	zstrm = zram_stream_get(zram);
+	write_lock(&zram->table_lock);
+	if (zram_wb_candidate(zram, index, mode, now)) {
+		if (zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))
+			handle_uncompressed_page(zram, page, index);
+		else
+			ret = zram_decompress_page(zram, zstrm, page, index);
+		if (!ret) {
+			zram_set_flag(zram, index, ZRAM_UNDER_WB);
+			in_flight = 1;
+		}
+	}
+	write_unlock(&zram->table_lock);
+	zram_stream_put(zram, zstrm);
+
+	if (!in_flight)
+		return ret;
+
+	down_write(&zram->wb_sem);
+	ret = zram_bdev_rw(zram, WRITE, page, blk_idx);
+
+	/* A write or free during the I/O clears ZRAM_UNDER_WB */
+	write_lock(&zram->table_lock);
+	if (!ret && zram_test_flag(zram, index, ZRAM_UNDER_WB)) {
+		zram_free_page(zram, index);
+		zram->table[index].blk_idx = blk_idx;
+		zram_set_flag(zram, index, ZRAM_WB);
+		zram_stat_inc(&zram->stats.pages_wb);
+		ret = 1;
+	} else {
+		zram_clear_flag(zram, index, ZRAM_UNDER_WB);
+	}
+	write_unlock(&zram->table_lock);
+	up_write(&zram->wb_sem);
+
+	return ret;
+}
+
+/*
+ * Move incompressible (ZRAM_WB_HUGE) or idle (ZRAM_WB_IDLE) pages to
+ * the backing device. Returns the number of pages written back or a
+ * negative error. Called with zram->init_lock held.
+ */
+int zram_writeback(struct zram *zram, enum zram_wb_mode mode)
+{
+	int ret = 0, written = 0;
+	u32 index, now = get_seconds();
+	struct page *page;
+	long blk_idx;
+
+	if (!zram->init_done || !zram->bdev)
+		return -EINVAL;
+
+	page = alloc_page(GFP_KERNEL);
+	if (!page)
+		return -ENOMEM;
+
+	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
+		read_lock(&zram->table_lock);
+		ret = zram_wb_candidate(zram, index, mode, now);
+		read_unlock(&zram->table_lock);
+		if (!ret)
+			continue;
+
+		blk_idx = zram_wb_alloc_slot(zram);
+		if (blk_idx < 0) {
+			ret = blk_idx;
+			break;
+		}
+
+		ret = zram_writeback_page(zram, index, mode, now,
+					page, blk_idx);
+		if (ret <= 0)
+			clear_bit(blk_idx, zram->wb_bitmap);
+		if (ret < 0) {
+			pr_err("Writeback failed! err=%d, page=%u\n",
+				ret, index);
+			break;
+		}
+
+		if (ret) {
+			zram_stat64_inc(zram, &zram->stats.wb_writes);
+			written++;
+		}
+		ret = 0;
+		cond_resched();
+	}
+
+	__free_page(page);
+
+	return written ? written : ret;
+}
+
+static void zram_release_backing_dev(struct zram *zram)
+{
+	if (!zram->bdev)
+		return;
+
+	blkdev_put(zram->bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
+	vfree(zram->wb_bitmap);
+
+	zram->bdev = NULL;
+	zram->wb_bitmap = NULL;
+	zram->wb_nr_pages = 0;
+}
+
+/*
+ * Open the block device at path as backing device, or drop the
+ * current one if path is "none". Called with zram->init_lock held on
+ * a device that is not initialized.
+ */
+int zram_set_backing_dev(struct zram *zram, const char *path)
+{
+	int ret;
+	unsigned long nr_pages, *bitmap;
+	struct block_device *bdev = NULL;
+	fmode_t mode = FMODE_READ | FMODE_WRITE | FMODE_EXCL;
+
+	if (!strcmp(path, "none")) {
+		zram_release_backing_dev(zram);
+		return 0;
+	}
+
+	bdev = blkdev_get_by_path(path, mode, zram);
+	if (IS_ERR(bdev))
+		return PTR_ERR(bdev);
+
+	nr_pages = i_size_read(bdev->bd_inode) >> PAGE_SHIFT;
+	if (!nr_pages) {
+		ret = -EINVAL;
+		goto fail;
+	}
+
+	bitmap = vzalloc(BITS_TO_LONGS(nr_pages) * sizeof(long));
+	if (!bitmap) {
+		ret = -ENOMEM;
+		goto fail;
+	}
+
+	zram_release_backing_dev(zram);
+	zram->bdev = bdev;
+	zram->wb_bitmap = bitmap;
+	zram->wb_nr_pages = nr_pages;
+
+	pr_info("Using %s as backing device (%lu pages)\n", path, nr_pages);
+	return 0;
+
+fail:
+	blkdev_put(bdev, mode);
+	return ret;
+}
+
 /*
  * Check if request is within bounds and page aligned.
  */
@@ -460,34 +1033,48 @@ void zram_reset_device(struct zram *zram)
 	mutex_lock(&zram->init_lock);
 	zram->init_done = 0;
 
-	/* Free various per-device buffers */
-	kfree(zram->compress_workmem);
-	free_pages((unsigned long)zram->compress_buffer, 1);
+	/* Reads waiting on the backing device still use the table */
+	flush_workqueue(zram_wb_wq);
 
-	zram->compress_workmem = NULL;
-	zram->compress_buffer = NULL;
+	/* Free various per-device buffers */
+	zram_free_streams(zram);
 
 	/* Free all pages that are still in this zram device */
 	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
-		struct page *page;
-		u16 offset;
+		struct zram_obj *obj;
 
-		page = zram->table[index].page;
-		offset = zram->table[index].offset;
+		if (zram_test_flag(zram, index, ZRAM_SAME) ||
+				zram_test_flag(zram, index, ZRAM_WB))
+			continue;
 
-		if (!page)
+		if (!zram->table[index].page)
 			continue;
 
-		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)))
-			__free_page(page);
-		else
-			xv_free(zram->mem_pool, page, offset);
+		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
+			__free_page(zram->table[index].page);
+			continue;
+		}
+
+		/* Shared objects go with their last reference */
+		obj = zram->table[index].obj;
+		if (--obj->count)
+			continue;
+
+		zs_free(zram->mem_pool, obj->handle);
+		kfree(obj);
 	}
 
 	vfree(zram->table);
 	zram->table = NULL;
 
-	xv_destroy_pool(zram->mem_pool);
+	vfree(zram->dedup_hash);
+	zram->dedup_hash = NULL;
+
+	/* The backing device stays attached, but all its slots are free */
+	if (zram->wb_bitmap)
+		bitmap_zero(zram->wb_bitmap, zram->wb_nr_pages);
+
+	zs_destroy_pool(zram->mem_pool);
 	zram->mem_pool = NULL;
 
 	/* Reset stats */
@@ -511,17 +1098,11 @@ int zram_init_device(struct zram *zram)
 
 	zram_set_disksize(zram, totalram_pages << PAGE_SHIFT);
 
-	zram->compress_workmem = kzalloc(LZO1X_MEM_COMPRESS, GFP_KERNEL);
-	if (!zram->compress_workmem) {
-		pr_err("Error allocating compressor working memory!\n");
-		ret = -ENOMEM;
-		goto fail;
-	}
+	pr_debug("Using %s compression\n", zram->compressor);
 
-	zram->compress_buffer = (void *)__get_free_pages(__GFP_ZERO, 1);
-	if (!zram->compress_buffer) {
-		pr_err("Error allocating compressor buffer space\n");
-		ret = -ENOMEM;
+	ret = zram_alloc_streams(zram);
+	if (ret) {
+		pr_err("Error allocating compression streams\n");
 		goto fail;
 	}
 
@@ -535,12 +1116,23 @@ int zram_init_device(struct zram *zram)
 		goto fail;
 	}
 
+	/* One hash bucket for every 8 pages of disk */
+	zram->dedup_mask = roundup_pow_of_two(max_t(size_t,
+					num_pages >> 3, 1)) - 1;
+	zram->dedup_hash = vzalloc((zram->dedup_mask + 1) *
+					sizeof(*zram->dedup_hash));
+	if (!zram->dedup_hash) {
+		pr_err("Error allocating dedup hash table\n");
+		ret = -ENOMEM;
+		goto fail;
+	}
+
 	set_capacity(zram->disk, zram->disksize >> SECTOR_SHIFT);
 
 	/* zram devices sort of resembles non-rotational disks */
 	queue_flag_set_unlocked(QUEUE_FLAG_NONROT, zram->disk->queue);
 
-	zram->mem_pool = xv_create_pool();
+	zram->mem_pool = zs_create_pool();
 	if (!zram->mem_pool) {
 		pr_err("Error creating memory pool\n");
 		ret = -ENOMEM;
@@ -566,7 +1158,9 @@ void zram_slot_free_notify(struct block_device *bdev, unsigned long index)
 	struct zram *zram;
 
 	zram = bdev->bd_disk->private_data;
+	write_lock(&zram->table_lock);
 	zram_free_page(zram, index);
+	write_unlock(&zram->table_lock);
 	zram_stat64_inc(zram, &zram->stats.notify_free);
 }
 
@@ -579,9 +1173,18 @@ static int create_device(struct zram *zram, int device_id)
 {
 	int ret = 0;
 
-	mutex_init(&zram->lock);
 	mutex_init(&zram->init_lock);
+	rwlock_init(&zram->table_lock);
 	spin_lock_init(&zram->stat64_lock);
+	strlcpy(zram->compressor, default_compressor,
+		sizeof(zram->compressor));
+	INIT_LIST_HEAD(&zram->idle_streams);
+	spin_lock_init(&zram->stream_lock);
+	init_waitqueue_head(&zram->stream_wait);
+	init_rwsem(&zram->wb_sem);
+	bio_list_init(&zram->wb_bios);
+	spin_lock_init(&zram->wb_bio_lock);
+	INIT_WORK(&zram->wb_work, zram_wb_read_work);
 
 	zram->queue = blk_alloc_queue(GFP_KERNEL);
 	if (!zram->queue) {
@@ -651,6 +1254,8 @@ static void destroy_device(struct zram *zram)
 
 	if (zram->queue)
 		blk_cleanup_queue(zram->queue);
+
+	zram_release_backing_dev(zram);
 }
 
 static int __init zram_init(void)
@@ -664,11 +1269,17 @@ static int __init zram_init(void)
 		goto out;
 	}
 
+	zram_wb_wq = alloc_workqueue("zram_wb", WQ_MEM_RECLAIM, 0);
+	if (!zram_wb_wq) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
 	zram_major = register_blkdev(0, "zram");
 	if (zram_major <= 0) {
 		pr_warning("Unable to get major number\n");
 		ret = -EBUSY;
-		goto out;
+		goto destroy_wq;
 	}
 
 	if (!num_devices) {
@@ -698,6 +1309,8 @@ free_devices:
 	kfree(devices);
 unregister:
 	unregister_blkdev(zram_major, "zram");
+destroy_wq:
+	destroy_workqueue(zram_wb_wq);
 out:
 	return ret;
 }
@@ -716,6 +1329,7 @@ static void __exit zram_exit(void)
 	}
 
 	unregister_blkdev(zram_major, "zram");
+	destroy_workqueue(zram_wb_wq);
 
 	kfree(devices);
 	pr_debug("Cleanup done!\n");
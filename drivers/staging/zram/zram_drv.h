@@ -17,8 +17,14 @@
 
 #include <linux/spinlock.h>
 #include <linux/mutex.h>
+#include <linux/rwsem.h>
+#include <linux/bio.h>
+#include <linux/workqueue.h>
+#include <linux/list.h>
+#include <linux/wait.h>
+#include <linux/crypto.h>
 
-#include "xvmalloc.h"
+#include "zsmalloc.h"
 
 /*
  * Some arbitrary value. This is just to catch
@@ -43,6 +49,12 @@ struct zobj_header {
 /* Default zram disk size: 25% of total RAM */
 static const unsigned default_disksize_perc_ram = 25;
 
+/*
+ * Default compression backend. Any "compression" type algorithm known
+ * to the crypto API can be selected through sysfs 'comp_algorithm'.
+ */
+static const char default_compressor[] = "lzo";
+
 /*
  * Pages that compress to size greater than this are stored
  * uncompressed in memory.
@@ -51,8 +63,8 @@ static const unsigned max_zpage_size = PAGE_SIZE / 4 * 3;
 
 /*
  * NOTE: max_zpage_size must be less than or equal to:
- *   XV_MAX_ALLOC_SIZE - sizeof(struct zobj_header)
- * otherwise, xv_malloc() would always return failure.
+ *   ZS_MAX_ALLOC_SIZE - sizeof(struct zobj_header)
+ * otherwise, zs_malloc() would always return failure.
  */
 
 /*-- End of configurable params */
@@ -68,19 +80,42 @@ enum zram_pageflags {
 	/* Page is stored uncompressed */
 	ZRAM_UNCOMPRESSED,
 
-	/* Page consists entirely of zeros */
-	ZRAM_ZERO,
+	/* Page is filled with one repeated word (table[].element) */
+	ZRAM_SAME,
+
+	/* Page lives on the backing device (table[].blk_idx) */
+	ZRAM_WB,
+
+	/* Page is being written to the backing device */
+	ZRAM_UNDER_WB,
 
 	__NR_ZRAM_PAGEFLAGS,
 };
 
 /*-- Data structures */
 
+/*
+ * Compressed object, shared by every table entry whose page compressed
+ * to identical bytes. Objects are hashed on their checksum in
+ * zram->dedup_hash so that later writes can find them.
+ */
+struct zram_obj {
+	struct hlist_node hnode;
+	unsigned long handle;	/* zsmalloc handle */
+	u32 size;	/* compressed size, excluding zobj_header */
+	u32 checksum;
+	u32 count;	/* no. of table entries referencing this object */
+};
+
 /* Allocated for each disk page */
 struct table {
-	struct page *page;
-	u16 offset;
-	u8 count;	/* object ref count (not yet used) */
+	union {
+		struct page *page;	/* ZRAM_UNCOMPRESSED */
+		unsigned long element;	/* ZRAM_SAME */
+		unsigned long blk_idx;	/* ZRAM_WB */
+		struct zram_obj *obj;	/* otherwise */
+	};
+	u32 ac_time;	/* get_seconds() of last read or write */
 	u8 flags;
 } __attribute__((aligned(4)));
 
@@ -92,20 +127,42 @@ struct zram_stats {
 	u64 failed_writes;	/* can happen when memory is too low */
 	u64 invalid_io;		/* non-page-aligned I/O requests */
 	u64 notify_free;	/* no. of swap slot free notifications */
+	u64 dup_hits;		/* writes that found an identical object */
+	u64 dup_size;		/* compressed bytes saved by sharing */
+	u64 wb_reads;		/* pages read from backing device */
+	u64 wb_writes;		/* pages written to backing device */
 	u32 pages_zero;		/* no. of zero filled pages */
+	u32 pages_same;		/* no. of other same element filled pages */
+	u32 pages_dup;		/* no. of pages sharing another's object */
+	u32 pages_wb;		/* no. of pages on backing device */
 	u32 pages_stored;	/* no. of pages currently stored */
 	u32 good_compress;	/* % of pages with compression ratio<=50% */
 	u32 pages_expand;	/* % of incompressible pages */
 };
 
+/*
+ * Compression transform and output buffer. A device keeps one of
+ * these per online CPU so that writers compress in parallel.
+ */
+struct zram_stream {
+	struct crypto_comp *tfm;
+	void *buffer;
+	struct list_head list;
+};
+
 struct zram {
-	struct xv_pool *mem_pool;
-	void *compress_workmem;
-	void *compress_buffer;
+	struct zs_pool *mem_pool;
 	struct table *table;
+	rwlock_t table_lock;	/* protect table[] entries, dedup_hash
+				 * and the page counters in zram_stats */
+	struct hlist_head *dedup_hash;
+	unsigned long dedup_mask;
 	spinlock_t stat64_lock;	/* protect 64-bit stats */
-	struct mutex lock;	/* protect compression buffers against
-				 * concurrent writes */
+	/* Idle compression streams; writers sleep on stream_wait */
+	struct list_head idle_streams;
+	spinlock_t stream_lock;
+	wait_queue_head_t stream_wait;
+	int num_streams;
 	struct request_queue *queue;
 	struct gendisk *disk;
 	int init_done;
@@ -116,6 +173,25 @@ struct zram {
 	 * we can store in a disk.
 	 */
 	u64 disksize;	/* bytes */
+	/* Crypto API compression algorithm, fixed once initialized */
+	char compressor[CRYPTO_MAX_ALG_NAME];
+
+	/*
+	 * Optional backing device that incompressible and idle pages
+	 * are written back to. wb_bitmap tracks its page sized slots.
+	 * wb_sem is held for writing while a slot is being filled and
+	 * for reading while reads wait on the backing device, so a
+	 * slot is never reused under a reader.
+	 */
+	struct block_device *bdev;
+	unsigned long *wb_bitmap;
+	unsigned long wb_nr_pages;
+	u32 wb_idle_age;	/* seconds; 0 disables idle writeback */
+	struct rw_semaphore wb_sem;
+	/* Reads that hit written back pages, handed to wb_work */
+	struct bio_list wb_bios;
+	spinlock_t wb_bio_lock;
+	struct work_struct wb_work;
 
 	struct zram_stats stats;
 };
@@ -126,7 +202,15 @@ extern unsigned int num_devices;
 extern struct attribute_group zram_disk_attr_group;
 #endif
 
+/* zram_writeback() modes */
+enum zram_wb_mode {
+	ZRAM_WB_HUGE,	/* pages stored uncompressed */
+	ZRAM_WB_IDLE,	/* pages untouched for wb_idle_age seconds */
+};
+
 extern int zram_init_device(struct zram *zram);
 extern void zram_reset_device(struct zram *zram);
+extern int zram_set_backing_dev(struct zram *zram, const char *path);
+extern int zram_writeback(struct zram *zram, enum zram_wb_mode mode);
 
 #endif
@@ -0,0 +1,596 @@
+/*
+ * zsmalloc memory allocator
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ *
+ * Size class allocator for compressed pages. Every object is carved
+ * out of a zspage holding only objects of its size class, and is
+ * reached through a handle, so zs_compact() can move objects out of
+ * sparsely used zspages and give the pages back.
+ */
+
+#ifdef CONFIG_ZRAM_DEBUG
+#define DEBUG
+#endif
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/highmem.h>
+#include <linux/init.h>
+#include <linux/percpu.h>
+#include <linux/sched.h>
+#include <linux/string.h>
+#include <linux/slab.h>
+
+#include "zsmalloc.h"
+#include "zsmalloc_int.h"
+
+static struct kmem_cache *zs_handle_cache;
+static DEFINE_PER_CPU(struct zs_map_area, zs_map_area);
+
+static gfp_t zs_meta_gfp(gfp_t flags)
+{
+	/* Metadata comes from slab, which cannot take these */
+	return flags & ~(__GFP_HIGHMEM | __GFP_MOVABLE);
+}
+
+static int get_size_class_index(size_t size)
+{
+	if (size <= ZS_MIN_ALLOC_SIZE)
+		return 0;
+
+	return DIV_ROUND_UP(size - ZS_MIN_ALLOC_SIZE, ZS_SIZE_CLASS_DELTA);
+}
+
+/*
+ * Pick the zspage size (in pages) which leaves the least space unused
+ * at its end for objects of the given size.
+ */
+static unsigned int get_pages_per_zspage(unsigned int size)
+{
+	unsigned int i, best = 1;
+	unsigned int max_usedpc = 0;
+
+	for (i = 1; i <= ZS_MAX_PAGES_PER_ZSPAGE; i++) {
+		unsigned int zspage_size = i * PAGE_SIZE;
+		unsigned int usedpc;
+
+		usedpc = (zspage_size - zspage_size % size) * 100 /
+				zspage_size;
+		if (usedpc > max_usedpc) {
+			max_usedpc = usedpc;
+			best = i;
+		}
+	}
+
+	return best;
+}
+
+static enum fullness_group get_fullness_group(struct size_class *class,
+					struct zspage *zspage)
+{
+	if (!zspage->inuse)
+		return ZS_EMPTY;
+	if (zspage->inuse == class->objs_per_zspage)
+		return ZS_FULL;
+	if (zspage->inuse * ZS_ALMOST_FULL_DEN >
+			class->objs_per_zspage * ZS_ALMOST_FULL_NUM)
+		return ZS_ALMOST_FULL;
+
+	return ZS_ALMOST_EMPTY;
+}
+
+/*
+ * Move zspage to the list matching its current usage. Empty zspages are
+ * taken off the lists; the caller is expected to free them.
+ * Called with class->lock held.
+ */
+static enum fullness_group fix_fullness_group(struct size_class *class,
+					struct zspage *zspage)
+{
+	enum fullness_group newfg;
+
+	newfg = get_fullness_group(class, zspage);
+	if (newfg == zspage->fullness)
+		return newfg;
+
+	if (zspage->fullness != ZS_EMPTY)
+		list_del(&zspage->list);
+	if (newfg != ZS_EMPTY)
+		list_add(&zspage->list, &class->fullness_list[newfg]);
+	zspage->fullness = newfg;
+
+	return newfg;
+}
+
+/*
+ * Find a zspage with a free slot, preferring fuller ones so that
+ * sparsely used zspages can drain.
+ */
+static struct zspage *find_get_zspage(struct size_class *class)
+{
+	struct list_head *head;
+
+	head = &class->fullness_list[ZS_ALMOST_FULL];
+	if (list_empty(head))
+		head = &class->fullness_list[ZS_ALMOST_EMPTY];
+	if (list_empty(head))
+		return NULL;
+
+	return list_first_entry(head, struct zspage, list);
+}
+
+static void free_zspage(struct zs_pool *pool, struct zspage *zspage)
+{
+	unsigned int i;
+	struct size_class *class = zspage->class;
+
+	for (i = 0; i < class->pages_per_zspage; i++)
+		__free_page(zspage->pages[i]);
+	kfree(zspage);
+
+	atomic_long_sub(class->pages_per_zspage, &pool->pages_allocated);
+}
+
+static struct zspage *alloc_zspage(struct zs_pool *pool,
+				struct size_class *class, gfp_t flags)
+{
+	unsigned int i;
+	struct zspage *zspage;
+
+	zspage = kzalloc(sizeof(*zspage) +
+			class->objs_per_zspage * sizeof(zspage->slots[0]),
+			zs_meta_gfp(flags));
+	if (!zspage)
+		return NULL;
+
+	for (i = 0; i < class->pages_per_zspage; i++) {
+		zspage->pages[i] = alloc_page(flags);
+		if (!zspage->pages[i])
+			goto fail;
+	}
+
+	INIT_LIST_HEAD(&zspage->list);
+	zspage->class = class;
+	zspage->fullness = ZS_EMPTY;
+	for (i = 0; i < class->objs_per_zspage; i++)
+		zspage->slots[i] = ((i + 1) << 1) | ZS_SLOT_FREE;
+
+	atomic_long_add(class->pages_per_zspage, &pool->pages_allocated);
+
+	return zspage;
+
+fail:
+	while (i--)
+		__free_page(zspage->pages[i]);
+	kfree(zspage);
+	return NULL;
+}
+
+static void obj_alloc(struct zspage *zspage, struct zs_handle *handle)
+{
+	unsigned int idx = zspage->free;
+
+	zspage->free = zspage->slots[idx] >> 1;
+	zspage->slots[idx] = (unsigned long)handle;
+	zspage->inuse++;
+
+	handle->zspage = zspage;
+	handle->idx = idx;
+}
+
+static void obj_free(struct zspage *zspage, unsigned int idx)
+{
+	zspage->slots[idx] = (zspage->free << 1) | ZS_SLOT_FREE;
+	zspage->free = idx;
+	zspage->inuse--;
+}
+
+/*
+ * Create a memory pool. Size classes are set up here; pages are only
+ * allocated as objects are.
+ */
+struct zs_pool *zs_create_pool(void)
+{
+	int i, fg;
+	struct zs_pool *pool;
+
+	if (!zs_handle_cache)
+		return NULL;
+
+	pool = kzalloc(sizeof(*pool), GFP_KERNEL);
+	if (!pool)
+		return NULL;
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		struct size_class *class = &pool->size_class[i];
+
+		spin_lock_init(&class->lock);
+		for (fg = 0; fg < _ZS_NR_FULLNESS_GROUPS; fg++)
+			INIT_LIST_HEAD(&class->fullness_list[fg]);
+
+		class->size = ZS_MIN_ALLOC_SIZE + i * ZS_SIZE_CLASS_DELTA;
+		class->pages_per_zspage = get_pages_per_zspage(class->size);
+		class->objs_per_zspage = class->pages_per_zspage *
+						PAGE_SIZE / class->size;
+	}
+
+	rwlock_init(&pool->migrate_lock);
+	atomic_long_set(&pool->pages_allocated, 0);
+	atomic_long_set(&pool->pages_compacted, 0);
+
+	return pool;
+}
+EXPORT_SYMBOL_GPL(zs_create_pool);
+
+void zs_destroy_pool(struct zs_pool *pool)
+{
+	int i, fg;
+
+	if (!pool)
+		return;
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		struct size_class *class = &pool->size_class[i];
+
+		for (fg = 0; fg < _ZS_NR_FULLNESS_GROUPS; fg++) {
+			if (!list_empty(&class->fullness_list[fg]))
+				pr_info("zsmalloc: class %u not empty\n",
+					class->size);
+		}
+	}
+	kfree(pool);
+}
+EXPORT_SYMBOL_GPL(zs_destroy_pool);
+
+/**
+ * zs_malloc - Allocate object of given size from pool.
+ * @pool: pool to allocate from
+ * @size: size of object to allocate
+ * @flags: gfp flags used if the pool needs to grow
+ *
+ * On success, a non-zero handle to the object is returned. It stays
+ * valid until zs_free() even though the object itself may move; use
+ * zs_map_object() to reach its contents. Returns 0 on failure.
+ *
+ * Allocation requests with size > ZS_MAX_ALLOC_SIZE will fail.
+ */
+unsigned long zs_malloc(struct zs_pool *pool, size_t size, gfp_t flags)
+{
+	struct zs_handle *handle;
+	struct size_class *class;
+	struct zspage *zspage;
+
+	if (unlikely(!size || size > ZS_MAX_ALLOC_SIZE))
+		return 0;
+
+	handle = kmem_cache_alloc(zs_handle_cache, zs_meta_gfp(flags));
+	if (!handle)
+		return 0;
+
+	class = &pool->size_class[get_size_class_index(size)];
+
+	spin_lock(&class->lock);
+	zspage = find_get_zspage(class);
+
+	if (!zspage) {
+		spin_unlock(&class->lock);
+		zspage = alloc_zspage(pool, class, flags);
+		if (unlikely(!zspage)) {
+			kmem_cache_free(zs_handle_cache, handle);
+			return 0;
+		}
+
+		spin_lock(&class->lock);
+		class->zspages++;
+	}
+
+	obj_alloc(zspage, handle);
+	class->objs_inuse++;
+	fix_fullness_group(class, zspage);
+	spin_unlock(&class->lock);
+
+	return (unsigned long)handle;
+}
+EXPORT_SYMBOL_GPL(zs_malloc);
+
+void zs_free(struct zs_pool *pool, unsigned long obj)
+{
+	struct zs_handle *handle = (struct zs_handle *)obj;
+	enum fullness_group fg;
+	struct size_class *class;
+	struct zspage *zspage;
+
+	if (unlikely(!handle))
+		return;
+
+	read_lock(&pool->migrate_lock);
+	zspage = handle->zspage;
+	class = zspage->class;
+
+	spin_lock(&class->lock);
+	obj_free(zspage, handle->idx);
+	class->objs_inuse--;
+	fg = fix_fullness_group(class, zspage);
+	if (fg == ZS_EMPTY)
+		class->zspages--;
+	spin_unlock(&class->lock);
+	read_unlock(&pool->migrate_lock);
+
+	if (fg == ZS_EMPTY)
+		free_zspage(pool, zspage);
+	kmem_cache_free(zs_handle_cache, handle);
+}
+EXPORT_SYMBOL_GPL(zs_free);
+
+/**
+ * zs_map_object - Get address of an allocated object.
+ * @pool: pool the object was allocated from
+ * @handle: handle returned by zs_malloc()
+ * @mm: how the object is going to be accessed
+ *
+ * Works like kmap_atomic() (it uses the KM_USER1 slot): the caller must
+ * not sleep or map another object on this CPU before zs_unmap_object().
+ * The object cannot move while it is mapped.
+ */
+void *zs_map_object(struct zs_pool *pool, unsigned long obj,
+			enum zs_mapmode mm)
+{
+	struct zs_handle *handle = (struct zs_handle *)obj;
+	struct size_class *class;
+	struct zs_map_area *area;
+	struct zspage *zspage;
+	unsigned long offset;
+	unsigned int off, first;
+	void *addr;
+
+	BUG_ON(!handle);
+
+	read_lock(&pool->migrate_lock);
+	zspage = handle->zspage;
+	class = zspage->class;
+
+	offset = (unsigned long)handle->idx * class->size;
+	off = offset & ~PAGE_MASK;
+
+	area = &get_cpu_var(zs_map_area);
+	area->pages[0] = zspage->pages[offset >> PAGE_SHIFT];
+
+	if (off + class->size <= PAGE_SIZE) {
+		area->vaddr = kmap_atomic(area->pages[0], KM_USER1);
+		return area->vaddr + off;
+	}
+
+	/* Object spans two pages: hand out a copy */
+	area->vaddr = NULL;
+	area->pages[1] = zspage->pages[(offset >> PAGE_SHIFT) + 1];
+	area->off = off;
+	area->size = class->size;
+	area->mm = mm;
+
+	if (mm != ZS_MM_WO) {
+		first = PAGE_SIZE - off;
+
+		addr = kmap_atomic(area->pages[0], KM_USER1);
+		memcpy(area->buf, addr + off, first);
+		kunmap_atomic(addr, KM_USER1);
+
+		addr = kmap_atomic(area->pages[1], KM_USER1);
+		memcpy(area->buf + first, addr, area->size - first);
+		kunmap_atomic(addr, KM_USER1);
+	}
+
+	return area->buf;
+}
+EXPORT_SYMBOL_GPL(zs_map_object);
+
+void zs_unmap_object(struct zs_pool *pool, unsigned long obj)
+{
+	struct zs_map_area *area;
+	unsigned int first;
+	void *addr;
+
+	area = &__get_cpu_var(zs_map_area);
+
+	if (area->vaddr) {
+		kunmap_atomic(area->vaddr, KM_USER1);
+		area->vaddr = NULL;
+	} else if (area->mm != ZS_MM_RO) {
+		first = PAGE_SIZE - area->off;
+
+		addr = kmap_atomic(area->pages[0], KM_USER1);
+		memcpy(addr + area->off, area->buf, first);
+		kunmap_atomic(addr, KM_USER1);
+
+		addr = kmap_atomic(area->pages[1], KM_USER1);
+		memcpy(addr, area->buf + first, area->size - first);
+		kunmap_atomic(addr, KM_USER1);
+	}
+
+	put_cpu_var(zs_map_area);
+	read_unlock(&pool->migrate_lock);
+}
+EXPORT_SYMBOL_GPL(zs_unmap_object);
+
+/*
+ * Copy an object slot between zspages of the same class, a piece at a
+ * time since either side may span two pages.
+ */
+static void zs_copy_object(struct size_class *class,
+			struct zspage *dst, unsigned int d_idx,
+			struct zspage *src, unsigned int s_idx)
+{
+	unsigned long s_off = (unsigned long)s_idx * class->size;
+	unsigned long d_off = (unsigned long)d_idx * class->size;
+	unsigned int left = class->size;
+
+	while (left) {
+		unsigned int s_pos = s_off & ~PAGE_MASK;
+		unsigned int d_pos = d_off & ~PAGE_MASK;
+		unsigned int len = left;
+		void *s_addr, *d_addr;
+
+		len = min_t(unsigned int, len, PAGE_SIZE - s_pos);
+		len = min_t(unsigned int, len, PAGE_SIZE - d_pos);
+
+		s_addr = kmap_atomic(src->pages[s_off >> PAGE_SHIFT], KM_USER0);
+		d_addr = kmap_atomic(dst->pages[d_off >> PAGE_SHIFT], KM_USER1);
+		memcpy(d_addr + d_pos, s_addr + s_pos, len);
+		kunmap_atomic(d_addr, KM_USER1);
+		kunmap_atomic(s_addr, KM_USER0);
+
+		s_off += len;
+		d_off += len;
+		left -= len;
+	}
+}
+
+/*
+ * Number of zspages the class could give back if its objects were
+ * packed tightly. Called with class->lock held.
+ */
+static unsigned long zs_can_compact(struct size_class *class)
+{
+	unsigned long unused;
+
+	unused = class->zspages * class->objs_per_zspage - class->objs_inuse;
+	return unused / class->objs_per_zspage;
+}
+
+/*
+ * Empty the least used zspage of the class into the others. Returns
+ * the zspage to free, or NULL if there was nothing to gain.
+ * Called with migrate_lock held for writing and class->lock held.
+ */
+static struct zspage *zs_compact_zspage(struct size_class *class)
+{
+	struct list_head *head = &class->fullness_list[ZS_ALMOST_EMPTY];
+	struct zspage *src, *dst;
+	unsigned int s_idx = 0;
+
+	if (!zs_can_compact(class) || list_empty(head))
+		return NULL;
+
+	/* Newly emptied zspages are added at the head */
+	src = list_entry(head->prev, struct zspage, list);
+	list_del(&src->list);
+	src->fullness = ZS_EMPTY;
+
+	while (src->inuse) {
+		struct zs_handle *handle;
+		unsigned int d_idx;
+
+		dst = find_get_zspage(class);
+		if (!dst)
+			break;
+
+		while (src->slots[s_idx] & ZS_SLOT_FREE)
+			s_idx++;
+
+		handle = (struct zs_handle *)src->slots[s_idx];
+		obj_alloc(dst, handle);
+		d_idx = handle->idx;
+
+		zs_copy_object(class, dst, d_idx, src, s_idx);
+		obj_free(src, s_idx);
+		fix_fullness_group(class, dst);
+	}
+
+	if (fix_fullness_group(class, src) != ZS_EMPTY)
+		return NULL;
+
+	class->zspages--;
+	return src;
+}
+
+/**
+ * zs_compact - Move objects out of sparsely used zspages.
+ * @pool: pool to compact
+ *
+ * Returns the number of pages given back to the system.
+ */
+unsigned long zs_compact(struct zs_pool *pool)
+{
+	int i;
+	unsigned long freed = 0;
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		struct size_class *class = &pool->size_class[i];
+		struct zspage *zspage;
+
+		do {
+			write_lock(&pool->migrate_lock);
+			spin_lock(&class->lock);
+			zspage = zs_compact_zspage(class);
+			spin_unlock(&class->lock);
+			write_unlock(&pool->migrate_lock);
+
+			if (zspage) {
+				freed += class->pages_per_zspage;
+				free_zspage(pool, zspage);
+			}
+			cond_resched();
+		} while (zspage);
+	}
+
+	atomic_long_add(freed, &pool->pages_compacted);
+
+	return freed;
+}
+EXPORT_SYMBOL_GPL(zs_compact);
+
+u64 zs_get_total_size_bytes(struct zs_pool *pool)
+{
+	return (u64)atomic_long_read(&pool->pages_allocated) << PAGE_SHIFT;
+}
+EXPORT_SYMBOL_GPL(zs_get_total_size_bytes);
+
+void zs_get_stats(struct zs_pool *pool, struct zs_pool_stats *stats)
+{
+	int i;
+
+	stats->total_size = zs_get_total_size_bytes(pool);
+	stats->objs_size = 0;
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		struct size_class *class = &pool->size_class[i];
+
+		spin_lock(&class->lock);
+		stats->objs_size += (u64)class->objs_inuse * class->size;
+		spin_unlock(&class->lock);
+	}
+	stats->pages_compacted = atomic_long_read(&pool->pages_compacted);
+}
+EXPORT_SYMBOL_GPL(zs_get_stats);
+
+static int __init zs_init(void)
+{
+	int cpu;
+
+	zs_handle_cache = kmem_cache_create("zs_handle",
+				sizeof(struct zs_handle), 0, 0, NULL);
+	if (!zs_handle_cache)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		struct zs_map_area *area = &per_cpu(zs_map_area, cpu);
+
+		area->buf = kmalloc(ZS_MAX_ALLOC_SIZE, GFP_KERNEL);
+		if (!area->buf)
+			goto fail;
+	}
+
+	return 0;
+
+fail:
+	for_each_possible_cpu(cpu)
+		kfree(per_cpu(zs_map_area, cpu).buf);
+	kmem_cache_destroy(zs_handle_cache);
+	zs_handle_cache = NULL;
+	return -ENOMEM;
+}
+subsys_initcall(zs_init);
@@ -0,0 +1,117 @@
+/*
+ * zsmalloc memory allocator
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#ifndef _ZS_MALLOC_INT_H_
+#define _ZS_MALLOC_INT_H_
+
+#include <linux/kernel.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/types.h>
+
+/* User configurable params */
+
+#define ZS_MIN_ALLOC_SIZE	32
+#define ZS_MAX_ALLOC_SIZE	PAGE_SIZE
+
+/*
+ * Size classes are separated by ZS_SIZE_CLASS_DELTA bytes: 16 for 4k
+ * pages. Each class carves objects of exactly its size out of a
+ * "zspage" of up to ZS_MAX_PAGES_PER_ZSPAGE physical pages, so that
+ * large classes waste little at the end of the zspage.
+ */
+#define ZS_SIZE_CLASS_DELTA	(PAGE_SIZE >> 8)
+#define ZS_SIZE_CLASSES		((ZS_MAX_ALLOC_SIZE - ZS_MIN_ALLOC_SIZE) \
+					/ ZS_SIZE_CLASS_DELTA + 1)
+#define ZS_MAX_PAGES_PER_ZSPAGE	4
+
+/* A zspage is almost full when more than 3/4 of its slots are used */
+#define ZS_ALMOST_FULL_NUM	3
+#define ZS_ALMOST_FULL_DEN	4
+
+/* End of user params */
+
+enum fullness_group {
+	ZS_ALMOST_FULL,
+	ZS_ALMOST_EMPTY,
+	ZS_FULL,
+	_ZS_NR_FULLNESS_GROUPS,
+
+	/* No objects in use; also used for zspages not on any list */
+	ZS_EMPTY,
+};
+
+/*
+ * Free slots hold the index of the next free slot shifted left by one
+ * with ZS_SLOT_FREE set. Used slots hold the object's handle, which is
+ * at least word aligned.
+ */
+#define ZS_SLOT_FREE	1UL
+
+struct zspage;
+
+/*
+ * What zs_malloc() hands out. Callers only ever see a pointer to this,
+ * so objects can move between zspages without the caller noticing.
+ */
+struct zs_handle {
+	struct zspage *zspage;
+	unsigned int idx;
+};
+
+struct zspage {
+	struct list_head list;		/* in class->fullness_list[] */
+	struct size_class *class;
+	unsigned int inuse;		/* no. of objects allocated */
+	unsigned int free;		/* first free slot */
+	enum fullness_group fullness;
+	struct page *pages[ZS_MAX_PAGES_PER_ZSPAGE];
+	unsigned long slots[0];		/* objs_per_zspage entries */
+};
+
+struct size_class {
+	spinlock_t lock;
+	struct list_head fullness_list[_ZS_NR_FULLNESS_GROUPS];
+	unsigned int size;
+	unsigned int pages_per_zspage;
+	unsigned int objs_per_zspage;
+
+	/* Protected by lock */
+	unsigned long zspages;
+	unsigned long objs_inuse;
+};
+
+struct zs_pool {
+	struct size_class size_class[ZS_SIZE_CLASSES];
+
+	/*
+	 * Held for reading while an object is mapped or freed, and for
+	 * writing while zs_compact() moves objects around.
+	 */
+	rwlock_t migrate_lock;
+
+	atomic_long_t pages_allocated;
+	atomic_long_t pages_compacted;
+};
+
+/*
+ * Per-cpu state of zs_map_object(). Only one object can be mapped at
+ * a time on a given CPU.
+ */
+struct zs_map_area {
+	void *vaddr;		/* kmap_atomic() address, or NULL */
+	char *buf;		/* bounce buffer for spanning objects */
+	struct page *pages[2];
+	unsigned int off;
+	unsigned int size;
+	enum zs_mapmode mm;
+};
+
+#endif
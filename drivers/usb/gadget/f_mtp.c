@@ -30,6 +30,10 @@
 #include <linux/file.h>
 #include <linux/device.h>
 #include <linux/miscdevice.h>
+#include <linux/mm.h>
+#include <linux/pagemap.h>
+#include <linux/highmem.h>
+#include <linux/backing-dev.h>
 
 #include <linux/usb.h>
 #include <linux/usb_usual.h>
@@ -37,6 +41,7 @@
 #include <linux/usb/f_mtp.h>
 
 #define MTP_BULK_BUFFER_SIZE       16384
+#define MTP_BULK_BUFFER_MAX        131072
 #define INTR_BUFFER_SIZE           28
 
 /* String IDs */
@@ -50,8 +55,10 @@
 #define STATE_ERROR                 4   /* error from completion routine */
 
 /* number of tx and rx requests to allocate */
-#define TX_REQ_MAX 4
-#define RX_REQ_MAX 2
+#define MTP_TX_REQ_DEFAULT 8
+#define MTP_TX_REQ_MAX 32
+#define MTP_RX_REQ_DEFAULT 4
+#define MTP_RX_REQ_MAX 16
 #define INTR_REQ_MAX 5
 
 /* ID for Microsoft MTP OS String */
@@ -69,6 +76,37 @@
 
 static const char mtp_shortname[] = "mtp_usb";
 
+/*
+ * Bulk request sizing, applied when the function is bound.  Deeper queues
+ * and larger buffers keep the UDC busy while the file transfer worker is
+ * blocked in vfs_read/vfs_write.  If the larger buffers cannot be allocated
+ * we fall back to MTP_BULK_BUFFER_SIZE.
+ */
+static unsigned int mtp_tx_req_len = MTP_BULK_BUFFER_SIZE;
+module_param(mtp_tx_req_len, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(mtp_tx_req_len, "size of each bulk IN request buffer");
+
+static unsigned int mtp_tx_reqs = MTP_TX_REQ_DEFAULT;
+module_param(mtp_tx_reqs, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(mtp_tx_reqs, "number of bulk IN requests");
+
+static unsigned int mtp_rx_req_len = MTP_BULK_BUFFER_SIZE;
+module_param(mtp_rx_req_len, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(mtp_rx_req_len, "size of each bulk OUT request buffer");
+
+static unsigned int mtp_rx_reqs = MTP_RX_REQ_DEFAULT;
+module_param(mtp_rx_reqs, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(mtp_rx_reqs, "number of bulk OUT requests");
+
+/*
+ * Queue page cache pages directly on the IN endpoint for MTP_SEND_FILE
+ * instead of copying them into the request buffer.  Only worth enabling
+ * when the UDC does DMA and copes well with page sized requests.
+ */
+static bool mtp_zero_copy;
+module_param(mtp_zero_copy, bool, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(mtp_zero_copy, "send page cache pages without copying");
+
 struct mtp_dev {
 	struct usb_function function;
 	struct usb_composite_dev *cdev;
@@ -91,9 +129,15 @@ struct mtp_dev {
 	wait_queue_head_t read_wq;
 	wait_queue_head_t write_wq;
 	wait_queue_head_t intr_wq;
-	struct usb_request *rx_req[RX_REQ_MAX];
+	struct usb_request *rx_req[MTP_RX_REQ_MAX];
 	int rx_done;
 
+	/* request sizing chosen at bind time */
+	int tx_req_len;
+	int rx_req_len;
+	int tx_reqs;
+	int rx_reqs;
+
 	/* for processing MTP_SEND_FILE, MTP_RECEIVE_FILE and
 	 * MTP_SEND_FILE_WITH_HEADER ioctls on a work queue
 	 */
@@ -347,6 +391,22 @@ static struct usb_request
 	return req;
 }
 
+/*
+ * Drop the page cache references taken by mtp_send_pages and point the
+ * request back at its own buffer, which is kept in req->context.
+ */
+static void mtp_release_pages(struct usb_request *req)
+{
+	unsigned offset;
+
+	if (req->buf == req->context)
+		return;
+
+	for (offset = 0; offset < req->length; offset += PAGE_SIZE)
+		page_cache_release(virt_to_page(req->buf + offset));
+	req->buf = req->context;
+}
+
 static void mtp_complete_in(struct usb_ep *ep, struct usb_request *req)
 {
 	struct mtp_dev *dev = _mtp_dev;
@@ -354,6 +414,8 @@ static void mtp_complete_in(struct usb_ep *ep, struct usb_request *req)
 	if (req->status != 0)
 		dev->state = STATE_ERROR;
 
+	mtp_release_pages(req);
+
 	mtp_req_put(dev, &dev->tx_idle, req);
 
 	wake_up(&dev->write_wq);
@@ -363,8 +425,10 @@ static void mtp_complete_out(struct usb_ep *ep, struct usb_request *req)
 {
 	struct mtp_dev *dev = _mtp_dev;
 
-	dev->rx_done = 1;
-	if (req->status != 0)
+	/* counts completions so receive_file_work can keep several queued */
+	dev->rx_done++;
+	/* requests we dequeue ourselves are not an error */
+	if (req->status != 0 && req->status != -ECONNRESET)
 		dev->state = STATE_ERROR;
 
 	wake_up(&dev->read_wq);
@@ -382,6 +446,13 @@ static void mtp_complete_intr(struct usb_ep *ep, struct usb_request *req)
 	wake_up(&dev->intr_wq);
 }
 
+/* clamp a requested bulk buffer size to something we can allocate */
+static int mtp_bulk_req_len(unsigned int len)
+{
+	len = clamp_t(unsigned int, len, PAGE_SIZE, MTP_BULK_BUFFER_MAX);
+	return round_down(len, PAGE_SIZE);
+}
+
 static int mtp_create_bulk_endpoints(struct mtp_dev *dev,
 				struct usb_endpoint_descriptor *in_desc,
 				struct usb_endpoint_descriptor *out_desc,
@@ -430,16 +501,33 @@ static int mtp_create_bulk_endpoints(struct mtp_dev *dev,
 	ep->driver_data = dev;		/* claim the endpoint */
 	dev->ep_intr = ep;
 
+	dev->tx_req_len = mtp_bulk_req_len(mtp_tx_req_len);
+	dev->rx_req_len = mtp_bulk_req_len(mtp_rx_req_len);
+	dev->tx_reqs = clamp_t(unsigned int, mtp_tx_reqs, 1, MTP_TX_REQ_MAX);
+	/* one rx buffer is always being written out while the rest are queued */
+	dev->rx_reqs = clamp_t(unsigned int, mtp_rx_reqs, 2, MTP_RX_REQ_MAX);
+
 	/* now allocate requests for our endpoints */
-	for (i = 0; i < TX_REQ_MAX; i++) {
-		req = mtp_request_new(dev->ep_in, MTP_BULK_BUFFER_SIZE);
+	for (i = 0; i < dev->tx_reqs; i++) {
+		req = mtp_request_new(dev->ep_in, dev->tx_req_len);
+		if (!req && dev->tx_req_len > MTP_BULK_BUFFER_SIZE) {
+			/* earlier requests are larger, which does no harm */
+			dev->tx_req_len = MTP_BULK_BUFFER_SIZE;
+			req = mtp_request_new(dev->ep_in, dev->tx_req_len);
+		}
 		if (!req)
 			goto fail;
 		req->complete = mtp_complete_in;
+		/* remember our own buffer while page cache pages are queued */
+		req->context = req->buf;
 		mtp_req_put(dev, &dev->tx_idle, req);
 	}
-	for (i = 0; i < RX_REQ_MAX; i++) {
-		req = mtp_request_new(dev->ep_out, MTP_BULK_BUFFER_SIZE);
+	for (i = 0; i < dev->rx_reqs; i++) {
+		req = mtp_request_new(dev->ep_out, dev->rx_req_len);
+		if (!req && dev->rx_req_len > MTP_BULK_BUFFER_SIZE) {
+			dev->rx_req_len = MTP_BULK_BUFFER_SIZE;
+			req = mtp_request_new(dev->ep_out, dev->rx_req_len);
+		}
 		if (!req)
 			goto fail;
 		req->complete = mtp_complete_out;
@@ -471,7 +559,7 @@ static ssize_t mtp_read(struct file *fp, char __user *buf,
 
 	DBG(cdev, "mtp_read(%d)\n", count);
 
-	if (count > MTP_BULK_BUFFER_SIZE)
+	if (count > dev->rx_req_len)
 		return -EINVAL;
 
 	/* we will block until we're online */
@@ -590,8 +678,8 @@ static ssize_t mtp_write(struct file *fp, const char __user *buf,
 			break;
 		}
 
-		if (count > MTP_BULK_BUFFER_SIZE)
-			xfer = MTP_BULK_BUFFER_SIZE;
+		if (count > dev->tx_req_len)
+			xfer = dev->tx_req_len;
 		else
 			xfer = count;
 		if (xfer && copy_from_user(req->buf, buf, xfer)) {
@@ -628,6 +716,76 @@ static ssize_t mtp_write(struct file *fp, const char __user *buf,
 	return r;
 }
 
+/*
+ * Widen the readahead window the way POSIX_FADV_SEQUENTIAL does, and make
+ * sure it covers at least our whole tx queue.
+ */
+static void mtp_file_readahead(struct mtp_dev *dev, struct file *filp)
+{
+	struct backing_dev_info *bdi = filp->f_mapping->backing_dev_info;
+	unsigned long ra_pages;
+
+	ra_pages = max_t(unsigned long, bdi->ra_pages * 2,
+			(dev->tx_req_len >> PAGE_SHIFT) * dev->tx_reqs);
+	if (filp->f_ra.ra_pages < ra_pages)
+		filp->f_ra.ra_pages = ra_pages;
+}
+
+/*
+ * Point req at the page cache pages backing filp at offset instead of
+ * copying them into req->buf.  Without scatter/gather in the gadget API a
+ * request has to be virtually contiguous, so we stop at the first page that
+ * is in highmem or does not follow the previous one in the linear map.
+ * Only whole pages inside i_size are used.  Returns the number of bytes
+ * queued, or 0 if the caller should fall back to vfs_read.
+ */
+static int mtp_send_pages(struct mtp_dev *dev, struct usb_request *req,
+		struct file *filp, loff_t offset, int64_t count)
+{
+	struct address_space *mapping = filp->f_mapping;
+	loff_t isize = i_size_read(mapping->host);
+	struct page *page;
+	pgoff_t index;
+	char *buf = NULL;
+	int len = 0;
+
+	if ((offset & ~PAGE_MASK) || !mapping->a_ops->readpage)
+		return 0;
+
+	while (len + PAGE_SIZE <= count && len + PAGE_SIZE <= dev->tx_req_len
+			&& offset + len + PAGE_SIZE <= isize) {
+		index = (offset + len) >> PAGE_SHIFT;
+		page = find_get_page(mapping, index);
+		if (!page) {
+			page_cache_sync_readahead(mapping, &filp->f_ra, filp,
+					index, (count - len) >> PAGE_SHIFT);
+			page = read_mapping_page(mapping, index, filp);
+			if (IS_ERR(page))
+				break;
+		} else if (!PageUptodate(page)) {
+			page_cache_release(page);
+			page = read_mapping_page(mapping, index, filp);
+			if (IS_ERR(page))
+				break;
+		}
+
+		if (PageHighMem(page) ||
+				(buf && page_address(page) != buf + len)) {
+			page_cache_release(page);
+			break;
+		}
+		if (!buf)
+			buf = page_address(page);
+		len += PAGE_SIZE;
+	}
+
+	if (len) {
+		req->buf = buf;
+		req->length = len;
+	}
+	return len;
+}
+
 /* read from a local file and write to USB */
 static void send_file_work(struct work_struct *data) {
 	struct mtp_dev	*dev = container_of(data, struct mtp_dev, send_file_work);
@@ -662,6 +820,8 @@ static void send_file_work(struct work_struct *data) {
 	if ((count & (dev->zlp_maxpacket - 1)) == 0)
 		sendZLP = 1;
 
+	mtp_file_readahead(dev, filp);
+
 	while (count > 0 || sendZLP) {
 		/* so we exit after sending ZLP */
 		if (count == 0)
@@ -681,8 +841,16 @@ static void send_file_work(struct work_struct *data) {
 			break;
 		}
 
-		if (count > MTP_BULK_BUFFER_SIZE)
-			xfer = MTP_BULK_BUFFER_SIZE;
+		if (mtp_zero_copy && !hdr_size) {
+			xfer = mtp_send_pages(dev, req, filp, offset, count);
+			if (xfer) {
+				offset += xfer;
+				goto queue_req;
+			}
+		}
+
+		if (count > dev->tx_req_len)
+			xfer = dev->tx_req_len;
 		else
 			xfer = count;
 
@@ -704,9 +872,11 @@ static void send_file_work(struct work_struct *data) {
 		hdr_size = 0;
 
 		req->length = xfer;
+queue_req:
 		ret = usb_ep_queue(dev->ep_in, req, GFP_KERNEL);
 		if (ret < 0) {
 			DBG(cdev, "send_file_work: xfer error %d\n", ret);
+			mtp_release_pages(req);
 			dev->state = STATE_ERROR;
 			r = -EIO;
 			break;
@@ -732,11 +902,11 @@ static void receive_file_work(struct work_struct *data)
 {
 	struct mtp_dev	*dev = container_of(data, struct mtp_dev, receive_file_work);
 	struct usb_composite_dev *cdev = dev->cdev;
-	struct usb_request *read_req = NULL, *write_req = NULL;
+	struct usb_request *read_req, *write_req = NULL;
 	struct file *filp;
 	loff_t offset;
 	int64_t count;
-	int ret, cur_buf = 0;
+	int ret, head = 0, tail = 0, queued = 0, done = 0, depth;
 	int r = 0;
 
 	/* read our parameters */
@@ -747,21 +917,33 @@ static void receive_file_work(struct work_struct *data)
 
 	DBG(cdev, "receive_file_work(%lld)\n", count);
 
-	while (count > 0 || write_req) {
-		if (count > 0) {
-			/* queue a request */
-			read_req = dev->rx_req[cur_buf];
-			cur_buf = (cur_buf + 1) % RX_REQ_MAX;
+	/* if xfer_file_length is 0xFFFFFFFF, then we read until we get a
+	 * short packet, so never have more than one read queued past it.
+	 * Otherwise keep every buffer but the one being written out busy.
+	 */
+	if (count == 0xFFFFFFFF)
+		depth = 1;
+	else
+		depth = dev->rx_reqs - 1;
+	dev->rx_done = 0;
 
-			read_req->length = (count > MTP_BULK_BUFFER_SIZE
-					? MTP_BULK_BUFFER_SIZE : count);
-			dev->rx_done = 0;
+	for (;;) {
+		/* queue reads for the data we have not asked for yet */
+		while (count > 0 && queued < depth) {
+			read_req = dev->rx_req[tail];
+			read_req->length = (count > dev->rx_req_len
+					? dev->rx_req_len : count);
 			ret = usb_ep_queue(dev->ep_out, read_req, GFP_KERNEL);
 			if (ret < 0) {
+				/* still write out what was already received */
 				r = -EIO;
 				dev->state = STATE_ERROR;
 				break;
 			}
+			tail = (tail + 1) % dev->rx_reqs;
+			queued++;
+			if (count != 0xFFFFFFFF)
+				count -= read_req->length;
 		}
 
 		if (write_req) {
@@ -777,30 +959,44 @@ static void receive_file_work(struct work_struct *data)
 			write_req = NULL;
 		}
 
-		if (read_req) {
-			/* wait for our last read to complete */
-			ret = wait_event_interruptible(dev->read_wq,
-				dev->rx_done || dev->state != STATE_BUSY);
-			if (dev->state == STATE_CANCELED) {
-				r = -ECANCELED;
-				if (!dev->rx_done)
-					usb_ep_dequeue(dev->ep_out, read_req);
-				break;
-			}
-			/* if xfer_file_length is 0xFFFFFFFF, then we read until
-			 * we get a zero length packet
-			 */
-			if (count != 0xFFFFFFFF)
-				count -= read_req->actual;
-			if (read_req->actual < read_req->length) {
-				/* short packet is used to signal EOF for sizes > 4 gig */
-				DBG(cdev, "got short packet\n");
-				count = 0;
-			}
+		if (r || !queued)
+			break;
 
-			write_req = read_req;
-			read_req = NULL;
+		/* wait for the oldest read to complete, they finish in order */
+		read_req = dev->rx_req[head];
+		ret = wait_event_interruptible(dev->read_wq,
+			dev->rx_done != done || dev->state != STATE_BUSY);
+		if (dev->state == STATE_CANCELED) {
+			r = -ECANCELED;
+			break;
 		}
+		if (dev->rx_done == done) {
+			r = -EIO;
+			break;
+		}
+		done++;
+		head = (head + 1) % dev->rx_reqs;
+		queued--;
+
+		if (read_req->actual < read_req->length) {
+			/* short packet is used to signal EOF for sizes > 4 gig */
+			DBG(cdev, "got short packet\n");
+			count = 0;
+			while (queued) {
+				usb_ep_dequeue(dev->ep_out, dev->rx_req[head]);
+				head = (head + 1) % dev->rx_reqs;
+				queued--;
+			}
+		}
+
+		write_req = read_req;
+	}
+
+	/* give back anything still queued after an error or cancel */
+	while (queued) {
+		usb_ep_dequeue(dev->ep_out, dev->rx_req[head]);
+		head = (head + 1) % dev->rx_reqs;
+		queued--;
 	}
 
 	DBG(cdev, "receive_file_work returning %d\n", r);
@@ -1139,8 +1335,10 @@ mtp_function_unbind(struct usb_configuration *c, struct usb_function *f)
 
 	while ((req = mtp_req_get(dev, &dev->tx_idle)))
 		mtp_request_free(req, dev->ep_in);
-	for (i = 0; i < RX_REQ_MAX; i++)
+	for (i = 0; i < MTP_RX_REQ_MAX; i++) {
 		mtp_request_free(dev->rx_req[i], dev->ep_out);
+		dev->rx_req[i] = NULL;
+	}
 	while ((req = mtp_req_get(dev, &dev->intr_idle)))
 		mtp_request_free(req, dev->ep_intr);
 	dev->state = STATE_OFFLINE;
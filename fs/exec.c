@@ -959,8 +959,15 @@ static int de_thread(struct task_struct *tsk)
 		list_replace_rcu(&leader->tasks, &tsk->tasks);
 		list_replace_init(&leader->sibling, &tsk->sibling);
 
+		/*
+		 * The siglock keeps oom_adj writers, which move the group
+		 * leader between lowmem_adj lists, from seeing it change.
+		 */
+		spin_lock(lock);
 		tsk->group_leader = tsk;
 		leader->group_leader = tsk;
+		lowmem_adj_replace(leader, tsk);
+		spin_unlock(lock);
 
 		tsk->exit_signal = SIGCHLD;
 
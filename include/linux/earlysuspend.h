@@ -17,6 +17,7 @@
 #define _LINUX_EARLYSUSPEND_H
 
 #ifdef CONFIG_HAS_EARLYSUSPEND
+#include <linux/ktime.h>
 #include <linux/list.h>
 #endif
 
@@ -29,6 +30,11 @@
  * the suspend handlers have already been called without a matching call to the
  * resume handlers, the suspend handler will be called directly from
  * register_early_suspend. This direct call can violate the normal level order.
+ * With the earlysuspend "parallel" parameter set, handlers registered at the
+ * same level are called concurrently, so any ordering between two handlers
+ * should be expressed with different levels.
+ * suspend_time and resume_time hold how long the last call of each handler
+ * took and are maintained by the early suspend core.
  */
 enum {
 	EARLY_SUSPEND_LEVEL_BLANK_SCREEN = 50,
@@ -41,6 +47,8 @@ struct early_suspend {
 	int level;
 	void (*suspend)(struct early_suspend *h);
 	void (*resume)(struct early_suspend *h);
+	ktime_t suspend_time;
+	ktime_t resume_time;
 #endif
 };
 
@@ -42,6 +42,16 @@ enum ion_heap_type {
 #define ION_HEAP_SYSTEM_CONTIG_MASK	(1 << ION_HEAP_TYPE_SYSTEM_CONTIG)
 #define ION_HEAP_CARVEOUT_MASK		(1 << ION_HEAP_TYPE_CARVEOUT)
 
+/*
+ * Allocation flags, passed in the top bits of ion_allocation_data.flags
+ * above the heap id mask, so heap ids must stay below 24.
+ *
+ * ION_FLAG_WRITECOMBINE: map a system heap buffer write-combined into
+ * userspace instead of cacheable, so that cpu writes reach memory without
+ * an ION_IOC_SYNC.
+ */
+#define ION_FLAG_WRITECOMBINE		(1U << 31)
+
 #ifdef __KERNEL__
 struct ion_device;
 struct ion_heap;
@@ -325,6 +335,78 @@ struct ion_cached_user_buf_data {
 	size_t size;
 };
 
+/**
+ * enum ion_sync_op - cache maintenance requested through ION_IOC_SYNC
+ * @ION_SYNC_CLEAN:		write dirty cache lines back to memory, e.g.
+ *				after the cpu filled a buffer through a
+ *				cacheable mapping
+ * @ION_SYNC_INVALIDATE:	discard cache lines, e.g. before the cpu reads
+ *				what a device wrote to the buffer
+ * @ION_SYNC_FLUSH:		clean and invalidate
+ */
+enum ion_sync_op {
+	ION_SYNC_CLEAN,
+	ION_SYNC_INVALIDATE,
+	ION_SYNC_FLUSH,
+};
+
+/**
+ * struct ion_sync_data - metadata passed from userspace for cache maintenance
+ * @handle:	a handle
+ * @offset:	offset into the buffer of the range to operate on
+ * @len:	length of the range, or 0 for everything from @offset onward
+ * @op:		one of enum ion_sync_op
+ *
+ * Unlike ION_IOC_FLUSH_CACHED and ION_IOC_INVAL_CACHED the range is given
+ * relative to the buffer, so no mapping needs to exist in the caller.
+ */
+struct ion_sync_data {
+	struct ion_handle *handle;
+	size_t offset;
+	size_t len;
+	unsigned int op;
+};
+
+/**
+ * struct ion_heap_usage_data - usage counters of one heap
+ * @id:		id of the heap
+ * @type:	type of the heap, from enum ion_heap_type
+ * @allocated:	bytes of live buffers allocated from the heap
+ * @mapped:	bytes of buffers mapped by at least one handle
+ * @shared:	bytes of buffers referenced by more than one handle
+ * @orphaned:	bytes of buffers that are only kept alive by share fds or
+ *		mappings, with no handle left in any client
+ */
+struct ion_heap_usage_data {
+	int id;
+	unsigned int type;
+	__u64 allocated;
+	__u64 mapped;
+	__u64 shared;
+	__u64 orphaned;
+};
+
+/**
+ * struct ion_usage_data - metadata passed to/from userspace for usage queries
+ * @allocated:	bytes of buffers the calling client holds handles to
+ * @mapped:	bytes of those buffers the client has mapped
+ * @shared:	bytes of those buffers the client imported from others
+ * @num_heaps:	number of entries in @heaps on input, number of heaps in
+ *		the system on output
+ * @heaps:	array filled with the usage of up to @num_heaps heaps
+ *
+ * All counters are maintained as buffers are allocated, mapped, shared and
+ * freed, so a query costs a few atomic reads per heap and never waits for
+ * allocations in progress.
+ */
+struct ion_usage_data {
+	__u64 allocated;
+	__u64 mapped;
+	__u64 shared;
+	unsigned int num_heaps;
+	struct ion_heap_usage_data *heaps;
+};
+
 #define ION_IOC_MAGIC		'I'
 
 /**
@@ -386,4 +468,22 @@ struct ion_cached_user_buf_data {
 #define ION_IOC_INVAL_CACHED	_IOWR(ION_IOC_MAGIC, 8, \
 					struct ion_cached_user_buf_data)
 
+/**
+ * DOC: ION_IOC_SYNC - clean and/or invalidate a range of a buffer
+ *
+ * Takes an ion_sync_data struct.  Lets buffers with cacheable user mappings
+ * (system heap buffers by default, carveout buffers mapped with cacheable set
+ * in ION_IOC_MAP) be shared with devices: clean after the cpu writes,
+ * invalidate before it reads.
+ */
+#define ION_IOC_SYNC		_IOWR(ION_IOC_MAGIC, 9, struct ion_sync_data)
+
+/**
+ * DOC: ION_IOC_USAGE - query memory usage counters
+ *
+ * Takes an ion_usage_data struct and fills in the counters of the calling
+ * client and of every heap.
+ */
+#define ION_IOC_USAGE		_IOWR(ION_IOC_MAGIC, 10, struct ion_usage_data)
+
 #endif /* _LINUX_ION_H */
@@ -1,6 +1,9 @@
 #ifndef _XT_QTAGUID_MATCH_H
 #define _XT_QTAGUID_MATCH_H
 
+#include <linux/types.h>
+#include <linux/if.h>
+
 /* For now we just replace the xt_owner.
  * FIXME: make iptables aware of qtaguid. */
 #include <linux/netfilter/xt_owner.h>
@@ -10,4 +13,59 @@
 #define XT_QTAGUID_SOCKET XT_OWNER_SOCKET
 #define xt_qtaguid_match_info xt_owner_match_info
 
+/*
+ * Binary layout of /proc/net/xt_qtaguid/stats_bin.
+ *
+ * A read returns one struct xt_qtaguid_stats_hdr followed by
+ * struct xt_qtaguid_stats_rec records of hdr.record_size bytes each, one
+ * per {iface, acct_tag, uid}. Writing the decimal generation of a previous
+ * dump to the file before reading it from offset 0 limits the records to
+ * the ones that changed since that dump. If that is not possible, e.g. tags
+ * were deleted in the meantime, XT_QTAGUID_STATS_FULL is set and every
+ * record is returned.
+ */
+#define XT_QTAGUID_STATS_MAGIC   0x51544753  /* "QTGS" */
+#define XT_QTAGUID_STATS_VERSION 1
+
+/* xt_qtaguid_stats_hdr.flags */
+#define XT_QTAGUID_STATS_FULL    (1 << 0)
+
+#define XT_QTAGUID_STATS_SETS    2
+
+enum {
+	XT_QTAGUID_STATS_RX,
+	XT_QTAGUID_STATS_TX,
+	XT_QTAGUID_STATS_DIRS
+};
+
+enum {
+	XT_QTAGUID_STATS_TCP,
+	XT_QTAGUID_STATS_UDP,
+	XT_QTAGUID_STATS_OTHER,
+	XT_QTAGUID_STATS_PROTOS
+};
+
+struct xt_qtaguid_stats_hdr {
+	__u32 magic;
+	__u16 version;
+	__u16 flags;
+	__u32 record_size;
+	/* Pass back to get only the records changed after this dump */
+	__u32 generation;
+};
+
+struct xt_qtaguid_stats_bpc {
+	__u64 bytes;
+	__u64 packets;
+};
+
+struct xt_qtaguid_stats_rec {
+	char ifname[IFNAMSIZ];
+	__u32 acct_tag;
+	__u32 uid;
+	struct xt_qtaguid_stats_bpc
+	counters[XT_QTAGUID_STATS_SETS][XT_QTAGUID_STATS_DIRS]
+		[XT_QTAGUID_STATS_PROTOS];
+};
+
 #endif /* _XT_QTAGUID_MATCH_H */
@@ -18,6 +18,8 @@
 
 #include <linux/list.h>
 #include <linux/ktime.h>
+#include <linux/rbtree.h>
+#include <linux/types.h>
 
 /* A wake_lock prevents the system from entering suspend or other low power
  * states when active. If the type is set to WAKE_LOCK_SUSPEND, the wake_lock
@@ -32,9 +34,40 @@ enum {
 	WAKE_LOCK_TYPE_COUNT
 };
 
+/* One record per pass of the suspend worker, read back-to-back from the
+ * debugfs file "suspend_attempts".  Times are in nanoseconds; blockers lists
+ * the wake locks that kept the attempt from going ahead (untimed locks first,
+ * then timed ones by latest expiry) and wakeup_lock the first suspend lock
+ * taken after devices were suspended.  wakeup_irq is -1 when no wakeup
+ * interrupt was reported.
+ */
+#define SUSPEND_ATTEMPT_MAX_BLOCKERS	4
+#define SUSPEND_ATTEMPT_NAME_LEN	32
+
+#define SUSPEND_ATTEMPT_WAKE_LOCK	(1U << 0) /* wake lock held, not tried */
+#define SUSPEND_ATTEMPT_LATE_ABORT	(1U << 1) /* wake lock taken in noirq */
+#define SUSPEND_ATTEMPT_NO_EVENT	(1U << 2) /* resumed with no wake lock */
+#define SUSPEND_ATTEMPT_BACKOFF		(1U << 3) /* started suspend backoff */
+
+struct suspend_attempt {
+	__u32	seq;
+	__u32	flags;
+	__s32	result;
+	__s32	wakeup_irq;
+	__u32	nr_blockers;
+	__u32	reserved;
+	__u64	start_ns;
+	__u64	early_suspend_ns;
+	__u64	dpm_suspend_ns;
+	__u64	suspend_ns;
+	char	wakeup_lock[SUSPEND_ATTEMPT_NAME_LEN];
+	char	blockers[SUSPEND_ATTEMPT_MAX_BLOCKERS][SUSPEND_ATTEMPT_NAME_LEN];
+};
+
 struct wake_lock {
 #ifdef CONFIG_HAS_WAKELOCK
 	struct list_head    link;
+	struct rb_node      expire_node;
 	int                 flags;
 	const char         *name;
 	unsigned long       expires;
@@ -45,6 +78,7 @@ struct wake_lock {
 		int             wakeup_count;
 		ktime_t         total_time;
 		ktime_t         prevent_suspend_time;
+		ktime_t         prevent_suspend_start;
 		ktime_t         max_time;
 		ktime_t         last_time;
 	} stat;
@@ -88,5 +122,15 @@ static inline long has_wake_lock(int type) { return 0; }
 
 #endif
 
+#ifdef CONFIG_WAKELOCK_STAT
+/* Record the interrupt that woke the system, or aborted the current suspend
+ * attempt, in the suspend_attempts log.  May be called from platform resume
+ * code with interrupts disabled.
+ */
+void suspend_profile_wakeup_irq(int irq);
+#else
+static inline void suspend_profile_wakeup_irq(int irq) {}
+#endif
+
 #endif
 
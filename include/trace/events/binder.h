@@ -0,0 +1,90 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM binder
+
+#if !defined(_TRACE_BINDER_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TRACE_BINDER_H
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(binder_transaction,
+	    TP_PROTO(int debug_id, int reply, int from_proc, int from_thread,
+		     int to_proc, int to_thread, int to_node,
+		     unsigned int code, unsigned int flags),
+	    TP_ARGS(debug_id, reply, from_proc, from_thread, to_proc,
+		    to_thread, to_node, code, flags),
+
+	    TP_STRUCT__entry(
+		    __field(int, debug_id)
+		    __field(int, reply)
+		    __field(int, from_proc)
+		    __field(int, from_thread)
+		    __field(int, to_proc)
+		    __field(int, to_thread)
+		    __field(int, to_node)
+		    __field(unsigned int, code)
+		    __field(unsigned int, flags)
+	    ),
+
+	    TP_fast_assign(
+		    __entry->debug_id = debug_id;
+		    __entry->reply = reply;
+		    __entry->from_proc = from_proc;
+		    __entry->from_thread = from_thread;
+		    __entry->to_proc = to_proc;
+		    __entry->to_thread = to_thread;
+		    __entry->to_node = to_node;
+		    __entry->code = code;
+		    __entry->flags = flags;
+	    ),
+
+	    TP_printk("transaction=%d %s from %d:%d to %d:%d node=%d "
+		      "code=0x%x flags=0x%x",
+		      __entry->debug_id,
+		      __entry->reply ? "reply" : "call",
+		      __entry->from_proc, __entry->from_thread,
+		      __entry->to_proc, __entry->to_thread,
+		      __entry->to_node, __entry->code, __entry->flags)
+);
+
+DECLARE_EVENT_CLASS(binder_latency,
+	    TP_PROTO(int debug_id, int pid, int node, s64 usecs),
+	    TP_ARGS(debug_id, pid, node, usecs),
+
+	    TP_STRUCT__entry(
+		    __field(int, debug_id)
+		    __field(int, pid)
+		    __field(int, node)
+		    __field(s64, usecs)
+	    ),
+
+	    TP_fast_assign(
+		    __entry->debug_id = debug_id;
+		    __entry->pid = pid;
+		    __entry->node = node;
+		    __entry->usecs = usecs;
+	    ),
+
+	    TP_printk("transaction=%d proc=%d node=%d usecs=%lld",
+		      __entry->debug_id, __entry->pid, __entry->node,
+		      __entry->usecs)
+);
+
+DEFINE_EVENT(binder_latency, binder_queue_latency,
+	    TP_PROTO(int debug_id, int pid, int node, s64 usecs),
+	    TP_ARGS(debug_id, pid, node, usecs)
+);
+
+DEFINE_EVENT(binder_latency, binder_reply_latency,
+	    TP_PROTO(int debug_id, int pid, int node, s64 usecs),
+	    TP_ARGS(debug_id, pid, node, usecs)
+);
+
+DEFINE_EVENT(binder_latency, binder_alloc_latency,
+	    TP_PROTO(int debug_id, int pid, int node, s64 usecs),
+	    TP_ARGS(debug_id, pid, node, usecs)
+);
+
+#endif /* _TRACE_BINDER_H */
+
+/* This part must be outside protection */
+#include <trace/define_trace.h>
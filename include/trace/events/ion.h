@@ -0,0 +1,60 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM ion
+
+#if !defined(_TRACE_ION_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TRACE_ION_H
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(ion_alloc,
+	    TP_PROTO(const char *client, pid_t pid, const char *heap,
+		     const void *buf, size_t len, unsigned int flags),
+	    TP_ARGS(client, pid, heap, buf, len, flags),
+
+	    TP_STRUCT__entry(
+		    __string(client, client)
+		    __field(pid_t, pid)
+		    __string(heap, heap)
+		    __field(const void *, buf)
+		    __field(size_t, len)
+		    __field(unsigned int, flags)
+	    ),
+
+	    TP_fast_assign(
+		    __assign_str(client, client);
+		    __entry->pid = pid;
+		    __assign_str(heap, heap);
+		    __entry->buf = buf;
+		    __entry->len = len;
+		    __entry->flags = flags;
+	    ),
+
+	    TP_printk("client=%s pid=%d heap=%s buf=%p len=%zu flags=0x%x",
+		      __get_str(client), __entry->pid, __get_str(heap),
+		      __entry->buf, __entry->len, __entry->flags)
+);
+
+TRACE_EVENT(ion_free,
+	    TP_PROTO(const char *heap, const void *buf, size_t len),
+	    TP_ARGS(heap, buf, len),
+
+	    TP_STRUCT__entry(
+		    __string(heap, heap)
+		    __field(const void *, buf)
+		    __field(size_t, len)
+	    ),
+
+	    TP_fast_assign(
+		    __assign_str(heap, heap);
+		    __entry->buf = buf;
+		    __entry->len = len;
+	    ),
+
+	    TP_printk("heap=%s buf=%p len=%zu",
+		      __get_str(heap), __entry->buf, __entry->len)
+);
+
+#endif /* _TRACE_ION_H */
+
+/* This part must be outside protection */
+#include <trace/define_trace.h>
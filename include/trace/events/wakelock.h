@@ -0,0 +1,72 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM wakelock
+
+#if !defined(_TRACE_WAKELOCK_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TRACE_WAKELOCK_H
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(suspend_attempt,
+	    TP_PROTO(u32 seq, u32 flags, int result, int wakeup_irq,
+		     u64 early_suspend_ns, u64 dpm_suspend_ns, u64 suspend_ns),
+	    TP_ARGS(seq, flags, result, wakeup_irq, early_suspend_ns,
+		    dpm_suspend_ns, suspend_ns),
+
+	    TP_STRUCT__entry(
+		    __field(u32, seq)
+		    __field(u32, flags)
+		    __field(int, result)
+		    __field(int, wakeup_irq)
+		    __field(u64, early_suspend_ns)
+		    __field(u64, dpm_suspend_ns)
+		    __field(u64, suspend_ns)
+	    ),
+
+	    TP_fast_assign(
+		    __entry->seq = seq;
+		    __entry->flags = flags;
+		    __entry->result = result;
+		    __entry->wakeup_irq = wakeup_irq;
+		    __entry->early_suspend_ns = early_suspend_ns;
+		    __entry->dpm_suspend_ns = dpm_suspend_ns;
+		    __entry->suspend_ns = suspend_ns;
+	    ),
+
+	    TP_printk("attempt=%u flags=0x%x result=%d irq=%d "
+		      "early_suspend_ns=%llu dpm_suspend_ns=%llu suspend_ns=%llu",
+		      __entry->seq, __entry->flags, __entry->result,
+		      __entry->wakeup_irq, __entry->early_suspend_ns,
+		      __entry->dpm_suspend_ns, __entry->suspend_ns)
+);
+
+DECLARE_EVENT_CLASS(suspend_lock,
+	    TP_PROTO(u32 seq, const char *name),
+	    TP_ARGS(seq, name),
+
+	    TP_STRUCT__entry(
+		    __field(u32, seq)
+		    __string(name, name)
+	    ),
+
+	    TP_fast_assign(
+		    __entry->seq = seq;
+		    __assign_str(name, name);
+	    ),
+
+	    TP_printk("attempt=%u lock=%s", __entry->seq, __get_str(name))
+);
+
+DEFINE_EVENT(suspend_lock, suspend_blocker,
+	    TP_PROTO(u32 seq, const char *name),
+	    TP_ARGS(seq, name)
+);
+
+DEFINE_EVENT(suspend_lock, suspend_wakeup_lock,
+	    TP_PROTO(u32 seq, const char *name),
+	    TP_ARGS(seq, name)
+);
+
+#endif /* _TRACE_WAKELOCK_H */
+
+/* This part must be outside protection */
+#include <trace/define_trace.h>
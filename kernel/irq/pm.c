@@ -10,6 +10,7 @@
 #include <linux/module.h>
 #include <linux/interrupt.h>
 #include <linux/syscore_ops.h>
+#include <linux/wakelock.h>
 
 #include "internals.h"
 
@@ -109,6 +110,7 @@ int check_wakeup_irqs(void)
 					irq,
 					desc->action && desc->action->name ?
 					desc->action->name : "");
+				suspend_profile_wakeup_irq(irq);
 				return -EBUSY;
 			}
 			continue;
@@ -13,10 +13,13 @@
  *
  */
 
+#include <linux/async.h>
+#include <linux/debugfs.h>
 #include <linux/earlysuspend.h>
 #include <linux/module.h>
 #include <linux/mutex.h>
 #include <linux/rtc.h>
+#include <linux/seq_file.h>
 #include <linux/syscalls.h> /* sys_sync */
 #include <linux/wakelock.h>
 #include <linux/workqueue.h>
@@ -31,10 +34,20 @@ enum {
 static int debug_mask = DEBUG_USER_STATE;
 module_param_named(debug_mask, debug_mask, int, S_IRUGO | S_IWUSR | S_IWGRP);
 
+/*
+ * Run the handlers of one level concurrently on the async threads.  Off by
+ * default: several in-tree handlers sharing a level still depend on each
+ * other's order, e.g. dsscomp's gralloc blanking and the gcx queue drain at
+ * DISABLE_FB, or the console switch and fb early suspend at STOP_DRAWING.
+ */
+static int parallel;
+module_param(parallel, int, S_IRUGO | S_IWUSR | S_IWGRP);
+
 static DEFINE_MUTEX(early_suspend_lock);
 static LIST_HEAD(early_suspend_handlers);
 static void early_suspend(struct work_struct *work);
 static void late_resume(struct work_struct *work);
+static void early_suspend_call(void *data, async_cookie_t cookie);
 static DECLARE_WORK(early_suspend_work, early_suspend);
 static DECLARE_WORK(late_resume_work, late_resume);
 static DEFINE_SPINLOCK(state_lock);
@@ -61,7 +74,7 @@ void register_early_suspend(struct early_suspend *handler)
 	}
 	list_add_tail(&handler->link, pos);
 	if ((state & SUSPENDED) && handler->suspend)
-		handler->suspend(handler);
+		early_suspend_call(handler, 0);
 	mutex_unlock(&early_suspend_lock);
 }
 EXPORT_SYMBOL(register_early_suspend);
@@ -74,10 +87,68 @@ void unregister_early_suspend(struct early_suspend *handler)
 }
 EXPORT_SYMBOL(unregister_early_suspend);
 
-static void early_suspend(struct work_struct *work)
+static void early_suspend_call(void *data, async_cookie_t cookie)
+{
+	struct early_suspend *h = data;
+	ktime_t start;
+
+	if (debug_mask & DEBUG_VERBOSE)
+		pr_info("early_suspend: calling %pf\n", h->suspend);
+	start = ktime_get();
+	h->suspend(h);
+	h->suspend_time = ktime_sub(ktime_get(), start);
+}
+
+static void late_resume_call(void *data, async_cookie_t cookie)
+{
+	struct early_suspend *h = data;
+	ktime_t start;
+
+	if (debug_mask & DEBUG_VERBOSE)
+		pr_info("late_resume: calling %pf\n", h->resume);
+	start = ktime_get();
+	h->resume(h);
+	h->resume_time = ktime_sub(ktime_get(), start);
+}
+
+/*
+ * Call the suspend (or, walking the list backwards, the resume) handlers.
+ * Handlers at the same level are started together and the whole level is
+ * waited for before moving on to the next one.  Caller must hold
+ * early_suspend_lock.
+ */
+static void call_handlers(bool resume)
 {
+	LIST_HEAD(domain);
 	struct early_suspend *pos;
+	async_func_ptr *call = resume ? late_resume_call : early_suspend_call;
+	int level = 0;
+	bool first = true;
+
+	pos = list_entry(resume ? early_suspend_handlers.prev :
+			 early_suspend_handlers.next, struct early_suspend, link);
+	while (&pos->link != &early_suspend_handlers) {
+		if (first || pos->level != level) {
+			async_synchronize_full_domain(&domain);
+			level = pos->level;
+			first = false;
+		}
+		if (resume ? pos->resume : pos->suspend) {
+			if (parallel)
+				async_schedule_domain(call, pos, &domain);
+			else
+				call(pos, 0);
+		}
+		pos = list_entry(resume ? pos->link.prev : pos->link.next,
+				 struct early_suspend, link);
+	}
+	async_synchronize_full_domain(&domain);
+}
+
+static void early_suspend(struct work_struct *work)
+{
 	unsigned long irqflags;
+	ktime_t start;
 	int abort = 0;
 	mutex_lock(&early_suspend_lock);
 	spin_lock_irqsave(&state_lock, irqflags);
@@ -99,14 +170,9 @@ static void early_suspend(struct work_struct *work)
 	if (debug_mask & DEBUG_SUSPEND) {
 		pr_info("early_suspend: call handlers\n");
 	}
-	list_for_each_entry(pos, &early_suspend_handlers, link) {
-		if (pos->suspend != NULL) {
-			if (debug_mask & DEBUG_VERBOSE) {
-				pr_info("early_suspend: calling %pf\n", pos->suspend);
-			}
-			pos->suspend(pos);
-		}
-	}
+	start = ktime_get();
+	call_handlers(false);
+	suspend_profile_early_suspend(ktime_sub(ktime_get(), start));
 	mutex_unlock(&early_suspend_lock);
 
 	if (debug_mask & DEBUG_SUSPEND) {
@@ -123,7 +189,6 @@ abort:
 
 static void late_resume(struct work_struct *work)
 {
-	struct early_suspend *pos;
 	unsigned long irqflags;
 	int abort = 0;
 	mutex_lock(&early_suspend_lock);
@@ -143,14 +208,7 @@ static void late_resume(struct work_struct *work)
 	if (debug_mask & DEBUG_SUSPEND) {
 		pr_info("late_resume: call handlers\n");
 	}
-	list_for_each_entry_reverse(pos, &early_suspend_handlers, link) {
-		if (pos->resume != NULL) {
-			if (debug_mask & DEBUG_VERBOSE) {
-				pr_info("late_resume: calling %pf\n", pos->resume);
-			}
-			pos->resume(pos);
-		}
-	}
+	call_handlers(true);
 	if (debug_mask & DEBUG_SUSPEND) {
 		pr_info("late_resume: done\n");
 	}
@@ -216,3 +274,40 @@ suspend_state_t get_suspend_state(void)
 {
 	return requested_suspend_state;
 }
+
+static int early_suspend_handlers_show(struct seq_file *m, void *unused)
+{
+	struct early_suspend *pos;
+
+	seq_puts(m, "level\tsuspend_ns\tresume_ns\thandler\n");
+	mutex_lock(&early_suspend_lock);
+	list_for_each_entry(pos, &early_suspend_handlers, link)
+		seq_printf(m, "%d\t%lld\t%lld\t%pf\n", pos->level,
+			   ktime_to_ns(pos->suspend_time),
+			   ktime_to_ns(pos->resume_time),
+			   pos->suspend ? (void *)pos->suspend :
+					  (void *)pos->resume);
+	mutex_unlock(&early_suspend_lock);
+	return 0;
+}
+
+static int early_suspend_handlers_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, early_suspend_handlers_show, NULL);
+}
+
+static const struct file_operations early_suspend_handlers_fops = {
+	.owner = THIS_MODULE,
+	.open = early_suspend_handlers_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static int __init early_suspend_debugfs_init(void)
+{
+	debugfs_create_file("early_suspend_handlers", S_IRUGO, NULL, NULL,
+			    &early_suspend_handlers_fops);
+	return 0;
+}
+late_initcall(early_suspend_debugfs_init);
@@ -253,6 +253,14 @@ extern struct wake_lock main_wake_lock;
 extern suspend_state_t requested_suspend_state;
 #endif
 
+#ifdef CONFIG_WAKELOCK_STAT
+void suspend_profile_early_suspend(ktime_t duration);
+void suspend_profile_dpm_suspend(ktime_t duration);
+#else
+static inline void suspend_profile_early_suspend(ktime_t duration) {}
+static inline void suspend_profile_dpm_suspend(ktime_t duration) {}
+#endif
+
 #ifdef CONFIG_USER_WAKELOCK
 ssize_t wake_lock_show(struct kobject *kobj, struct kobj_attribute *attr,
 			char *buf);
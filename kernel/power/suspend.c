@@ -201,6 +201,7 @@ static int suspend_enter(suspend_state_t state)
  */
 int suspend_devices_and_enter(suspend_state_t state)
 {
+	ktime_t start;
 	int error;
 
 	if (!suspend_ops)
@@ -214,7 +215,9 @@ int suspend_devices_and_enter(suspend_state_t state)
 	}
 	suspend_console();
 	suspend_test_start();
+	start = ktime_get();
 	error = dpm_suspend_start(PMSG_SUSPEND);
+	suspend_profile_dpm_suspend(ktime_sub(ktime_get(), start));
 	if (error) {
 		printk(KERN_ERR "PM: Some devices failed to suspend\n");
 		goto Recover_platform;
@@ -14,7 +14,10 @@
  */
 
 #include <linux/ctype.h>
+#include <linux/dcache.h>
+#include <linux/hash.h>
 #include <linux/module.h>
+#include <linux/rculist.h>
 #include <linux/wakelock.h>
 #include <linux/slab.h>
 
@@ -30,22 +33,43 @@ enum {
 static int debug_mask = DEBUG_FAILURE;
 module_param_named(debug_mask, debug_mask, int, S_IRUGO | S_IWUSR | S_IWGRP);
 
-static DEFINE_MUTEX(tree_lock);
+#define USER_WAKE_LOCK_HASH_BITS	6
+
+/*
+ * User wake locks are never freed, so lookups walk the hash chains under RCU
+ * only and wake_lock/wake_unlock writes from different processes do not
+ * serialize on each other.  hash_lock is taken just to add a new lock.
+ */
+static DEFINE_MUTEX(hash_lock);
 
 struct user_wake_lock {
-	struct rb_node		node;
+	struct hlist_node	node;
 	struct wake_lock	wake_lock;
 	char			name[0];
 };
-struct rb_root user_wake_locks;
+static struct hlist_head user_wake_locks[1 << USER_WAKE_LOCK_HASH_BITS];
+
+static struct user_wake_lock *find_wake_lock_name(struct hlist_head *head,
+	const char *buf, int name_len)
+{
+	struct user_wake_lock *l;
+	struct hlist_node *n;
+
+	hlist_for_each_entry_rcu(l, n, head, node) {
+		if (debug_mask & DEBUG_ERROR)
+			pr_info("lookup_wake_lock_name: compare %.*s %s\n",
+				name_len, buf, l->name);
+		if (!strncmp(buf, l->name, name_len) && !l->name[name_len])
+			return l;
+	}
+	return NULL;
+}
 
 static struct user_wake_lock *lookup_wake_lock_name(
 	const char *buf, int allocate, long *timeoutptr)
 {
-	struct rb_node **p = &user_wake_locks.rb_node;
-	struct rb_node *parent = NULL;
+	struct hlist_head *head;
 	struct user_wake_lock *l;
-	int diff;
 	u64 timeout;
 	int name_len;
 	const char *arg;
@@ -78,45 +102,41 @@ static struct user_wake_lock *lookup_wake_lock_name(
 	else if (timeoutptr)
 		*timeoutptr = 0;
 
-	/* Lookup wake lock in rbtree */
-	while (*p) {
-		parent = *p;
-		l = rb_entry(parent, struct user_wake_lock, node);
-		diff = strncmp(buf, l->name, name_len);
-		if (!diff && l->name[name_len])
-			diff = -1;
-		if (debug_mask & DEBUG_ERROR)
-			pr_info("lookup_wake_lock_name: compare %.*s %s %d\n",
-				name_len, buf, l->name, diff);
-
-		if (diff < 0)
-			p = &(*p)->rb_left;
-		else if (diff > 0)
-			p = &(*p)->rb_right;
-		else
-			return l;
-	}
+	/* Lookup wake lock in hash table */
+	head = &user_wake_locks[hash_long(full_name_hash(buf, name_len),
+					  USER_WAKE_LOCK_HASH_BITS)];
+	rcu_read_lock();
+	l = find_wake_lock_name(head, buf, name_len);
+	rcu_read_unlock();
+	if (l)
+		return l;
 
-	/* Allocate and add new wakelock to rbtree */
+	/* Allocate and add new wakelock to hash table */
 	if (!allocate) {
 		if (debug_mask & DEBUG_ERROR)
 			pr_info("lookup_wake_lock_name: %.*s not found\n",
 				name_len, buf);
 		return ERR_PTR(-EINVAL);
 	}
+	mutex_lock(&hash_lock);
+	l = find_wake_lock_name(head, buf, name_len);
+	if (l)
+		goto out_unlock;
 	l = kzalloc(sizeof(*l) + name_len + 1, GFP_KERNEL);
 	if (l == NULL) {
 		if (debug_mask & DEBUG_FAILURE)
 			pr_err("lookup_wake_lock_name: failed to allocate "
 				"memory for %.*s\n", name_len, buf);
-		return ERR_PTR(-ENOMEM);
+		l = ERR_PTR(-ENOMEM);
+		goto out_unlock;
 	}
 	memcpy(l->name, buf, name_len);
 	if (debug_mask & DEBUG_NEW)
 		pr_info("lookup_wake_lock_name: new wake lock %s\n", l->name);
 	wake_lock_init(&l->wake_lock, WAKE_LOCK_SUSPEND, l->name);
-	rb_link_node(&l->node, parent, p);
-	rb_insert_color(&l->node, &user_wake_locks);
+	hlist_add_head_rcu(&l->node, head);
+out_unlock:
+	mutex_unlock(&hash_lock);
 	return l;
 
 bad_arg:
@@ -131,19 +151,20 @@ ssize_t wake_lock_show(
 {
 	char *s = buf;
 	char *end = buf + PAGE_SIZE;
-	struct rb_node *n;
+	struct hlist_node *n;
 	struct user_wake_lock *l;
-
-	mutex_lock(&tree_lock);
-
-	for (n = rb_first(&user_wake_locks); n != NULL; n = rb_next(n)) {
-		l = rb_entry(n, struct user_wake_lock, node);
-		if (wake_lock_active(&l->wake_lock))
-			s += scnprintf(s, end - s, "%s ", l->name);
+	int i;
+
+	rcu_read_lock();
+	for (i = 0; i < ARRAY_SIZE(user_wake_locks); i++) {
+		hlist_for_each_entry_rcu(l, n, &user_wake_locks[i], node) {
+			if (wake_lock_active(&l->wake_lock))
+				s += scnprintf(s, end - s, "%s ", l->name);
+		}
 	}
 	s += scnprintf(s, end - s, "\n");
+	rcu_read_unlock();
 
-	mutex_unlock(&tree_lock);
 	return (s - buf);
 }
 
@@ -154,7 +175,6 @@ ssize_t wake_lock_store(
 	long timeout;
 	struct user_wake_lock *l;
 
-	mutex_lock(&tree_lock);
 	l = lookup_wake_lock_name(buf, 1, &timeout);
 	if (IS_ERR(l)) {
 		n = PTR_ERR(l);
@@ -169,7 +189,6 @@ ssize_t wake_lock_store(
 	else
 		wake_lock(&l->wake_lock);
 bad_name:
-	mutex_unlock(&tree_lock);
 	return n;
 }
 
@@ -179,19 +198,20 @@ ssize_t wake_unlock_show(
 {
 	char *s = buf;
 	char *end = buf + PAGE_SIZE;
-	struct rb_node *n;
+	struct hlist_node *n;
 	struct user_wake_lock *l;
-
-	mutex_lock(&tree_lock);
-
-	for (n = rb_first(&user_wake_locks); n != NULL; n = rb_next(n)) {
-		l = rb_entry(n, struct user_wake_lock, node);
-		if (!wake_lock_active(&l->wake_lock))
-			s += scnprintf(s, end - s, "%s ", l->name);
+	int i;
+
+	rcu_read_lock();
+	for (i = 0; i < ARRAY_SIZE(user_wake_locks); i++) {
+		hlist_for_each_entry_rcu(l, n, &user_wake_locks[i], node) {
+			if (!wake_lock_active(&l->wake_lock))
+				s += scnprintf(s, end - s, "%s ", l->name);
+		}
 	}
 	s += scnprintf(s, end - s, "\n");
+	rcu_read_unlock();
 
-	mutex_unlock(&tree_lock);
 	return (s - buf);
 }
 
@@ -201,7 +221,6 @@ ssize_t wake_unlock_store(
 {
 	struct user_wake_lock *l;
 
-	mutex_lock(&tree_lock);
 	l = lookup_wake_lock_name(buf, 0, NULL);
 	if (IS_ERR(l)) {
 		n = PTR_ERR(l);
@@ -213,7 +232,6 @@ ssize_t wake_unlock_store(
 
 	wake_unlock(&l->wake_lock);
 not_found:
-	mutex_unlock(&tree_lock);
 	return n;
 }
 
@@ -20,10 +20,15 @@
 #include <linux/syscalls.h> /* sys_sync */
 #include <linux/wakelock.h>
 #ifdef CONFIG_WAKELOCK_STAT
+#include <linux/debugfs.h>
 #include <linux/proc_fs.h>
+#include <linux/uaccess.h>
 #endif
 #include "power.h"
 
+#define CREATE_TRACE_POINTS
+#include <trace/events/wakelock.h>
+
 enum {
 	DEBUG_EXIT_SUSPEND = 1U << 0,
 	DEBUG_WAKEUP = 1U << 1,
@@ -41,9 +46,23 @@ module_param_named(debug_mask, debug_mask, int, S_IRUGO | S_IWUSR | S_IWGRP);
 #define WAKE_LOCK_AUTO_EXPIRE            (1U << 10)
 #define WAKE_LOCK_PREVENTING_SUSPEND     (1U << 11)
 
+/*
+ * Active wake locks without a timeout sit on active_wake_locks, so "is any
+ * of them held" is a list_empty() check.  Active locks with a timeout are
+ * kept in a per-type rbtree ordered by expiry, with the earliest and latest
+ * node cached: expiring locks pops from the front and the time until all of
+ * them are gone is read off the back, neither of which walks the locks.
+ */
+struct wake_lock_expire_queue {
+	struct rb_root root;
+	struct rb_node *first;
+	struct rb_node *last;
+};
+
 static DEFINE_SPINLOCK(list_lock);
 static LIST_HEAD(inactive_locks);
 static struct list_head active_wake_locks[WAKE_LOCK_TYPE_COUNT];
+static struct wake_lock_expire_queue active_timed_locks[WAKE_LOCK_TYPE_COUNT];
 static int current_event_num;
 struct workqueue_struct *suspend_work_queue;
 struct wake_lock main_wake_lock;
@@ -61,6 +80,14 @@ static struct wake_lock deleted_wake_locks;
 static ktime_t last_sleep_time_update;
 static int wait_for_wakeup;
 
+/* Total time main_wake_lock has been released, i.e. the time we have spent
+ * trying to suspend, up to last_sleep_time_update.  A suspend lock records
+ * this clock when it becomes active and is charged the difference when it is
+ * released, so no update has to visit every active lock.
+ */
+static ktime_t sleep_wait_time;
+static int sleep_wait_active;
+
 int get_expired_time(struct wake_lock *lock, ktime_t *expire_time)
 {
 	struct timespec ts;
@@ -84,6 +111,15 @@ int get_expired_time(struct wake_lock *lock, ktime_t *expire_time)
 }
 
 
+static ktime_t sleep_wait_time_at(ktime_t now)
+{
+	if (!sleep_wait_active ||
+	    ktime_to_ns(now) < ktime_to_ns(last_sleep_time_update))
+		return sleep_wait_time;
+	return ktime_add(sleep_wait_time,
+			 ktime_sub(now, last_sleep_time_update));
+}
+
 static int print_lock_stat(struct seq_file *m, struct wake_lock *lock)
 {
 	int lock_count = lock->stat.count;
@@ -107,7 +143,8 @@ static int print_lock_stat(struct seq_file *m, struct wake_lock *lock)
 		total_time = ktime_add(total_time, add_time);
 		if (lock->flags & WAKE_LOCK_PREVENTING_SUSPEND)
 			prevent_suspend_time = ktime_add(prevent_suspend_time,
-					ktime_sub(now, last_sleep_time_update));
+					ktime_sub(sleep_wait_time_at(now),
+						  lock->stat.prevent_suspend_start));
 		if (add_time.tv64 > max_time.tv64)
 			max_time = add_time;
 	}
@@ -125,6 +162,7 @@ static int wakelock_stats_show(struct seq_file *m, void *unused)
 {
 	unsigned long irqflags;
 	struct wake_lock *lock;
+	struct rb_node *n;
 	int ret;
 	int type;
 
@@ -137,6 +175,10 @@ static int wakelock_stats_show(struct seq_file *m, void *unused)
 	for (type = 0; type < WAKE_LOCK_TYPE_COUNT; type++) {
 		list_for_each_entry(lock, &active_wake_locks[type], link)
 			ret = print_lock_stat(m, lock);
+		for (n = active_timed_locks[type].first; n; n = rb_next(n)) {
+			lock = rb_entry(n, struct wake_lock, expire_node);
+			ret = print_lock_stat(m, lock);
+		}
 	}
 	spin_unlock_irqrestore(&list_lock, irqflags);
 	return 0;
@@ -161,7 +203,8 @@ static void wake_unlock_stat_locked(struct wake_lock *lock, int expired)
 		lock->stat.max_time = duration;
 	lock->stat.last_time = ktime_get();
 	if (lock->flags & WAKE_LOCK_PREVENTING_SUSPEND) {
-		duration = ktime_sub(now, last_sleep_time_update);
+		duration = ktime_sub(sleep_wait_time_at(now),
+				     lock->stat.prevent_suspend_start);
 		lock->stat.prevent_suspend_time = ktime_add(
 			lock->stat.prevent_suspend_time, duration);
 		lock->flags &= ~WAKE_LOCK_PREVENTING_SUSPEND;
@@ -170,39 +213,71 @@ static void wake_unlock_stat_locked(struct wake_lock *lock, int expired)
 
 static void update_sleep_wait_stats_locked(int done)
 {
-	struct wake_lock *lock;
-	ktime_t now, etime, elapsed, add;
-	int expired;
+	ktime_t now = ktime_get();
 
-	now = ktime_get();
-	elapsed = ktime_sub(now, last_sleep_time_update);
-	list_for_each_entry(lock, &active_wake_locks[WAKE_LOCK_SUSPEND], link) {
-		expired = get_expired_time(lock, &etime);
-		if (lock->flags & WAKE_LOCK_PREVENTING_SUSPEND) {
-			if (expired)
-				add = ktime_sub(etime, last_sleep_time_update);
-			else
-				add = elapsed;
-			lock->stat.prevent_suspend_time = ktime_add(
-				lock->stat.prevent_suspend_time, add);
-		}
-		if (done || expired)
-			lock->flags &= ~WAKE_LOCK_PREVENTING_SUSPEND;
-		else
-			lock->flags |= WAKE_LOCK_PREVENTING_SUSPEND;
-	}
+	sleep_wait_time = sleep_wait_time_at(now);
+	sleep_wait_active = !done;
 	last_sleep_time_update = now;
 }
 #endif
 
+static void expire_queue_add(struct wake_lock_expire_queue *q,
+			     struct wake_lock *lock)
+{
+	struct rb_node **p = &q->root.rb_node;
+	struct rb_node *parent = NULL;
+	bool leftmost = true, rightmost = true;
+
+	while (*p) {
+		struct wake_lock *entry;
+
+		parent = *p;
+		entry = rb_entry(parent, struct wake_lock, expire_node);
+		if (time_before(lock->expires, entry->expires)) {
+			p = &parent->rb_left;
+			rightmost = false;
+		} else {
+			p = &parent->rb_right;
+			leftmost = false;
+		}
+	}
+	rb_link_node(&lock->expire_node, parent, p);
+	rb_insert_color(&lock->expire_node, &q->root);
+	if (leftmost)
+		q->first = &lock->expire_node;
+	if (rightmost)
+		q->last = &lock->expire_node;
+}
+
+static void expire_queue_del(struct wake_lock_expire_queue *q,
+			     struct wake_lock *lock)
+{
+	if (q->first == &lock->expire_node)
+		q->first = rb_next(&lock->expire_node);
+	if (q->last == &lock->expire_node)
+		q->last = rb_prev(&lock->expire_node);
+	rb_erase(&lock->expire_node, &q->root);
+}
+
+/* Caller must acquire the list_lock spinlock */
+static void unlink_wake_lock_locked(struct wake_lock *lock)
+{
+	int type = lock->flags & WAKE_LOCK_TYPE_MASK;
+
+	if (lock->flags & WAKE_LOCK_AUTO_EXPIRE)
+		expire_queue_del(&active_timed_locks[type], lock);
+	else
+		list_del(&lock->link);
+}
+
 
 static void expire_wake_lock(struct wake_lock *lock)
 {
 #ifdef CONFIG_WAKELOCK_STAT
 	wake_unlock_stat_locked(lock, 1);
 #endif
+	unlink_wake_lock_locked(lock);
 	lock->flags &= ~(WAKE_LOCK_ACTIVE | WAKE_LOCK_AUTO_EXPIRE);
-	list_del(&lock->link);
 	list_add(&lock->link, &inactive_locks);
 	if (debug_mask & (DEBUG_WAKE_LOCK | DEBUG_EXPIRE))
 		pr_info("expired wake lock %s\n", lock->name);
@@ -212,22 +287,25 @@ static void expire_wake_lock(struct wake_lock *lock)
 static void print_active_locks(int type)
 {
 	struct wake_lock *lock;
+	struct rb_node *n;
 	bool print_expired = true;
 
 	BUG_ON(type >= WAKE_LOCK_TYPE_COUNT);
 	list_for_each_entry(lock, &active_wake_locks[type], link) {
-		if (lock->flags & WAKE_LOCK_AUTO_EXPIRE) {
-			long timeout = lock->expires - jiffies;
-			if (timeout > 0)
-				pr_info("active wake lock %s, time left %ld\n",
-					lock->name, timeout);
-			else if (print_expired)
-				pr_info("wake lock %s, expired\n", lock->name);
-		} else {
-			pr_info("active wake lock %s\n", lock->name);
-			if (!(debug_mask & DEBUG_EXPIRE))
-				print_expired = false;
-		}
+		pr_info("active wake lock %s\n", lock->name);
+		if (!(debug_mask & DEBUG_EXPIRE))
+			print_expired = false;
+	}
+	for (n = active_timed_locks[type].first; n; n = rb_next(n)) {
+		long timeout;
+
+		lock = rb_entry(n, struct wake_lock, expire_node);
+		timeout = lock->expires - jiffies;
+		if (timeout > 0)
+			pr_info("active wake lock %s, time left %ld\n",
+				lock->name, timeout);
+		else if (print_expired)
+			pr_info("wake lock %s, expired\n", lock->name);
 	}
 }
 
@@ -241,21 +319,23 @@ void dump_active_locks(int type)
 
 static long has_wake_lock_locked(int type)
 {
-	struct wake_lock *lock, *n;
-	long max_timeout = 0;
+	struct wake_lock_expire_queue *q;
+	struct wake_lock *lock;
 
 	BUG_ON(type >= WAKE_LOCK_TYPE_COUNT);
-	list_for_each_entry_safe(lock, n, &active_wake_locks[type], link) {
-		if (lock->flags & WAKE_LOCK_AUTO_EXPIRE) {
-			long timeout = lock->expires - jiffies;
-			if (timeout <= 0)
-				expire_wake_lock(lock);
-			else if (timeout > max_timeout)
-				max_timeout = timeout;
-		} else
-			return -1;
+	if (!list_empty(&active_wake_locks[type]))
+		return -1;
+	q = &active_timed_locks[type];
+	while (q->first) {
+		lock = rb_entry(q->first, struct wake_lock, expire_node);
+		if ((long)(lock->expires - jiffies) > 0)
+			break;
+		expire_wake_lock(lock);
 	}
-	return max_timeout;
+	if (!q->last)
+		return 0;
+	lock = rb_entry(q->last, struct wake_lock, expire_node);
+	return lock->expires - jiffies;
 }
 
 long has_wake_lock(int type)
@@ -270,6 +350,196 @@ long has_wake_lock(int type)
 	return ret;
 }
 
+#ifdef CONFIG_WAKELOCK_STAT
+#define SUSPEND_PROFILE_RING_SIZE	64
+
+/*
+ * The last SUSPEND_PROFILE_RING_SIZE passes of the suspend worker.  The pass
+ * in flight is filled in as cur_attempt by the hooks below and copied into
+ * the ring when suspend() returns; suspend() only runs on the single threaded
+ * suspend_work_queue so there is never more than one.  Lock order is
+ * list_lock, then suspend_profile_lock.
+ */
+static DEFINE_SPINLOCK(suspend_profile_lock);
+static struct suspend_attempt suspend_attempt_log[SUSPEND_PROFILE_RING_SIZE];
+static u32 suspend_attempt_seq;
+static struct suspend_attempt cur_attempt;
+static ktime_t pending_early_suspend_time;
+static struct dentry *suspend_attempts_dentry;
+
+void suspend_profile_early_suspend(ktime_t duration)
+{
+	unsigned long irqflags;
+
+	spin_lock_irqsave(&suspend_profile_lock, irqflags);
+	pending_early_suspend_time = duration;
+	spin_unlock_irqrestore(&suspend_profile_lock, irqflags);
+}
+
+void suspend_profile_dpm_suspend(ktime_t duration)
+{
+	unsigned long irqflags;
+
+	spin_lock_irqsave(&suspend_profile_lock, irqflags);
+	cur_attempt.dpm_suspend_ns = ktime_to_ns(duration);
+	spin_unlock_irqrestore(&suspend_profile_lock, irqflags);
+}
+
+void suspend_profile_wakeup_irq(int irq)
+{
+	unsigned long irqflags;
+
+	spin_lock_irqsave(&suspend_profile_lock, irqflags);
+	if (cur_attempt.wakeup_irq < 0)
+		cur_attempt.wakeup_irq = irq;
+	spin_unlock_irqrestore(&suspend_profile_lock, irqflags);
+}
+EXPORT_SYMBOL(suspend_profile_wakeup_irq);
+
+/* Caller must acquire the list_lock spinlock */
+static void suspend_profile_wakeup_lock_locked(struct wake_lock *lock)
+{
+	spin_lock(&suspend_profile_lock);
+	if (!cur_attempt.wakeup_lock[0])
+		strlcpy(cur_attempt.wakeup_lock, lock->name,
+			sizeof(cur_attempt.wakeup_lock));
+	spin_unlock(&suspend_profile_lock);
+}
+
+static void suspend_profile_add_blocker(struct wake_lock *lock)
+{
+	strlcpy(cur_attempt.blockers[cur_attempt.nr_blockers++], lock->name,
+		SUSPEND_ATTEMPT_NAME_LEN);
+}
+
+static void suspend_profile_blockers(u32 flags)
+{
+	struct wake_lock_expire_queue *q;
+	struct wake_lock *lock;
+	struct rb_node *n;
+	unsigned long irqflags;
+
+	spin_lock_irqsave(&list_lock, irqflags);
+	spin_lock(&suspend_profile_lock);
+	cur_attempt.flags |= flags;
+	cur_attempt.nr_blockers = 0;
+	list_for_each_entry(lock, &active_wake_locks[WAKE_LOCK_SUSPEND], link) {
+		if (cur_attempt.nr_blockers == SUSPEND_ATTEMPT_MAX_BLOCKERS)
+			goto out;
+		suspend_profile_add_blocker(lock);
+	}
+	q = &active_timed_locks[WAKE_LOCK_SUSPEND];
+	for (n = q->last; n; n = rb_prev(n)) {
+		if (cur_attempt.nr_blockers == SUSPEND_ATTEMPT_MAX_BLOCKERS)
+			break;
+		lock = rb_entry(n, struct wake_lock, expire_node);
+		suspend_profile_add_blocker(lock);
+	}
+out:
+	spin_unlock(&suspend_profile_lock);
+	spin_unlock_irqrestore(&list_lock, irqflags);
+}
+
+static void suspend_profile_start(void)
+{
+	unsigned long irqflags;
+
+	spin_lock_irqsave(&suspend_profile_lock, irqflags);
+	memset(&cur_attempt, 0, sizeof(cur_attempt));
+	cur_attempt.wakeup_irq = -1;
+	cur_attempt.start_ns = ktime_to_ns(ktime_get());
+	cur_attempt.early_suspend_ns = ktime_to_ns(pending_early_suspend_time);
+	pending_early_suspend_time = ktime_set(0, 0);
+	spin_unlock_irqrestore(&suspend_profile_lock, irqflags);
+}
+
+static void suspend_profile_end(int result, u32 flags, s64 suspend_ns)
+{
+	struct suspend_attempt rec;
+	unsigned long irqflags;
+	int i;
+
+	spin_lock_irqsave(&suspend_profile_lock, irqflags);
+	cur_attempt.seq = suspend_attempt_seq++;
+	cur_attempt.flags |= flags;
+	cur_attempt.result = result;
+	cur_attempt.suspend_ns = suspend_ns;
+	rec = cur_attempt;
+	suspend_attempt_log[rec.seq % SUSPEND_PROFILE_RING_SIZE] = rec;
+	spin_unlock_irqrestore(&suspend_profile_lock, irqflags);
+
+	trace_suspend_attempt(rec.seq, rec.flags, rec.result, rec.wakeup_irq,
+			      rec.early_suspend_ns, rec.dpm_suspend_ns,
+			      rec.suspend_ns);
+	for (i = 0; i < rec.nr_blockers; i++)
+		trace_suspend_blocker(rec.seq, rec.blockers[i]);
+	if (rec.wakeup_lock[0])
+		trace_suspend_wakeup_lock(rec.seq, rec.wakeup_lock);
+}
+
+/*
+ * The file position counts records.  A reader that has fallen more than a
+ * ring behind skips ahead to the oldest record still held; a read at the
+ * newest record returns 0.
+ */
+static ssize_t suspend_attempts_read(struct file *file, char __user *buf,
+				     size_t count, loff_t *ppos)
+{
+	struct suspend_attempt rec;
+	unsigned long irqflags;
+	u32 next = *ppos;
+	ssize_t done = 0;
+
+	if (count < sizeof(rec))
+		return -EINVAL;
+
+	while (count - done >= sizeof(rec)) {
+		spin_lock_irqsave(&suspend_profile_lock, irqflags);
+		if (next == suspend_attempt_seq) {
+			spin_unlock_irqrestore(&suspend_profile_lock, irqflags);
+			break;
+		}
+		if (suspend_attempt_seq - next > SUSPEND_PROFILE_RING_SIZE)
+			next = suspend_attempt_seq - SUSPEND_PROFILE_RING_SIZE;
+		rec = suspend_attempt_log[next % SUSPEND_PROFILE_RING_SIZE];
+		spin_unlock_irqrestore(&suspend_profile_lock, irqflags);
+
+		if (copy_to_user(buf + done, &rec, sizeof(rec))) {
+			if (!done)
+				done = -EFAULT;
+			break;
+		}
+		done += sizeof(rec);
+		next++;
+	}
+	*ppos = next;
+	return done;
+}
+
+static const struct file_operations suspend_attempts_fops = {
+	.owner = THIS_MODULE,
+	.open = nonseekable_open,
+	.read = suspend_attempts_read,
+	.llseek = no_llseek,
+};
+
+/* debugfs is registered at core_initcall as well, but after us */
+static int __init suspend_profile_init(void)
+{
+	suspend_attempts_dentry = debugfs_create_file("suspend_attempts",
+						      S_IRUGO, NULL, NULL,
+						      &suspend_attempts_fops);
+	return 0;
+}
+late_initcall(suspend_profile_init);
+#else
+static inline void suspend_profile_blockers(u32 flags) {}
+static inline void suspend_profile_start(void) {}
+static inline void suspend_profile_end(int result, u32 flags, s64 suspend_ns)
+{
+}
+#endif
+
 static void suspend_backoff(void)
 {
 	pr_info("suspend: too many immediate wakeups, back off\n");
@@ -282,10 +552,14 @@ static void suspend(struct work_struct *work)
 	int ret;
 	int entry_event_num;
 	struct timespec ts_entry, ts_exit;
+	u32 profile_flags = 0;
 
+	suspend_profile_start();
 	if (has_wake_lock(WAKE_LOCK_SUSPEND)) {
 		if (debug_mask & DEBUG_SUSPEND)
 			pr_info("suspend: abort suspend\n");
+		suspend_profile_blockers(SUSPEND_ATTEMPT_WAKE_LOCK);
+		suspend_profile_end(-EAGAIN, 0, 0);
 		return;
 	}
 
@@ -312,6 +586,7 @@ static void suspend(struct work_struct *work)
 		if (suspend_short_count == SUSPEND_BACKOFF_THRESHOLD) {
 			suspend_backoff();
 			suspend_short_count = 0;
+			profile_flags |= SUSPEND_ATTEMPT_BACKOFF;
 		}
 	} else {
 		suspend_short_count = 0;
@@ -321,7 +596,10 @@ static void suspend(struct work_struct *work)
 		if (debug_mask & DEBUG_SUSPEND)
 			pr_info("suspend: pm_suspend returned with no event\n");
 		wake_lock_timeout(&unknown_wakeup, HZ / 2);
+		profile_flags |= SUSPEND_ATTEMPT_NO_EVENT;
 	}
+	suspend_profile_end(ret, profile_flags,
+			    timespec_to_ns(&ts_exit) - timespec_to_ns(&ts_entry));
 }
 static DECLARE_WORK(suspend_work, suspend);
 
@@ -353,6 +631,8 @@ static int power_suspend_late(struct device *dev)
 	int ret = has_wake_lock(WAKE_LOCK_SUSPEND) ? -EAGAIN : 0;
 #ifdef CONFIG_WAKELOCK_STAT
 	wait_for_wakeup = !ret;
+	if (ret)
+		suspend_profile_blockers(SUSPEND_ATTEMPT_LATE_ABORT);
 #endif
 	if (debug_mask & DEBUG_SUSPEND)
 		pr_info("power_suspend_late return %d\n", ret);
@@ -387,6 +667,7 @@ void wake_lock_init(struct wake_lock *lock, int type, const char *name)
 	lock->stat.wakeup_count = 0;
 	lock->stat.total_time = ktime_set(0, 0);
 	lock->stat.prevent_suspend_time = ktime_set(0, 0);
+	lock->stat.prevent_suspend_start = ktime_set(0, 0);
 	lock->stat.max_time = ktime_set(0, 0);
 	lock->stat.last_time = ktime_set(0, 0);
 #endif
@@ -421,7 +702,7 @@ void wake_lock_destroy(struct wake_lock *lock)
 				  lock->stat.max_time);
 	}
 #endif
-	list_del(&lock->link);
+	unlink_wake_lock_locked(lock);
 	spin_unlock_irqrestore(&list_lock, irqflags);
 }
 EXPORT_SYMBOL(wake_lock_destroy);
@@ -444,6 +725,7 @@ static void wake_lock_internal(
 			pr_info("wakeup wake lock: %s\n", lock->name);
 		wait_for_wakeup = 0;
 		lock->stat.wakeup_count++;
+		suspend_profile_wakeup_lock_locked(lock);
 	}
 	if ((lock->flags & WAKE_LOCK_AUTO_EXPIRE) &&
 	    (long)(lock->expires - jiffies) <= 0) {
@@ -456,8 +738,17 @@ static void wake_lock_internal(
 #ifdef CONFIG_WAKELOCK_STAT
 		lock->stat.last_time = ktime_get();
 #endif
+		list_del(&lock->link);
+	} else
+		unlink_wake_lock_locked(lock);
+#ifdef CONFIG_WAKELOCK_STAT
+	if (type == WAKE_LOCK_SUSPEND &&
+	    !(lock->flags & WAKE_LOCK_PREVENTING_SUSPEND)) {
+		lock->stat.prevent_suspend_start =
+			sleep_wait_time_at(ktime_get());
+		lock->flags |= WAKE_LOCK_PREVENTING_SUSPEND;
 	}
-	list_del(&lock->link);
+#endif
 	if (has_timeout) {
 		if (debug_mask & DEBUG_WAKE_LOCK)
 			pr_info("wake_lock: %s, type %d, timeout %ld.%03lu\n",
@@ -465,7 +756,7 @@ static void wake_lock_internal(
 				(timeout % HZ) * MSEC_PER_SEC / HZ);
 		lock->expires = jiffies + timeout;
 		lock->flags |= WAKE_LOCK_AUTO_EXPIRE;
-		list_add_tail(&lock->link, &active_wake_locks[type]);
+		expire_queue_add(&active_timed_locks[type], lock);
 	} else {
 		if (debug_mask & DEBUG_WAKE_LOCK)
 			pr_info("wake_lock: %s, type %d\n", lock->name, type);
@@ -478,8 +769,6 @@ static void wake_lock_internal(
 #ifdef CONFIG_WAKELOCK_STAT
 		if (lock == &main_wake_lock)
 			update_sleep_wait_stats_locked(1);
-		else if (!wake_lock_active(&main_wake_lock))
-			update_sleep_wait_stats_locked(0);
 #endif
 		if (has_timeout)
 			expire_in = has_wake_lock_locked(type);
@@ -531,9 +820,11 @@ void wake_unlock(struct wake_lock *lock)
 #endif
 	if (debug_mask & DEBUG_WAKE_LOCK)
 		pr_info("wake_unlock: %s\n", lock->name);
+	if (lock->flags & WAKE_LOCK_ACTIVE) {
+		unlink_wake_lock_locked(lock);
+		list_add(&lock->link, &inactive_locks);
+	}
 	lock->flags &= ~(WAKE_LOCK_ACTIVE | WAKE_LOCK_AUTO_EXPIRE);
-	list_del(&lock->link);
-	list_add(&lock->link, &inactive_locks);
 	if (type == WAKE_LOCK_SUSPEND) {
 		long has_lock = has_wake_lock_locked(type);
 		if (has_lock > 0) {
@@ -590,8 +881,10 @@ static int __init wakelocks_init(void)
 	int ret;
 	int i;
 
-	for (i = 0; i < ARRAY_SIZE(active_wake_locks); i++)
+	for (i = 0; i < ARRAY_SIZE(active_wake_locks); i++) {
 		INIT_LIST_HEAD(&active_wake_locks[i]);
+		active_timed_locks[i].root = RB_ROOT;
+	}
 
 #ifdef CONFIG_WAKELOCK_STAT
 	wake_lock_init(&deleted_wake_locks, WAKE_LOCK_SUSPEND,
@@ -643,6 +936,7 @@ err_platform_device_register:
 static void  __exit wakelocks_exit(void)
 {
 #ifdef CONFIG_WAKELOCK_STAT
+	debugfs_remove(suspend_attempts_dentry);
 	remove_proc_entry("wakelocks", NULL);
 #endif
 	destroy_workqueue(suspend_work_queue);
@@ -15,10 +15,14 @@
 #define DEBUG
 
 #include <linux/file.h>
+#include <linux/hash.h>
 #include <linux/inetdevice.h>
 #include <linux/module.h>
 #include <linux/netfilter/x_tables.h>
 #include <linux/netfilter/xt_qtaguid.h>
+#include <linux/percpu.h>
+#include <linux/rculist.h>
+#include <linux/seq_file.h>
 #include <linux/skbuff.h>
 #include <linux/workqueue.h>
 #include <net/addrconf.h>
@@ -49,6 +53,7 @@ static unsigned int proc_iface_perms = S_IRUGO;
 module_param_named(iface_perms, proc_iface_perms, uint, S_IRUGO | S_IWUSR);
 
 static struct proc_dir_entry *xt_qtaguid_stats_file;
+static struct proc_dir_entry *xt_qtaguid_stats_bin_file;
 static unsigned int proc_stats_perms = S_IRUGO;
 module_param_named(stats_perms, proc_stats_perms, uint, S_IRUGO | S_IWUSR);
 
@@ -157,6 +162,11 @@ static struct proc_dir_entry *iface_stat_fmt_procfile;
  *   iface_stat_list_lock
  *     struct iface_stat->tag_stat_list_lock
  *
+ * qtaguid_stats_bin_start() .. qtaguid_stats_bin_stop()
+ *   rcu_read_lock()
+ *     (iface_stat_list)
+ *     struct iface_stat->tag_stat_list_lock
+ *
  * qtudev_open()
  *   uid_tag_data_tree_lock
  *
@@ -189,15 +199,17 @@ static struct proc_dir_entry *iface_stat_fmt_procfile;
  * qtaguid_mt()
  *   account_for_uid()
  *     if_tag_stat_update()
- *       get_sock_stat()
- *         sock_tag_list_lock
+ *       rcu_read_lock()
+ *         (iface_stat_list)
+ *         (sock_tag_hash)
+ *         (tag_stat_cache)
+ *       only on a tag_stat_cache miss:
+ *       get_active_counter_set()
+ *         tag_counter_set_list_lock
  *       struct iface_stat->tag_stat_list_lock
- *         tag_stat_update()
- *           get_active_counter_set()
- *             tag_counter_set_list_lock
- *         tag_stat_update()
- *           get_active_counter_set()
- *             tag_counter_set_list_lock
+ *   iface_stat_update_from_skb()
+ *     rcu_read_lock()
+ *       (iface_stat_list)
  *
  *
  * qtaguid_ctrl_parse()
@@ -227,6 +239,40 @@ static DEFINE_SPINLOCK(iface_stat_list_lock);
 
 static struct rb_root sock_tag_tree = RB_ROOT;
 static DEFINE_SPINLOCK(sock_tag_list_lock);
+/*
+ * Every sock_tag in sock_tag_tree is also hashed here by sk, so the packet
+ * path can find it under rcu_read_lock() instead of sock_tag_list_lock.
+ */
+#define SOCK_TAG_HASH_BITS 8
+static struct hlist_head sock_tag_hash[1 << SOCK_TAG_HASH_BITS];
+
+/*
+ * Each cpu remembers the tag_stat it last billed, so back to back packets
+ * of a flow skip the tag_stat_tree walk and both spinlocks.
+ * tag_stat_gen is bumped whenever a tag_stat is freed or a counter set
+ * changes, which invalidates every cache entry. tag_stats are freed after
+ * an RCU grace period, so a hit is safe for the rest of the read side
+ * critical section it was found in.
+ */
+struct tag_stat_cache {
+	unsigned int gen;
+	struct iface_stat *iface_entry;
+	tag_t tag;
+	struct tag_stat *ts_entry;
+	int active_set;
+};
+static DEFINE_PER_CPU(struct tag_stat_cache, tag_stat_cache);
+static atomic_t tag_stat_gen = ATOMIC_INIT(0);
+
+/*
+ * Every stats_bin dump starts a new generation, and the packet path stamps
+ * the per-cpu counters it touches with the current one. A delta dump then
+ * only needs the tag_stats with a stamp at or after the generation the
+ * caller passes back. Deleting tag_stats can not be expressed as a delta,
+ * so qtaguid_stats_delete_gen forces the next dump to be a full one.
+ */
+static atomic_t qtaguid_stats_gen = ATOMIC_INIT(1);
+static atomic_t qtaguid_stats_delete_gen = ATOMIC_INIT(0);
 
 static struct rb_root tag_counter_set_tree = RB_ROOT;
 static DEFINE_SPINLOCK(tag_counter_set_list_lock);
@@ -419,6 +465,20 @@ static void sock_tag_tree_insert(struct sock_tag *data, struct rb_root *root)
 	rb_insert_color(&data->sock_node, root);
 }
 
+/* Caller must hold sock_tag_list_lock */
+static void sock_tag_hash_add(struct sock_tag *st_entry)
+{
+	hlist_add_head_rcu(&st_entry->sock_hash_node,
+			   &sock_tag_hash[hash_ptr(st_entry->sk,
+						   SOCK_TAG_HASH_BITS)]);
+}
+
+/* Caller must hold sock_tag_list_lock */
+static void sock_tag_hash_del(struct sock_tag *st_entry)
+{
+	hlist_del_rcu(&st_entry->sock_hash_node);
+}
+
 static void sock_tag_tree_erase(struct rb_root *st_to_free_tree)
 {
 	struct rb_node *node;
@@ -435,7 +495,7 @@ static void sock_tag_tree_erase(struct rb_root *st_to_free_tree)
 			 get_uid_from_tag(st_entry->tag));
 		rb_erase(&st_entry->sock_node, st_to_free_tree);
 		sockfd_put(st_entry->socket);
-		kfree(st_entry);
+		kfree_rcu(st_entry, rcu);
 	}
 }
 
@@ -746,6 +806,13 @@ static int read_proc_bool(char *page, char **start, off_t off,
 	return len;
 }
 
+/* Drop every cpu's cached tag_stat and active counter set */
+static void tag_stat_cache_invalidate(void)
+{
+	atomic_inc(&tag_stat_gen);
+	smp_mb__after_atomic_inc();
+}
+
 static int get_active_counter_set(tag_t tag)
 {
 	int active_set = 0;
@@ -788,6 +855,27 @@ done:
 	return iface_entry;
 }
 
+/*
+ * Lockless variant of get_iface_entry() for the packet path.
+ * Active entries are matched on the net_device pointer, the name is only
+ * compared for inactive entries that still receive stragglers.
+ * Caller must be in an rcu read side critical section.
+ */
+static struct iface_stat *get_iface_entry_rcu(const struct net_device *dev)
+{
+	struct iface_stat *iface_entry;
+
+	list_for_each_entry_rcu(iface_entry, &iface_stat_list, list) {
+		if (ACCESS_ONCE(iface_entry->net_dev) == dev)
+			return iface_entry;
+	}
+	list_for_each_entry_rcu(iface_entry, &iface_stat_list, list) {
+		if (!strcmp(dev->name, iface_entry->ifname))
+			return iface_entry;
+	}
+	return NULL;
+}
+
 static int iface_stat_fmt_proc_read(char *page, char **num_items_returned,
 				    off_t items_to_skip, int char_count,
 				    int *eof, void *data)
@@ -799,6 +887,7 @@ static int iface_stat_fmt_proc_read(char *page, char **num_items_returned,
 	struct iface_stat *iface_entry;
 	struct rtnl_link_stats64 dev_stats, *stats;
 	struct rtnl_link_stats64 no_dev_stats = {0};
+	struct byte_packet_counters totals_via_skb[IFS_MAX_DIRECTIONS];
 
 	if (unlikely(module_passive)) {
 		*eof = 1;
@@ -866,15 +955,16 @@ static int iface_stat_fmt_proc_read(char *page, char **num_items_returned,
 				stats->tx_bytes, stats->tx_packets
 				);
 		} else {
+			iface_stat_sum_skb_totals(iface_entry, totals_via_skb);
 			len = snprintf(
 				outp, char_count,
 				"%s "
 				"%llu %llu %llu %llu\n",
 				iface_entry->ifname,
-				iface_entry->totals_via_skb[IFS_RX].bytes,
-				iface_entry->totals_via_skb[IFS_RX].packets,
-				iface_entry->totals_via_skb[IFS_TX].bytes,
-				iface_entry->totals_via_skb[IFS_TX].packets
+				totals_via_skb[IFS_RX].bytes,
+				totals_via_skb[IFS_RX].packets,
+				totals_via_skb[IFS_TX].bytes,
+				totals_via_skb[IFS_TX].packets
 				);
 		}
 		if (len >= char_count) {
@@ -974,6 +1064,16 @@ static struct iface_stat *iface_alloc(struct net_device *net_dev)
 		kfree(new_iface);
 		return NULL;
 	}
+	new_iface->totals_via_skb = kzalloc(nr_cpu_ids *
+					    sizeof(*new_iface->totals_via_skb),
+					    GFP_ATOMIC);
+	if (new_iface->totals_via_skb == NULL) {
+		pr_err("qtaguid: iface_stat: create(%s): "
+		       "skb totals alloc failed\n", net_dev->name);
+		kfree(new_iface->ifname);
+		kfree(new_iface);
+		return NULL;
+	}
 	spin_lock_init(&new_iface->tag_stat_list_lock);
 	new_iface->tag_stat_tree = RB_ROOT;
 	_iface_stat_set_active(new_iface, net_dev, true);
@@ -987,6 +1087,7 @@ static struct iface_stat *iface_alloc(struct net_device *net_dev)
 		pr_err("qtaguid: iface_stat: create(%s): "
 		       "work alloc failed\n", new_iface->ifname);
 		_iface_stat_set_active(new_iface, net_dev, false);
+		kfree(new_iface->totals_via_skb);
 		kfree(new_iface->ifname);
 		kfree(new_iface);
 		return NULL;
@@ -994,7 +1095,7 @@ static struct iface_stat *iface_alloc(struct net_device *net_dev)
 	isw->iface_entry = new_iface;
 	INIT_WORK(&isw->iface_work, iface_create_proc_worker);
 	schedule_work(&isw->iface_work);
-	list_add(&new_iface->list, &iface_stat_list);
+	list_add_rcu(&new_iface->list, &iface_stat_list);
 	return new_iface;
 }
 
@@ -1186,16 +1287,32 @@ static struct sock_tag *get_sock_stat_nl(const struct sock *sk)
 	return sock_tag_tree_search(&sock_tag_tree, sk);
 }
 
-static struct sock_tag *get_sock_stat(const struct sock *sk)
+/*
+ * Find the tag of a tagged sock without taking sock_tag_list_lock.
+ * Caller must be in an rcu read side critical section.
+ */
+static bool get_sock_tag_rcu(const struct sock *sk, tag_t *tag)
 {
 	struct sock_tag *sock_tag_entry;
-	MT_DEBUG("qtaguid: get_sock_stat(sk=%p)\n", sk);
+	struct hlist_node *node;
+	unsigned int seq;
+
+	MT_DEBUG("qtaguid: get_sock_tag_rcu(sk=%p)\n", sk);
 	if (!sk)
-		return NULL;
-	spin_lock_bh(&sock_tag_list_lock);
-	sock_tag_entry = get_sock_stat_nl(sk);
-	spin_unlock_bh(&sock_tag_list_lock);
-	return sock_tag_entry;
+		return false;
+	hlist_for_each_entry_rcu(sock_tag_entry, node,
+				 &sock_tag_hash[hash_ptr((void *)sk,
+							 SOCK_TAG_HASH_BITS)],
+				 sock_hash_node) {
+		if (sock_tag_entry->sk != sk)
+			continue;
+		do {
+			seq = read_seqcount_begin(&sock_tag_entry->tag_seq);
+			*tag = sock_tag_entry->tag;
+		} while (read_seqcount_retry(&sock_tag_entry->tag_seq, seq));
+		return true;
+	}
+	return false;
 }
 
 static int ipx_proto(const struct sk_buff *skb,
@@ -1302,6 +1419,7 @@ static void iface_stat_update_from_skb(const struct sk_buff *skb,
 				       struct xt_action_param *par)
 {
 	struct iface_stat *entry;
+	struct iface_skb_totals *totals;
 	const struct net_device *el_dev;
 	enum ifs_tx_rx direction = par->in ? IFS_RX : IFS_TX;
 	int bytes = skb->len;
@@ -1336,37 +1454,51 @@ static void iface_stat_update_from_skb(const struct sk_buff *skb,
 			 par->family, proto);
 	}
 
-	spin_lock_bh(&iface_stat_list_lock);
-	entry = get_iface_entry(el_dev->name);
+	rcu_read_lock();
+	entry = get_iface_entry_rcu(el_dev);
 	if (entry == NULL) {
 		IF_DEBUG("qtaguid: iface_stat: %s(%s): not tracked\n",
 			 __func__, el_dev->name);
-		spin_unlock_bh(&iface_stat_list_lock);
+		rcu_read_unlock();
 		return;
 	}
 
 	IF_DEBUG("qtaguid: %s(%s): entry=%p\n", __func__,
 		 el_dev->name, entry);
 
-	entry->totals_via_skb[direction].bytes += bytes;
-	entry->totals_via_skb[direction].packets++;
-	spin_unlock_bh(&iface_stat_list_lock);
+	totals = &entry->totals_via_skb[smp_processor_id()];
+	u64_stats_update_begin(&totals->syncp);
+	totals->bpc[direction].bytes += bytes;
+	totals->bpc[direction].packets++;
+	u64_stats_update_end(&totals->syncp);
+	rcu_read_unlock();
+}
+
+static void tag_stat_counters_update(struct tag_stat *tag_entry, int set,
+				     enum ifs_tx_rx direction, int proto,
+				     int bytes)
+{
+	struct tag_stat_counters *tsc = &tag_entry->pcpu[smp_processor_id()];
+
+	u64_stats_update_begin(&tsc->syncp);
+	data_counters_update(&tsc->counters, set, direction, proto, bytes);
+	u64_stats_update_end(&tsc->syncp);
+	tsc->gen = atomic_read(&qtaguid_stats_gen);
 }
 
-static void tag_stat_update(struct tag_stat *tag_entry,
+/* Called from the packet path with bottom halves disabled. */
+static void tag_stat_update(struct tag_stat *tag_entry, int active_set,
 			enum ifs_tx_rx direction, int proto, int bytes)
 {
-	int active_set;
-	active_set = get_active_counter_set(tag_entry->tn.tag);
 	MT_DEBUG("qtaguid: tag_stat_update(tag=0x%llx (uid=%u) set=%d "
 		 "dir=%d proto=%d bytes=%d)\n",
 		 tag_entry->tn.tag, get_uid_from_tag(tag_entry->tn.tag),
 		 active_set, direction, proto, bytes);
-	data_counters_update(&tag_entry->counters, active_set, direction,
-			     proto, bytes);
-	if (tag_entry->parent_counters)
-		data_counters_update(tag_entry->parent_counters, active_set,
-				     direction, proto, bytes);
+	tag_stat_counters_update(tag_entry, active_set, direction, proto,
+				 bytes);
+	if (tag_entry->parent)
+		tag_stat_counters_update(tag_entry->parent, active_set,
+					 direction, proto, bytes);
 }
 
 /*
@@ -1381,7 +1513,10 @@ static struct tag_stat *create_if_tag_stat(struct iface_stat *iface_entry,
 	IF_DEBUG("qtaguid: iface_stat: %s(): ife=%p tag=0x%llx"
 		 " (uid=%u)\n", __func__,
 		 iface_entry, tag, get_uid_from_tag(tag));
-	new_tag_stat_entry = kzalloc(sizeof(*new_tag_stat_entry), GFP_ATOMIC);
+	new_tag_stat_entry = kzalloc(sizeof(*new_tag_stat_entry) +
+				     nr_cpu_ids *
+				     sizeof(new_tag_stat_entry->pcpu[0]),
+				     GFP_ATOMIC);
 	if (!new_tag_stat_entry) {
 		pr_err("qtaguid: iface_stat: tag stat alloc failed\n");
 		goto done;
@@ -1392,97 +1527,117 @@ done:
 	return new_tag_stat_entry;
 }
 
-static void if_tag_stat_update(const char *ifname, uid_t uid,
+/*
+ * Find or create the tag_stat to bill for tag on iface_entry.
+ * iface_entry->tag_stat_list_lock should be held.
+ */
+static struct tag_stat *get_if_tag_stat(struct iface_stat *iface_entry,
+					tag_t tag)
+{
+	struct tag_stat *tag_stat_entry;
+	struct tag_stat *uid_tag_stat;
+	tag_t acct_tag = get_atag_from_tag(tag);
+	tag_t uid_tag = get_utag_from_tag(tag);
+
+	/* Loop over tag list under this interface for {acct_tag,uid_tag} */
+	tag_stat_entry = tag_stat_tree_search(&iface_entry->tag_stat_tree,
+					      tag);
+	if (tag_stat_entry) {
+		/*
+		 * Updating the {acct_tag, uid_tag} entry handles both stats:
+		 * {0, uid_tag} will also get updated.
+		 */
+		return tag_stat_entry;
+	}
+
+	/* Loop over tag list under this interface for {0,uid_tag} */
+	uid_tag_stat = tag_stat_tree_search(&iface_entry->tag_stat_tree,
+					    uid_tag);
+	if (!uid_tag_stat) {
+		/* Here: the base uid_tag did not exist */
+		/*
+		 * No parent counters. So
+		 *  - No {0, uid_tag} stats and no {acc_tag, uid_tag} stats.
+		 */
+		uid_tag_stat = create_if_tag_stat(iface_entry, uid_tag);
+		if (!uid_tag_stat)
+			return NULL;
+	}
+	/*
+	 * For acct_tag == 0 the {0, uid_tag} entry did not exist, or the
+	 * first search would have found it, so it was just created.
+	 */
+	if (!acct_tag)
+		return uid_tag_stat;
+
+	/* Create the child {acct_tag, uid_tag} and hook up parent. */
+	tag_stat_entry = create_if_tag_stat(iface_entry, tag);
+	if (tag_stat_entry)
+		tag_stat_entry->parent = uid_tag_stat;
+	return tag_stat_entry;
+}
+
+static void if_tag_stat_update(const struct net_device *net_dev, uid_t uid,
 			       const struct sock *sk, enum ifs_tx_rx direction,
 			       int proto, int bytes)
 {
 	struct tag_stat *tag_stat_entry;
-	tag_t tag, acct_tag;
-	tag_t uid_tag;
-	struct data_counters *uid_tag_counters;
-	struct sock_tag *sock_tag_entry;
+	struct tag_stat_cache *cache;
+	tag_t tag;
 	struct iface_stat *iface_entry;
-	struct tag_stat *new_tag_stat = NULL;
+	unsigned int gen;
+	int active_set;
 	MT_DEBUG("qtaguid: if_tag_stat_update(ifname=%s "
 		"uid=%u sk=%p dir=%d proto=%d bytes=%d)\n",
-		 ifname, uid, sk, direction, proto, bytes);
+		 net_dev->name, uid, sk, direction, proto, bytes);
 
-
-	iface_entry = get_iface_entry(ifname);
+	rcu_read_lock();
+	iface_entry = get_iface_entry_rcu(net_dev);
 	if (!iface_entry) {
 		pr_err("qtaguid: iface_stat: stat_update() %s not found\n",
-		       ifname);
-		return;
+		       net_dev->name);
+		goto done_unlock;
 	}
 	/* It is ok to process data when an iface_entry is inactive */
 
 	MT_DEBUG("qtaguid: iface_stat: stat_update() dev=%s entry=%p\n",
-		 ifname, iface_entry);
+		 net_dev->name, iface_entry);
 
 	/*
 	 * Look for a tagged sock.
 	 * It will have an acct_uid.
 	 */
-	sock_tag_entry = get_sock_stat(sk);
-	if (sock_tag_entry) {
-		tag = sock_tag_entry->tag;
-		acct_tag = get_atag_from_tag(tag);
-		uid_tag = get_utag_from_tag(tag);
-	} else {
-		acct_tag = make_atag_from_value(0);
-		tag = combine_atag_with_uid(acct_tag, uid);
-		uid_tag = make_tag_from_uid(uid);
+	if (!get_sock_tag_rcu(sk, &tag))
+		tag = combine_atag_with_uid(make_atag_from_value(0), uid);
+
+	gen = atomic_read(&tag_stat_gen);
+	smp_rmb();
+	cache = &__get_cpu_var(tag_stat_cache);
+	if (cache->gen == gen && cache->iface_entry == iface_entry
+	    && cache->tag == tag && cache->ts_entry) {
+		tag_stat_update(cache->ts_entry, cache->active_set,
+				direction, proto, bytes);
+		goto done_unlock;
 	}
+
 	MT_DEBUG("qtaguid: iface_stat: stat_update(): "
 		 " looking for tag=0x%llx (uid=%u) in ife=%p\n",
 		 tag, get_uid_from_tag(tag), iface_entry);
-	/* Loop over tag list under this interface for {acct_tag,uid_tag} */
+	active_set = get_active_counter_set(tag);
 	spin_lock_bh(&iface_entry->tag_stat_list_lock);
-
-	tag_stat_entry = tag_stat_tree_search(&iface_entry->tag_stat_tree,
-					      tag);
+	tag_stat_entry = get_if_tag_stat(iface_entry, tag);
 	if (tag_stat_entry) {
-		/*
-		 * Updating the {acct_tag, uid_tag} entry handles both stats:
-		 * {0, uid_tag} will also get updated.
-		 */
-		tag_stat_update(tag_stat_entry, direction, proto, bytes);
-		spin_unlock_bh(&iface_entry->tag_stat_list_lock);
-		return;
+		tag_stat_update(tag_stat_entry, active_set, direction, proto,
+				bytes);
+		cache->gen = gen;
+		cache->iface_entry = iface_entry;
+		cache->tag = tag;
+		cache->ts_entry = tag_stat_entry;
+		cache->active_set = active_set;
 	}
-
-	/* Loop over tag list under this interface for {0,uid_tag} */
-	tag_stat_entry = tag_stat_tree_search(&iface_entry->tag_stat_tree,
-					      uid_tag);
-	if (!tag_stat_entry) {
-		/* Here: the base uid_tag did not exist */
-		/*
-		 * No parent counters. So
-		 *  - No {0, uid_tag} stats and no {acc_tag, uid_tag} stats.
-		 */
-		new_tag_stat = create_if_tag_stat(iface_entry, uid_tag);
-		uid_tag_counters = &new_tag_stat->counters;
-	} else {
-		uid_tag_counters = &tag_stat_entry->counters;
-	}
-
-	if (acct_tag) {
-		/* Create the child {acct_tag, uid_tag} and hook up parent. */
-		new_tag_stat = create_if_tag_stat(iface_entry, tag);
-		new_tag_stat->parent_counters = uid_tag_counters;
-	} else {
-		/*
-		 * For new_tag_stat to be still NULL here would require:
-		 *  {0, uid_tag} exists
-		 *  and {acct_tag, uid_tag} doesn't exist
-		 *  AND acct_tag == 0.
-		 * Impossible. This reassures us that new_tag_stat
-		 * below will always be assigned.
-		 */
-		BUG_ON(!new_tag_stat);
-	}
-	tag_stat_update(new_tag_stat, direction, proto, bytes);
 	spin_unlock_bh(&iface_entry->tag_stat_list_lock);
+done_unlock:
+	rcu_read_unlock();
 }
 
 static int iface_netdev_event_handler(struct notifier_block *nb,
@@ -1729,7 +1884,7 @@ static void account_for_uid(const struct sk_buff *skb,
 			 par->hooknum, el_dev->name, el_dev->type,
 			 par->family, proto);
 
-		if_tag_stat_update(el_dev->name, uid,
+		if_tag_stat_update(el_dev, uid,
 				skb->sk ? skb->sk : alternate_sk,
 				par->in ? IFS_RX : IFS_TX,
 				proto, skb->len);
@@ -2095,6 +2250,7 @@ static int ctrl_cmd_delete(const char *input)
 
 		if (!acct_tag || st_entry->tag == tag) {
 			rb_erase(&st_entry->sock_node, &sock_tag_tree);
+			sock_tag_hash_del(st_entry);
 			/* Can't sockfd_put() within spinlock, do it later. */
 			sock_tag_tree_insert(st_entry, &st_to_free_tree);
 			tr_entry = lookup_tag_ref(st_entry->tag, NULL);
@@ -2158,7 +2314,11 @@ static int ctrl_cmd_delete(const char *input)
 					 entry_uid);
 				rb_erase(&ts_entry->tn.node,
 					 &iface_entry->tag_stat_tree);
-				kfree(ts_entry);
+				/* The packet path might still be using it */
+				tag_stat_cache_invalidate();
+				kfree_rcu(ts_entry, rcu);
+				atomic_set(&qtaguid_stats_delete_gen,
+					   atomic_read(&qtaguid_stats_gen));
 			}
 		}
 		spin_unlock_bh(&iface_entry->tag_stat_list_lock);
@@ -2247,6 +2407,7 @@ static int ctrl_cmd_counter_set(const char *input)
 	}
 	tcs->active_set = counter_set;
 	spin_unlock_bh(&tag_counter_set_list_lock);
+	tag_stat_cache_invalidate();
 	atomic64_inc(&qtu_events.counter_set_changes);
 	res = 0;
 
@@ -2341,7 +2502,9 @@ static int ctrl_cmd_tag(const char *input)
 		BUG_ON(IS_ERR_OR_NULL(prev_tag_ref_entry));
 		BUG_ON(prev_tag_ref_entry->num_sock_tags <= 0);
 		prev_tag_ref_entry->num_sock_tags--;
+		write_seqcount_begin(&sock_tag_entry->tag_seq);
 		sock_tag_entry->tag = full_tag;
+		write_seqcount_end(&sock_tag_entry->tag_seq);
 	} else {
 		CT_DEBUG("qtaguid: ctrl_tag(%s): newtag for sk=%p\n",
 			 input, el_socket->sk);
@@ -2358,6 +2521,7 @@ static int ctrl_cmd_tag(const char *input)
 		sock_tag_entry->sk = el_socket->sk;
 		sock_tag_entry->socket = el_socket;
 		sock_tag_entry->pid = current->tgid;
+		seqcount_init(&sock_tag_entry->tag_seq);
 		sock_tag_entry->tag = combine_atag_with_uid(acct_tag,
 							    uid);
 		spin_lock_bh(&uid_tag_data_tree_lock);
@@ -2381,6 +2545,7 @@ static int ctrl_cmd_tag(const char *input)
 		spin_unlock_bh(&uid_tag_data_tree_lock);
 
 		sock_tag_tree_insert(sock_tag_entry, &sock_tag_tree);
+		sock_tag_hash_add(sock_tag_entry);
 		atomic64_inc(&qtu_events.sockets_tagged);
 	}
 	spin_unlock_bh(&sock_tag_list_lock);
@@ -2447,6 +2612,7 @@ static int ctrl_cmd_untag(const char *input)
 	 * so it can do whatever it wants to it.
 	 */
 	rb_erase(&sock_tag_entry->sock_node, &sock_tag_tree);
+	sock_tag_hash_del(sock_tag_entry);
 
 	tag_ref_entry = lookup_tag_ref(sock_tag_entry->tag, &utd_entry);
 	BUG_ON(!tag_ref_entry);
@@ -2483,7 +2649,7 @@ static int ctrl_cmd_untag(const char *input)
 		 atomic_long_read(&el_socket->file->f_count) - 1);
 	sockfd_put(el_socket);
 
-	kfree(sock_tag_entry);
+	kfree_rcu(sock_tag_entry, rcu);
 	atomic64_inc(&qtu_events.sockets_untagged);
 
 	return 0;
@@ -2562,6 +2728,8 @@ struct proc_print_info {
 	char **num_items_returned;
 	struct iface_stat *iface_entry;
 	struct tag_stat *ts_entry;
+	/* ts_entry's counters summed over all cpus */
+	struct data_counters cnts;
 	int item_index;
 	int items_to_skip;
 	int char_count;
@@ -2600,7 +2768,7 @@ static int pp_stats_line(struct proc_print_info *ppi, int cnt_set)
 		}
 		if (ppi->item_index++ < ppi->items_to_skip)
 			return 0;
-		cnts = &ppi->ts_entry->counters;
+		cnts = &ppi->cnts;
 		len = snprintf(
 			ppi->outp, ppi->char_count,
 			"%d %s 0x%llx %u %u "
@@ -2641,6 +2809,8 @@ static bool pp_sets(struct proc_print_info *ppi)
 {
 	int len;
 	int counter_set;
+
+	tag_stat_sum_counters(ppi->ts_entry, &ppi->cnts);
 	for (counter_set = 0; counter_set < IFS_MAX_COUNTER_SETS;
 	     counter_set++) {
 		len = pp_stats_line(ppi, counter_set);
@@ -2730,6 +2900,267 @@ static int qtaguid_stats_proc_read(char *page, char **num_items_returned,
 	return ppi.outp - page;
 }
 
+/*------------------------------------------*/
+/*
+ * Binary stats dump, see struct xt_qtaguid_stats_hdr for the format.
+ *
+ * The iterator holds the tag_stat_list_lock of the iface it is walking from
+ * ->start to ->stop, and remembers the last {iface, tag} it returned so that
+ * each read() resumes with a tree search instead of a walk from the top.
+ */
+struct stats_bin_iter {
+	/* Set through write(), 0 asks for a full dump */
+	unsigned int since;
+	/* Generation of the dump in progress */
+	unsigned int gen;
+	bool full;
+	/* Position of the tag_stat at {iface_entry, tag} */
+	loff_t pos;
+	struct iface_stat *iface_entry;
+	tag_t tag;
+	struct iface_stat *locked_iface;
+};
+
+static void stats_bin_lock_iface(struct stats_bin_iter *iter,
+				 struct iface_stat *iface_entry)
+{
+	if (iter->locked_iface == iface_entry)
+		return;
+	if (iter->locked_iface)
+		spin_unlock_bh(&iter->locked_iface->tag_stat_list_lock);
+	iter->locked_iface = iface_entry;
+	if (iface_entry)
+		spin_lock_bh(&iface_entry->tag_stat_list_lock);
+}
+
+/* First tag_stat in root with a tag >= tag, or > tag if after is set */
+static struct tag_stat *tag_stat_tree_lower_bound(struct rb_root *root,
+						  tag_t tag, bool after)
+{
+	struct rb_node *node = root->rb_node;
+	struct tag_stat *res = NULL;
+
+	while (node) {
+		struct tag_stat *ts_entry = rb_entry(node, struct tag_stat,
+						     tn.node);
+		int result = tag_compare(ts_entry->tn.tag, tag);
+
+		if (result > 0 || (!after && !result)) {
+			res = ts_entry;
+			node = node->rb_left;
+		} else {
+			node = node->rb_right;
+		}
+	}
+	return res;
+}
+
+/*
+ * Find the first tag_stat at (or after) {iface_entry, tag}, moving on to the
+ * following ifaces as needed, and remember where it was found.
+ */
+static struct tag_stat *stats_bin_seek(struct stats_bin_iter *iter,
+				       struct iface_stat *iface_entry,
+				       tag_t tag, bool after)
+{
+	struct tag_stat *ts_entry;
+
+	while (&iface_entry->list != &iface_stat_list) {
+		stats_bin_lock_iface(iter, iface_entry);
+		ts_entry = tag_stat_tree_lower_bound(
+			&iface_entry->tag_stat_tree, tag, after);
+		if (ts_entry) {
+			iter->iface_entry = iface_entry;
+			iter->tag = ts_entry->tn.tag;
+			return ts_entry;
+		}
+		iface_entry = list_entry_rcu(iface_entry->list.next,
+					     struct iface_stat, list);
+		tag = 0;
+		after = false;
+	}
+	stats_bin_lock_iface(iter, NULL);
+	iter->iface_entry = NULL;
+	return NULL;
+}
+
+static struct tag_stat *stats_bin_first(struct stats_bin_iter *iter)
+{
+	return stats_bin_seek(iter, list_entry_rcu(iface_stat_list.next,
+						   struct iface_stat, list),
+			      0, false);
+}
+
+static void *qtaguid_stats_bin_start(struct seq_file *m, loff_t *pos)
+{
+	struct stats_bin_iter *iter = m->private;
+	struct tag_stat *ts_entry;
+	loff_t n;
+
+	rcu_read_lock();
+	if (!*pos) {
+		iter->gen = atomic_inc_return(&qtaguid_stats_gen);
+		iter->full = !iter->since ||
+			(int)(atomic_read(&qtaguid_stats_delete_gen)
+			      - iter->since) >= 0;
+		iter->iface_entry = NULL;
+		iter->pos = 0;
+		return SEQ_START_TOKEN;
+	}
+	if (unlikely(module_passive))
+		return NULL;
+
+	if (iter->iface_entry && *pos == iter->pos) {
+		ts_entry = stats_bin_seek(iter, iter->iface_entry,
+					  iter->tag, false);
+	} else if (iter->iface_entry && *pos == iter->pos + 1) {
+		ts_entry = stats_bin_seek(iter, iter->iface_entry,
+					  iter->tag, true);
+	} else {
+		ts_entry = stats_bin_first(iter);
+		for (n = 1; ts_entry && n < *pos; n++)
+			ts_entry = stats_bin_seek(iter, iter->iface_entry,
+						  iter->tag, true);
+	}
+	if (ts_entry)
+		iter->pos = *pos;
+	return ts_entry;
+}
+
+static void *qtaguid_stats_bin_next(struct seq_file *m, void *v, loff_t *pos)
+{
+	struct stats_bin_iter *iter = m->private;
+	struct tag_stat *ts_entry;
+
+	(*pos)++;
+	if (v == SEQ_START_TOKEN) {
+		if (unlikely(module_passive))
+			return NULL;
+		ts_entry = stats_bin_first(iter);
+	} else {
+		ts_entry = stats_bin_seek(iter, iter->iface_entry,
+					  iter->tag, true);
+	}
+	if (ts_entry)
+		iter->pos = *pos;
+	return ts_entry;
+}
+
+static void qtaguid_stats_bin_stop(struct seq_file *m, void *v)
+{
+	struct stats_bin_iter *iter = m->private;
+
+	stats_bin_lock_iface(iter, NULL);
+	rcu_read_unlock();
+}
+
+static bool tag_stat_changed_since(struct tag_stat *ts_entry,
+				   unsigned int gen)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		if ((int)(ACCESS_ONCE(ts_entry->pcpu[cpu].gen) - gen) >= 0)
+			return true;
+	}
+	return false;
+}
+
+static int qtaguid_stats_bin_show(struct seq_file *m, void *v)
+{
+	struct stats_bin_iter *iter = m->private;
+	struct tag_stat *ts_entry = v;
+	struct xt_qtaguid_stats_rec rec;
+	struct data_counters cnts;
+	uid_t stat_uid;
+	int set, proto;
+
+	BUILD_BUG_ON(XT_QTAGUID_STATS_SETS != IFS_MAX_COUNTER_SETS);
+	BUILD_BUG_ON((int)XT_QTAGUID_STATS_PROTOS != (int)IFS_MAX_PROTOS);
+
+	if (v == SEQ_START_TOKEN) {
+		struct xt_qtaguid_stats_hdr hdr = {
+			.magic = XT_QTAGUID_STATS_MAGIC,
+			.version = XT_QTAGUID_STATS_VERSION,
+			.flags = iter->full ? XT_QTAGUID_STATS_FULL : 0,
+			.record_size = sizeof(rec),
+			.generation = iter->gen,
+		};
+		return seq_write(m, &hdr, sizeof(hdr));
+	}
+
+	stat_uid = get_uid_from_tag(ts_entry->tn.tag);
+	if (!can_read_other_uid_stats(stat_uid))
+		return SEQ_SKIP;
+	if (!iter->full && !tag_stat_changed_since(ts_entry, iter->since))
+		return SEQ_SKIP;
+
+	tag_stat_sum_counters(ts_entry, &cnts);
+	memset(&rec, 0, sizeof(rec));
+	strlcpy(rec.ifname, iter->iface_entry->ifname, sizeof(rec.ifname));
+	rec.acct_tag = get_atag_from_tag(ts_entry->tn.tag) >> 32;
+	rec.uid = stat_uid;
+	for (set = 0; set < IFS_MAX_COUNTER_SETS; set++) {
+		for (proto = 0; proto < IFS_MAX_PROTOS; proto++) {
+			rec.counters[set][XT_QTAGUID_STATS_RX][proto].bytes =
+				cnts.bpc[set][IFS_RX][proto].bytes;
+			rec.counters[set][XT_QTAGUID_STATS_RX][proto].packets =
+				cnts.bpc[set][IFS_RX][proto].packets;
+			rec.counters[set][XT_QTAGUID_STATS_TX][proto].bytes =
+				cnts.bpc[set][IFS_TX][proto].bytes;
+			rec.counters[set][XT_QTAGUID_STATS_TX][proto].packets =
+				cnts.bpc[set][IFS_TX][proto].packets;
+		}
+	}
+	return seq_write(m, &rec, sizeof(rec));
+}
+
+static const struct seq_operations qtaguid_stats_bin_seq_ops = {
+	.start = qtaguid_stats_bin_start,
+	.next = qtaguid_stats_bin_next,
+	.stop = qtaguid_stats_bin_stop,
+	.show = qtaguid_stats_bin_show,
+};
+
+static int qtaguid_stats_bin_open(struct inode *inode, struct file *file)
+{
+	return seq_open_private(file, &qtaguid_stats_bin_seq_ops,
+				sizeof(struct stats_bin_iter));
+}
+
+/* Takes the generation of a previous dump to ask for a delta dump. */
+static ssize_t qtaguid_stats_bin_write(struct file *file,
+				       const char __user *buffer,
+				       size_t count, loff_t *offp)
+{
+	struct seq_file *m = file->private_data;
+	struct stats_bin_iter *iter = m->private;
+	char input_buf[16];
+	unsigned int since;
+
+	if (count >= sizeof(input_buf))
+		return -EINVAL;
+	if (copy_from_user(input_buf, buffer, count))
+		return -EFAULT;
+	input_buf[count] = '\0';
+	if (sscanf(input_buf, "%u", &since) != 1)
+		return -EINVAL;
+
+	mutex_lock(&m->lock);
+	iter->since = since;
+	mutex_unlock(&m->lock);
+	return count;
+}
+
+static const struct file_operations qtaguid_stats_bin_fops = {
+	.owner = THIS_MODULE,
+	.open = qtaguid_stats_bin_open,
+	.read = seq_read,
+	.write = qtaguid_stats_bin_write,
+	.llseek = seq_lseek,
+	.release = seq_release_private,
+};
+
 /*------------------------------------------*/
 static int qtudev_open(struct inode *inode, struct file *file)
 {
@@ -2848,6 +3279,7 @@ static int qtudev_release(struct inode *inode, struct file *file)
 		free_tag_ref_from_utd_entry(tr, utd_entry);
 
 		rb_erase(&st_entry->sock_node, &sock_tag_tree);
+		sock_tag_hash_del(st_entry);
 		list_del(&st_entry->list);
 		/* Can't sockfd_put() within spinlock, do it later. */
 		sock_tag_tree_insert(st_entry, &st_to_free_tree);
@@ -2927,8 +3359,22 @@ static int __init qtaguid_proc_register(struct proc_dir_entry **res_procdir)
 	 * TODO: add support counter hacking
 	 * xt_qtaguid_stats_file->write_proc = qtaguid_stats_proc_write;
 	 */
+
+	/* Anyone who can read it may ask for a delta of their own dump. */
+	xt_qtaguid_stats_bin_file = proc_create("stats_bin",
+						proc_stats_perms | S_IWUGO,
+						*res_procdir,
+						&qtaguid_stats_bin_fops);
+	if (!xt_qtaguid_stats_bin_file) {
+		pr_err("qtaguid: failed to create xt_qtaguid/stats_bin "
+			"file\n");
+		ret = -ENOMEM;
+		goto no_stats_bin_entry;
+	}
 	return 0;
 
+no_stats_bin_entry:
+	remove_proc_entry("stats", *res_procdir);
 no_stats_entry:
 	remove_proc_entry("ctrl", *res_procdir);
 no_ctrl_entry:
@@ -11,8 +11,14 @@
 #define __XT_QTAGUID_INTERNAL_H__
 
 #include <linux/types.h>
+#include <linux/cache.h>
+#include <linux/cpumask.h>
 #include <linux/rbtree.h>
+#include <linux/rcupdate.h>
+#include <linux/seqlock.h>
 #include <linux/spinlock_types.h>
+#include <linux/string.h>
+#include <linux/u64_stats_sync.h>
 #include <linux/workqueue.h>
 
 /* Iface handling */
@@ -179,6 +185,18 @@ struct data_counters {
 	struct byte_packet_counters bpc[IFS_MAX_COUNTER_SETS][IFS_MAX_DIRECTIONS][IFS_MAX_PROTOS];
 };
 
+/*
+ * The packet path only ever touches the copy belonging to the cpu it runs
+ * on, with bottom halves disabled by the iptables core. Readers add up all
+ * the cpus; syncp keeps the 64bit values from tearing on 32bit hosts.
+ */
+struct tag_stat_counters {
+	struct data_counters counters;
+	struct u64_stats_sync syncp;
+	/* qtaguid_stats_gen as of the last update, for delta dumps */
+	unsigned int gen;
+} ____cacheline_aligned_in_smp;
+
 /* Generic X based nodes used as a base for rb_tree ops */
 struct tag_node {
 	struct rb_node node;
@@ -187,23 +205,59 @@ struct tag_node {
 
 struct tag_stat {
 	struct tag_node tn;
-	struct data_counters counters;
+	/* tag_stats are looked up locklessly and freed after a grace period */
+	struct rcu_head rcu;
 	/*
 	 * If this tag is acct_tag based, we need to count against the
 	 * matching parent uid_tag.
 	 */
-	struct data_counters *parent_counters;
+	struct tag_stat *parent;
+	/* One entry per possible cpu, see tag_stat_sum_counters() */
+	struct tag_stat_counters pcpu[0];
 };
 
+static inline void tag_stat_sum_counters(struct tag_stat *ts,
+					 struct data_counters *res)
+{
+	uint64_t *dst = (uint64_t *)res->bpc;
+	int cpu, i;
+
+	memset(res, 0, sizeof(*res));
+	for_each_possible_cpu(cpu) {
+		struct tag_stat_counters *tsc = &ts->pcpu[cpu];
+		struct data_counters snap;
+		uint64_t *src = (uint64_t *)snap.bpc;
+		unsigned int start;
+
+		do {
+			start = u64_stats_fetch_begin_bh(&tsc->syncp);
+			snap = tsc->counters;
+		} while (u64_stats_fetch_retry_bh(&tsc->syncp, start));
+		for (i = 0; i < sizeof(snap) / sizeof(uint64_t); i++)
+			dst[i] += src[i];
+	}
+}
+
+/* Per cpu share of iface_stat.totals_via_skb */
+struct iface_skb_totals {
+	struct byte_packet_counters bpc[IFS_MAX_DIRECTIONS];
+	struct u64_stats_sync syncp;
+} ____cacheline_aligned_in_smp;
+
 struct iface_stat {
-	struct list_head list;  /* in iface_stat_list */
+	/*
+	 * In iface_stat_list. Entries are never removed, the packet path
+	 * walks the list under rcu_read_lock().
+	 */
+	struct list_head list;
 	char *ifname;
 	bool active;
 	/* net_dev is only valid for active iface_stat */
 	struct net_device *net_dev;
 
 	struct byte_packet_counters totals_via_dev[IFS_MAX_DIRECTIONS];
-	struct byte_packet_counters totals_via_skb[IFS_MAX_DIRECTIONS];
+	/* One entry per possible cpu, see iface_stat_sum_skb_totals() */
+	struct iface_skb_totals *totals_via_skb;
 	/*
 	 * We keep the last_known, because some devices reset their counters
 	 * just before NETDEV_UP, while some will reset just before
@@ -222,6 +276,28 @@ struct iface_stat {
 	spinlock_t tag_stat_list_lock;
 };
 
+static inline void iface_stat_sum_skb_totals(struct iface_stat *is,
+					     struct byte_packet_counters *res)
+{
+	int cpu, dir;
+
+	memset(res, 0, sizeof(*res) * IFS_MAX_DIRECTIONS);
+	for_each_possible_cpu(cpu) {
+		struct iface_skb_totals *ist = &is->totals_via_skb[cpu];
+		struct byte_packet_counters snap[IFS_MAX_DIRECTIONS];
+		unsigned int start;
+
+		do {
+			start = u64_stats_fetch_begin_bh(&ist->syncp);
+			memcpy(snap, ist->bpc, sizeof(snap));
+		} while (u64_stats_fetch_retry_bh(&ist->syncp, start));
+		for (dir = 0; dir < IFS_MAX_DIRECTIONS; dir++) {
+			res[dir].bytes += snap[dir].bytes;
+			res[dir].packets += snap[dir].packets;
+		}
+	}
+}
+
 /* This is needed to create proc_dir_entries from atomic context. */
 struct iface_stat_work {
 	struct work_struct iface_work;
@@ -236,6 +312,9 @@ struct iface_stat_work {
  */
 struct sock_tag {
 	struct rb_node sock_node;
+	/* In sock_tag_hash, for the lockless lookup from the packet path */
+	struct hlist_node sock_hash_node;
+	struct rcu_head rcu;
 	struct sock *sk;  /* Only used as a number, never dereferenced */
 	/* The socket is needed for sockfd_put() */
 	struct socket *socket;
@@ -243,6 +322,8 @@ struct sock_tag {
 	struct list_head list;   /* in proc_qtu_data.sock_tag_list */
 	pid_t pid;
 
+	/* Retagging bumps tag_seq so lockless readers never see half a tag */
+	seqcount_t tag_seq;
 	tag_t tag;
 };
 
@@ -0,0 +1,209 @@
+/*
+ * ashmem_bench - ashmem pin/unpin throughput under memory pressure
+ *
+ * Copyright (C) 2012 Google, Inc.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * For every thread count from 1 to -j, each thread maps its own -s page
+ * ashmem region and for -t seconds unpins and re-pins it -c pages at a
+ * time, refilling chunks that were purged in between, as a cache built
+ * on ashmem would.  With -m a separate process keeps allocating, touching
+ * and freeing that many MB so that reclaim runs the ashmem shrinker the
+ * whole time.  A shrinker that holds many area mutexes, or that keeps
+ * rescanning busy areas, shows up as pin/unpin stalls and a falling
+ * pairs/s column; the purged column shows how much the shrinker got.
+ */
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* from include/linux/ashmem.h */
+#define __ASHMEMIOC		0x77
+#define ASHMEM_SET_SIZE		_IOW(__ASHMEMIOC, 3, size_t)
+#define ASHMEM_PIN		_IOW(__ASHMEMIOC, 7, struct ashmem_pin)
+#define ASHMEM_UNPIN		_IOW(__ASHMEMIOC, 8, struct ashmem_pin)
+#define ASHMEM_WAS_PURGED	1
+
+struct ashmem_pin {
+	uint32_t offset;
+	uint32_t len;
+};
+
+#define MAX_THREADS	64
+
+static size_t page_size;
+static size_t region_pages = 1024;
+static size_t chunk_pages = 16;
+static int seconds = 5;
+static volatile int start_flag, stop_flag;
+
+struct worker {
+	pthread_t thread;
+	unsigned long long pairs;
+	unsigned long long purged;
+	int error;
+};
+
+static void *worker_thread(void *arg)
+{
+	struct worker *w = arg;
+	size_t size = region_pages * page_size;
+	size_t chunk = chunk_pages * page_size;
+	struct ashmem_pin pin;
+	size_t off = 0;
+	char *map;
+	int fd, ret;
+
+	fd = open("/dev/ashmem", O_RDWR);
+	if (fd < 0 || ioctl(fd, ASHMEM_SET_SIZE, size) < 0) {
+		w->error = 1;
+		return NULL;
+	}
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		w->error = 1;
+		close(fd);
+		return NULL;
+	}
+	memset(map, 1, size);
+
+	while (!start_flag)
+		;
+	while (!stop_flag) {
+		pin.offset = off;
+		pin.len = chunk;
+		if (ioctl(fd, ASHMEM_UNPIN, &pin) < 0) {
+			w->error = 1;
+			break;
+		}
+		ret = ioctl(fd, ASHMEM_PIN, &pin);
+		if (ret < 0) {
+			w->error = 1;
+			break;
+		}
+		if (ret == ASHMEM_WAS_PURGED) {
+			memset(map + off, 1, chunk);
+			w->purged++;
+		}
+		w->pairs++;
+		off += chunk;
+		if (off + chunk > size)
+			off = 0;
+	}
+	munmap(map, size);
+	close(fd);
+	return NULL;
+}
+
+static void run_pressure(size_t mb)
+{
+	size_t size = mb << 20;
+	char *mem;
+
+	for (;;) {
+		mem = malloc(size);
+		if (mem) {
+			memset(mem, 1, size);
+			free(mem);
+		}
+	}
+}
+
+static int run_round(int threads)
+{
+	struct worker w[MAX_THREADS];
+	unsigned long long pairs = 0, purged = 0;
+	int i, error = 0;
+
+	memset(w, 0, sizeof(w));
+	start_flag = stop_flag = 0;
+	for (i = 0; i < threads; i++)
+		pthread_create(&w[i].thread, NULL, worker_thread, &w[i]);
+	start_flag = 1;
+	sleep(seconds);
+	stop_flag = 1;
+	for (i = 0; i < threads; i++) {
+		pthread_join(w[i].thread, NULL);
+		pairs += w[i].pairs;
+		purged += w[i].purged;
+		error |= w[i].error;
+	}
+	if (error) {
+		fprintf(stderr, "/dev/ashmem: setup or ioctl failed\n");
+		return -1;
+	}
+	printf("%7d %12.0f %12llu\n", threads, (double)pairs / seconds,
+	       purged);
+	fflush(stdout);
+	return 0;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-j max_threads] [-s region_pages] "
+		"[-c chunk_pages] [-m pressure_mb] [-t seconds]\n", prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	int max_threads = 4, threads, opt, ret = 0;
+	size_t pressure_mb = 0;
+	pid_t pressure = 0;
+
+	while ((opt = getopt(argc, argv, "j:s:c:m:t:")) != -1) {
+		switch (opt) {
+		case 'j':
+			max_threads = atoi(optarg);
+			break;
+		case 's':
+			region_pages = atoi(optarg);
+			break;
+		case 'c':
+			chunk_pages = atoi(optarg);
+			break;
+		case 'm':
+			pressure_mb = atoi(optarg);
+			break;
+		case 't':
+			seconds = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (max_threads < 1 || max_threads > MAX_THREADS || !chunk_pages ||
+	    region_pages < chunk_pages || seconds < 1)
+		usage(argv[0]);
+	page_size = sysconf(_SC_PAGESIZE);
+
+	if (pressure_mb) {
+		pressure = fork();
+		if (pressure == 0)
+			run_pressure(pressure_mb);
+	}
+
+	printf("threads      pairs/s       purged  (%zu page regions, "
+	       "%zu page chunks, %zu MB pressure)\n",
+	       region_pages, chunk_pages, pressure_mb);
+	for (threads = 1; threads <= max_threads && !ret; threads++)
+		ret = run_round(threads);
+
+	if (pressure > 0) {
+		kill(pressure, SIGKILL);
+		waitpid(pressure, NULL, 0);
+	}
+	return ret ? 1 : 0;
+}
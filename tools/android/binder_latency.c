@@ -0,0 +1,177 @@
+/*
+ * binder_latency - check binder latency histograms against userspace
+ *
+ * Copyright (C) 2012 Google, Inc.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * Runs -n synchronous calls from a client process to a server process
+ * that spends -d microseconds on each call, and prints the round trip
+ * times seen by the client in the same log2 microsecond buckets that the
+ * driver uses.  It then prints the client's and server's entries from
+ * the binder debugfs "latency" file: the server's queue histogram should
+ * sit well below the client round trips and its reply histogram should
+ * peak at the -d bucket.  Must run as root (servicemanager and debugfs).
+ */
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "binder_util.h"
+
+#define MAP_SIZE	(128 * 1024)
+#define HIST_BUCKETS	16	/* BINDER_HIST_BUCKETS */
+#define LATENCY_FILE	"/sys/kernel/debug/binder/latency"
+
+static int server_delay_us;
+
+static int delay_handler(struct binder_state *bs,
+			 struct binder_transaction_data *txn,
+			 void *reply, size_t *reply_len)
+{
+	if (server_delay_us)
+		usleep(server_delay_us);
+	*reply_len = 0;
+	return 0;
+}
+
+static void run_server(const char *name, int ready_fd)
+{
+	struct binder_state *bs = binder_open(MAP_SIZE);
+	char ok = 1;
+
+	if (!bs || svcmgr_publish(bs, name, (void *)1)) {
+		fprintf(stderr, "%s: cannot publish\n", name);
+		ok = 0;
+	}
+	if (write(ready_fd, &ok, 1) != 1 || !ok)
+		exit(1);
+	binder_loop(bs, delay_handler);
+	exit(0);
+}
+
+static int bucket(uint64_t usecs)
+{
+	int b = 0;
+
+	while (usecs >= 2 && b < HIST_BUCKETS - 1) {
+		usecs >>= 1;
+		b++;
+	}
+	return b;
+}
+
+/* Print the "proc <pid>" block and its nodes from the debugfs file */
+static void print_kernel_hist(pid_t pid)
+{
+	char line[512], want[32];
+	int in_proc = 0;
+	FILE *f;
+
+	f = fopen(LATENCY_FILE, "r");
+	if (!f) {
+		perror(LATENCY_FILE);
+		return;
+	}
+	snprintf(want, sizeof(want), "proc %d\n", pid);
+	while (fgets(line, sizeof(line), f)) {
+		if (!strncmp(line, "binder latency", 14)) {
+			fputs(line, stdout);
+			continue;
+		}
+		if (!strncmp(line, "proc ", 5))
+			in_proc = !strcmp(line, want);
+		if (in_proc)
+			fputs(line, stdout);
+	}
+	fclose(f);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int hist[HIST_BUCKETS] = { 0 };
+	struct binder_state *bs;
+	size_t payload = 64;
+	int calls = 10000;
+	uint32_t handle;
+	uint64_t start;
+	char name[64], c;
+	int ready[2];
+	void *data;
+	pid_t server;
+	int opt, i;
+
+	while ((opt = getopt(argc, argv, "n:d:s:")) != -1) {
+		switch (opt) {
+		case 'n':
+			calls = atoi(optarg);
+			break;
+		case 'd':
+			server_delay_us = atoi(optarg);
+			break;
+		case 's':
+			payload = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-n calls] [-d server_us] "
+				"[-s payload_bytes]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	snprintf(name, sizeof(name), "binder_latency.%d", getpid());
+	if (pipe(ready)) {
+		perror("pipe");
+		return 1;
+	}
+	server = fork();
+	if (server == 0)
+		run_server(name, ready[1]);
+	if (read(ready[0], &c, 1) != 1 || !c)
+		return 1;
+
+	bs = binder_open(MAP_SIZE);
+	data = calloc(1, payload ? payload : 1);
+	if (!bs || !data)
+		goto err;
+	handle = svcmgr_lookup(bs, name);
+	if (!handle) {
+		fprintf(stderr, "%s: lookup failed\n", name);
+		goto err;
+	}
+
+	for (i = 0; i < calls; i++) {
+		start = now_ns();
+		if (binder_call(bs, handle, 1, data, payload, NULL, 0,
+				NULL, NULL))
+			goto err;
+		hist[bucket((now_ns() - start) / 1000)]++;
+	}
+
+	printf("client round trip (log2 usec buckets):");
+	for (i = 0; i < HIST_BUCKETS; i++)
+		printf(" %d", i ? 1 << i : 0);
+	printf("\n  rtt   ");
+	for (i = 0; i < HIST_BUCKETS; i++)
+		printf(" %u", hist[i]);
+	printf("\n\nclient (pid %d):\n", getpid());
+	print_kernel_hist(getpid());
+	printf("\nserver (pid %d):\n", server);
+	print_kernel_hist(server);
+
+	kill(server, SIGKILL);
+	waitpid(server, NULL, 0);
+	return 0;
+
+err:
+	kill(server, SIGKILL);
+	waitpid(server, NULL, 0);
+	return 1;
+}
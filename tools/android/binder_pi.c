@@ -0,0 +1,174 @@
+/*
+ * binder_pi - binder call latency of a realtime caller under CPU load
+ *
+ * Copyright (C) 2012 Google, Inc.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * A SCHED_FIFO client (as an audio thread would be) makes synchronous
+ * calls to a SCHED_OTHER server that burns -w microseconds of CPU per
+ * call, while -l nice 0 busy loops per CPU compete with the server.
+ * Without priority inheritance the server thread has to share the CPU
+ * with the load and the caller's latency tail follows the scheduler's
+ * timeslice; when the server runs at the caller's policy and priority
+ * the tail collapses to about -w.  Run once with -o (SCHED_OTHER caller)
+ * for the uninherited baseline.  Must run as root.
+ */
+
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "binder_util.h"
+
+#define MAP_SIZE	(128 * 1024)
+#define MAX_LOAD	64
+
+static int work_us = 200;
+
+static void spin_us(int us)
+{
+	uint64_t end = now_ns() + (uint64_t)us * 1000;
+
+	while (now_ns() < end)
+		;
+}
+
+static int work_handler(struct binder_state *bs,
+			struct binder_transaction_data *txn,
+			void *reply, size_t *reply_len)
+{
+	spin_us(work_us);
+	*reply_len = 0;
+	return 0;
+}
+
+static void run_server(const char *name, int ready_fd)
+{
+	struct binder_state *bs = binder_open(MAP_SIZE);
+	char ok = 1;
+
+	if (!bs || svcmgr_publish(bs, name, (void *)1)) {
+		fprintf(stderr, "%s: cannot publish\n", name);
+		ok = 0;
+	}
+	if (write(ready_fd, &ok, 1) != 1 || !ok)
+		exit(1);
+	binder_loop(bs, work_handler);
+	exit(0);
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+int main(int argc, char **argv)
+{
+	pid_t server, load[MAX_LOAD];
+	struct sched_param param;
+	struct binder_state *bs;
+	int calls = 2000, nload = -1, rt = 1;
+	uint64_t *lat, start;
+	uint32_t handle;
+	char name[64], c;
+	int ready[2];
+	int opt, i, ret = 1;
+
+	while ((opt = getopt(argc, argv, "n:w:l:o")) != -1) {
+		switch (opt) {
+		case 'n':
+			calls = atoi(optarg);
+			break;
+		case 'w':
+			work_us = atoi(optarg);
+			break;
+		case 'l':
+			nload = atoi(optarg);
+			break;
+		case 'o':
+			rt = 0;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-n calls] [-w server_us] "
+				"[-l load_procs] [-o]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (nload < 0)
+		nload = 2 * sysconf(_SC_NPROCESSORS_ONLN);
+	if (nload > MAX_LOAD)
+		nload = MAX_LOAD;
+	lat = calloc(calls, sizeof(*lat));
+	if (!lat || calls < 1)
+		return 1;
+
+	snprintf(name, sizeof(name), "binder_pi.%d", getpid());
+	if (pipe(ready)) {
+		perror("pipe");
+		return 1;
+	}
+	server = fork();
+	if (server == 0)
+		run_server(name, ready[1]);
+	if (read(ready[0], &c, 1) != 1 || !c)
+		return 1;
+
+	for (i = 0; i < nload; i++) {
+		load[i] = fork();
+		if (load[i] == 0)
+			for (;;)
+				;
+	}
+
+	bs = binder_open(MAP_SIZE);
+	handle = bs ? svcmgr_lookup(bs, name) : 0;
+	if (!handle) {
+		fprintf(stderr, "%s: lookup failed\n", name);
+		goto out;
+	}
+	if (rt) {
+		param.sched_priority = 50;
+		if (sched_setscheduler(0, SCHED_FIFO, &param)) {
+			perror("sched_setscheduler");
+			goto out;
+		}
+	}
+
+	for (i = 0; i < calls; i++) {
+		start = now_ns();
+		if (binder_call(bs, handle, 1, NULL, 0, NULL, 0, NULL, NULL))
+			goto out;
+		lat[i] = (now_ns() - start) / 1000;
+	}
+
+	qsort(lat, calls, sizeof(*lat), cmp_u64);
+	printf("caller %s, server work %d us, %d load procs, %d calls\n",
+	       rt ? "SCHED_FIFO 50" : "SCHED_OTHER", work_us, nload, calls);
+	printf("usec: p50 %llu  p90 %llu  p99 %llu  max %llu\n",
+	       (unsigned long long)lat[calls / 2],
+	       (unsigned long long)lat[calls * 9 / 10],
+	       (unsigned long long)lat[calls * 99 / 100],
+	       (unsigned long long)lat[calls - 1]);
+	ret = 0;
+
+out:
+	param.sched_priority = 0;
+	sched_setscheduler(0, SCHED_OTHER, &param);
+	for (i = 0; i < nload; i++) {
+		kill(load[i], SIGKILL);
+		waitpid(load[i], NULL, 0);
+	}
+	kill(server, SIGKILL);
+	waitpid(server, NULL, 0);
+	return ret;
+}
@@ -0,0 +1,202 @@
+/*
+ * binder_stress - binder transactions/sec versus client/server pairs
+ *
+ * Copyright (C) 2012 Google, Inc.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * For every pair count from 1 to -p, fork that many server processes,
+ * each publishing its own service through servicemanager, and as many
+ * client processes each hammering one server with synchronous calls for
+ * -t seconds.  Independent pairs share nothing but the driver, so with
+ * fine-grained locking the total rate should grow with the pair count
+ * up to the number of cores.  Must run as root or system so that
+ * servicemanager accepts the registrations.
+ */
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "binder_util.h"
+
+#define MAP_SIZE	(128 * 1024)
+#define MAX_PAIRS	64
+
+static size_t payload = 64;
+static int seconds = 5;
+
+static int echo_handler(struct binder_state *bs,
+			struct binder_transaction_data *txn,
+			void *reply, size_t *reply_len)
+{
+	*reply_len = 0;
+	return 0;
+}
+
+static void run_server(const char *name, int ready_fd)
+{
+	struct binder_state *bs = binder_open(MAP_SIZE);
+	char ok = 1;
+
+	if (!bs || svcmgr_publish(bs, name, (void *)1)) {
+		fprintf(stderr, "%s: cannot publish\n", name);
+		ok = 0;
+	}
+	if (write(ready_fd, &ok, 1) != 1 || !ok)
+		exit(1);
+	close(ready_fd);
+	binder_loop(bs, echo_handler);
+	exit(0);
+}
+
+static void run_client(const char *name, int ready_fd, int start_fd,
+		       int result_fd)
+{
+	struct binder_state *bs = binder_open(MAP_SIZE);
+	char *data = calloc(1, payload);
+	unsigned long long count = 0;
+	uint32_t handle = 0;
+	uint64_t end;
+	char c = 1;
+
+	if (bs)
+		handle = svcmgr_lookup(bs, name);
+	if (!handle) {
+		fprintf(stderr, "%s: lookup failed\n", name);
+		c = 0;
+	}
+	if (write(ready_fd, &c, 1) != 1 || !c)
+		exit(1);
+	/* the parent closing the pipe is the start signal */
+	while (read(start_fd, &c, 1) < 0 && errno == EINTR)
+		;
+
+	end = now_ns() + (uint64_t)seconds * 1000000000ULL;
+	while (now_ns() < end) {
+		if (binder_call(bs, handle, 1, data, payload, NULL, 0,
+				NULL, NULL))
+			exit(1);
+		count++;
+	}
+	if (write(result_fd, &count, sizeof(count)) != sizeof(count))
+		exit(1);
+	exit(0);
+}
+
+static int wait_ready(int fd, int n)
+{
+	char c;
+
+	while (n--) {
+		if (read(fd, &c, 1) != 1 || !c)
+			return -1;
+	}
+	return 0;
+}
+
+static int run_round(int pairs, int round)
+{
+	pid_t servers[MAX_PAIRS], clients[MAX_PAIRS];
+	int ready[2], start[2], result[2];
+	unsigned long long total = 0, count;
+	char name[64];
+	int i, ret = -1;
+
+	if (pipe(ready) || pipe(start) || pipe(result)) {
+		perror("pipe");
+		return -1;
+	}
+
+	for (i = 0; i < pairs; i++) {
+		snprintf(name, sizeof(name), "binder_stress.%d.%d.%d",
+			 getpid(), round, i);
+		servers[i] = fork();
+		if (servers[i] == 0)
+			run_server(name, ready[1]);
+	}
+	if (wait_ready(ready[0], pairs))
+		goto out_servers;
+
+	for (i = 0; i < pairs; i++) {
+		snprintf(name, sizeof(name), "binder_stress.%d.%d.%d",
+			 getpid(), round, i);
+		clients[i] = fork();
+		if (clients[i] == 0) {
+			close(start[1]);
+			run_client(name, ready[1], start[0], result[1]);
+		}
+	}
+	if (wait_ready(ready[0], pairs))
+		goto out_clients;
+
+	close(start[1]);
+	for (i = 0; i < pairs; i++) {
+		if (read(result[0], &count, sizeof(count)) != sizeof(count))
+			goto out_clients;
+		total += count;
+	}
+	printf("%5d %12.0f %12.0f\n", pairs, (double)total / seconds,
+	       (double)total / seconds / pairs);
+	fflush(stdout);
+	ret = 0;
+
+out_clients:
+	for (i = 0; i < pairs; i++)
+		waitpid(clients[i], NULL, 0);
+out_servers:
+	for (i = 0; i < pairs; i++) {
+		kill(servers[i], SIGKILL);
+		waitpid(servers[i], NULL, 0);
+	}
+	close(ready[0]);
+	close(ready[1]);
+	close(start[0]);
+	close(result[0]);
+	close(result[1]);
+	return ret;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-p max_pairs] [-s payload_bytes] "
+		"[-t seconds]\n", prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	int max_pairs = 4;
+	int opt, pairs;
+
+	while ((opt = getopt(argc, argv, "p:s:t:")) != -1) {
+		switch (opt) {
+		case 'p':
+			max_pairs = atoi(optarg);
+			break;
+		case 's':
+			payload = atoi(optarg);
+			break;
+		case 't':
+			seconds = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (max_pairs < 1 || max_pairs > MAX_PAIRS || seconds < 1 || !payload)
+		usage(argv[0]);
+
+	printf("pairs        txn/s   txn/s/pair  (payload %zu bytes)\n",
+	       payload);
+	for (pairs = 1; pairs <= max_pairs; pairs++)
+		if (run_round(pairs, pairs))
+			return 1;
+	return 0;
+}
@@ -0,0 +1,392 @@
+/*
+ * Minimal binder client/server helpers for the binder benchmarks.
+ *
+ * Copyright (C) 2012 Google, Inc.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * Only what the benchmarks need is implemented: synchronous calls,
+ * single threaded loopers and publishing/looking up services through
+ * the stock servicemanager, so the tools run on an unmodified device.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "binder_util.h"
+
+#define SVC_MGR_CHECK_SERVICE	2
+#define SVC_MGR_ADD_SERVICE	3
+
+static const char svcmgr_id[] = "android.os.IServiceManager";
+
+uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+struct binder_state *binder_open(size_t mapsize)
+{
+	struct binder_state *bs;
+	struct binder_version vers;
+
+	bs = calloc(1, sizeof(*bs));
+	if (!bs)
+		return NULL;
+	bs->fd = open("/dev/binder", O_RDWR);
+	if (bs->fd < 0) {
+		perror("open /dev/binder");
+		goto err_open;
+	}
+	if (ioctl(bs->fd, BINDER_VERSION, &vers) < 0 ||
+	    vers.protocol_version != BINDER_CURRENT_PROTOCOL_VERSION) {
+		fprintf(stderr, "binder: protocol version mismatch\n");
+		goto err_version;
+	}
+	bs->mapsize = mapsize;
+	bs->map = mmap(NULL, mapsize, PROT_READ, MAP_PRIVATE, bs->fd, 0);
+	if (bs->map == MAP_FAILED) {
+		perror("mmap /dev/binder");
+		goto err_version;
+	}
+	return bs;
+
+err_version:
+	close(bs->fd);
+err_open:
+	free(bs);
+	return NULL;
+}
+
+void binder_close(struct binder_state *bs)
+{
+	munmap(bs->map, bs->mapsize);
+	close(bs->fd);
+	free(bs);
+}
+
+static int binder_write_read(struct binder_state *bs,
+			     const void *wbuf, size_t wlen,
+			     void *rbuf, size_t rlen, size_t *consumed)
+{
+	struct binder_write_read bwr;
+	int ret;
+
+	memset(&bwr, 0, sizeof(bwr));
+	bwr.write_size = wlen;
+	bwr.write_buffer = (unsigned long)wbuf;
+	bwr.read_size = rlen;
+	bwr.read_buffer = (unsigned long)rbuf;
+	do {
+		ret = ioctl(bs->fd, BINDER_WRITE_READ, &bwr);
+		if (ret < 0 && errno == EINTR) {
+			/* the driver may have consumed the write already */
+			bwr.write_buffer += bwr.write_consumed;
+			bwr.write_size -= bwr.write_consumed;
+			bwr.write_consumed = 0;
+		}
+	} while (ret < 0 && errno == EINTR);
+	if (ret < 0) {
+		perror("BINDER_WRITE_READ");
+		return -1;
+	}
+	if (consumed)
+		*consumed = bwr.read_consumed;
+	return 0;
+}
+
+static int binder_write(struct binder_state *bs, const void *data, size_t len)
+{
+	return binder_write_read(bs, data, len, NULL, 0, NULL);
+}
+
+static void binder_ref_done(struct binder_state *bs, uint32_t cmd,
+			    const struct binder_ptr_cookie *pc)
+{
+	struct {
+		uint32_t cmd;
+		struct binder_ptr_cookie pc;
+	} __attribute__((packed)) wr;
+
+	wr.cmd = cmd;
+	wr.pc = *pc;
+	binder_write(bs, &wr, sizeof(wr));
+}
+
+/*
+ * Walk the commands returned by one read.  Reference counting requests on
+ * our own nodes are acknowledged right away.  A transaction or reply is
+ * always the last command of a read; it is copied to *txn and its command
+ * stored in *cmdp.  Returns 1 if one was found, -1 for a dead or failed
+ * reply and 0 if the buffer held nothing of interest.
+ */
+static int binder_parse(struct binder_state *bs, const uint8_t *ptr,
+			size_t size, uint32_t *cmdp,
+			struct binder_transaction_data *txn)
+{
+	const uint8_t *end = ptr + size;
+
+	while (ptr + sizeof(uint32_t) <= end) {
+		uint32_t cmd = *(const uint32_t *)ptr;
+
+		ptr += sizeof(uint32_t);
+		switch (cmd) {
+		case BR_NOOP:
+		case BR_TRANSACTION_COMPLETE:
+		case BR_SPAWN_LOOPER:
+		case BR_OK:
+			break;
+		case BR_INCREFS:
+			binder_ref_done(bs, BC_INCREFS_DONE, (const void *)ptr);
+			ptr += sizeof(struct binder_ptr_cookie);
+			break;
+		case BR_ACQUIRE:
+			binder_ref_done(bs, BC_ACQUIRE_DONE, (const void *)ptr);
+			ptr += sizeof(struct binder_ptr_cookie);
+			break;
+		case BR_RELEASE:
+		case BR_DECREFS:
+			ptr += sizeof(struct binder_ptr_cookie);
+			break;
+		case BR_DEAD_BINDER:
+		case BR_CLEAR_DEATH_NOTIFICATION_DONE:
+			ptr += sizeof(void *);
+			break;
+		case BR_ERROR:
+			fprintf(stderr, "binder: BR_ERROR %d\n",
+				*(const int *)ptr);
+			return -1;
+		case BR_TRANSACTION:
+		case BR_REPLY:
+			memcpy(txn, ptr, sizeof(*txn));
+			*cmdp = cmd;
+			return 1;
+		case BR_DEAD_REPLY:
+		case BR_FAILED_REPLY:
+			return -1;
+		default:
+			fprintf(stderr, "binder: unexpected command 0x%x\n",
+				cmd);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* Returns the BR_TRANSACTION or BR_REPLY command received, or 0 */
+static uint32_t binder_wait(struct binder_state *bs,
+			    const void *wbuf, size_t wlen,
+			    struct binder_transaction_data *txn)
+{
+	uint32_t rbuf[64];
+	uint32_t cmd;
+	size_t consumed;
+	int ret;
+
+	for (;;) {
+		if (binder_write_read(bs, wbuf, wlen, rbuf, sizeof(rbuf),
+				      &consumed))
+			return 0;
+		wlen = 0;
+		ret = binder_parse(bs, (uint8_t *)rbuf, consumed, &cmd, txn);
+		if (ret < 0)
+			return 0;
+		if (ret)
+			return cmd;
+	}
+}
+
+static void binder_free_buffer(struct binder_state *bs, const void *buffer)
+{
+	struct {
+		uint32_t cmd;
+		const void *buffer;
+	} __attribute__((packed)) wr;
+
+	wr.cmd = BC_FREE_BUFFER;
+	wr.buffer = buffer;
+	binder_write(bs, &wr, sizeof(wr));
+}
+
+static void binder_handle_cmd(struct binder_state *bs, uint32_t cmd,
+			      uint32_t handle)
+{
+	uint32_t wr[2] = { cmd, handle };
+
+	binder_write(bs, wr, sizeof(wr));
+}
+
+void binder_release(struct binder_state *bs, uint32_t handle)
+{
+	binder_handle_cmd(bs, BC_RELEASE, handle);
+}
+
+int binder_call(struct binder_state *bs, uint32_t handle, uint32_t code,
+		const void *data, size_t len,
+		const size_t *offs, size_t noffs,
+		void *reply, size_t *reply_len)
+{
+	struct {
+		uint32_t cmd;
+		struct binder_transaction_data txn;
+	} __attribute__((packed)) wr;
+	struct binder_transaction_data txn;
+	const size_t *roffs;
+	size_t i, n;
+
+	memset(&wr, 0, sizeof(wr));
+	wr.cmd = BC_TRANSACTION;
+	wr.txn.target.handle = handle;
+	wr.txn.code = code;
+	wr.txn.flags = TF_ACCEPT_FDS;
+	wr.txn.data_size = len;
+	wr.txn.offsets_size = noffs * sizeof(size_t);
+	wr.txn.data.ptr.buffer = data;
+	wr.txn.data.ptr.offsets = offs;
+
+	if (binder_wait(bs, &wr, sizeof(wr), &txn) != BR_REPLY)
+		return -1;
+
+	if (txn.flags & TF_STATUS_CODE) {
+		binder_free_buffer(bs, txn.data.ptr.buffer);
+		return -1;
+	}
+	roffs = txn.data.ptr.offsets;
+	for (i = 0; i < txn.offsets_size / sizeof(size_t); i++) {
+		const struct flat_binder_object *obj =
+			(const void *)((const uint8_t *)txn.data.ptr.buffer +
+				       roffs[i]);
+
+		if (obj->type == BINDER_TYPE_HANDLE)
+			binder_handle_cmd(bs, BC_ACQUIRE, obj->handle);
+	}
+	if (reply_len) {
+		n = txn.data_size < *reply_len ? txn.data_size : *reply_len;
+		memcpy(reply, txn.data.ptr.buffer, n);
+		*reply_len = txn.data_size;
+	}
+	binder_free_buffer(bs, txn.data.ptr.buffer);
+	return 0;
+}
+
+void binder_loop(struct binder_state *bs, binder_handler func)
+{
+	struct {
+		uint32_t free_cmd;
+		const void *buffer;
+		uint32_t reply_cmd;
+		struct binder_transaction_data txn;
+	} __attribute__((packed)) wr;
+	struct binder_transaction_data txn;
+	uint8_t reply[4096];
+	uint32_t cmd = BC_ENTER_LOOPER;
+	const void *wbuf = &cmd;
+	size_t wlen = sizeof(cmd);
+	size_t reply_len;
+	int done;
+
+	for (;;) {
+		if (binder_wait(bs, wbuf, wlen, &txn) != BR_TRANSACTION)
+			return;
+
+		reply_len = sizeof(reply);
+		done = func(bs, &txn, reply, &reply_len);
+
+		memset(&wr, 0, sizeof(wr));
+		wr.free_cmd = BC_FREE_BUFFER;
+		wr.buffer = txn.data.ptr.buffer;
+		wbuf = &wr;
+		wlen = sizeof(wr.free_cmd) + sizeof(wr.buffer);
+		if (!(txn.flags & TF_ONE_WAY)) {
+			wr.reply_cmd = BC_REPLY;
+			wr.txn.data_size = reply_len;
+			wr.txn.data.ptr.buffer = reply;
+			wlen = sizeof(wr);
+		}
+		if (done) {
+			binder_write(bs, wbuf, wlen);
+			return;
+		}
+	}
+}
+
+/* Parcel layout of String16: length in chars, UTF-16 with terminator */
+static size_t put_string16(uint8_t *p, const char *s)
+{
+	uint32_t len = strlen(s);
+	uint16_t *d = (uint16_t *)(p + sizeof(uint32_t));
+	size_t size = sizeof(uint32_t) + ((len + 1) * 2 + 3) / 4 * 4;
+	uint32_t i;
+
+	memset(p, 0, size);
+	*(uint32_t *)p = len;
+	for (i = 0; i < len; i++)
+		d[i] = s[i];
+	return size;
+}
+
+static size_t svcmgr_header(uint8_t *p, const char *name)
+{
+	size_t n = 0;
+
+	*(uint32_t *)p = 0;	/* strict mode policy */
+	n += sizeof(uint32_t);
+	n += put_string16(p + n, svcmgr_id);
+	n += put_string16(p + n, name);
+	return n;
+}
+
+int svcmgr_publish(struct binder_state *bs, const char *name, void *ptr)
+{
+	uint8_t data[512];
+	size_t off, n;
+	struct flat_binder_object *obj;
+	uint32_t status = ~0U;
+	size_t status_len = sizeof(status);
+
+	n = svcmgr_header(data, name);
+	off = n;
+	obj = (struct flat_binder_object *)(data + n);
+	memset(obj, 0, sizeof(*obj));
+	obj->type = BINDER_TYPE_BINDER;
+	obj->flags = 0x7f | FLAT_BINDER_FLAG_ACCEPTS_FDS;
+	obj->binder = ptr;
+	obj->cookie = ptr;
+	n += sizeof(*obj);
+	*(uint32_t *)(data + n) = 0;	/* allow_isolated */
+	n += sizeof(uint32_t);
+
+	if (binder_call(bs, 0, SVC_MGR_ADD_SERVICE, data, n, &off, 1,
+			&status, &status_len))
+		return -1;
+	return status ? -1 : 0;
+}
+
+uint32_t svcmgr_lookup(struct binder_state *bs, const char *name)
+{
+	uint8_t data[512];
+	struct flat_binder_object obj;
+	size_t obj_len = sizeof(obj);
+	size_t n;
+
+	n = svcmgr_header(data, name);
+	memset(&obj, 0, sizeof(obj));
+	if (binder_call(bs, 0, SVC_MGR_CHECK_SERVICE, data, n, NULL, 0,
+			&obj, &obj_len))
+		return 0;
+	if (obj_len < sizeof(obj) || obj.type != BINDER_TYPE_HANDLE)
+		return 0;
+	return obj.handle;
+}
@@ -0,0 +1,62 @@
+/*
+ * Minimal binder client/server helpers for the binder benchmarks.
+ *
+ * Copyright (C) 2012 Google, Inc.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ */
+
+#ifndef _BINDER_UTIL_H
+#define _BINDER_UTIL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "binder.h"
+
+struct binder_state {
+	int fd;
+	void *map;
+	size_t mapsize;
+};
+
+/*
+ * Called for every incoming transaction.  The handler fills in up to
+ * *reply_len bytes of reply and updates *reply_len; returning non-zero
+ * makes binder_loop() return after the reply has been sent.
+ */
+typedef int (*binder_handler)(struct binder_state *bs,
+			      struct binder_transaction_data *txn,
+			      void *reply, size_t *reply_len);
+
+struct binder_state *binder_open(size_t mapsize);
+void binder_close(struct binder_state *bs);
+
+/*
+ * Synchronous call.  The reply payload is copied to reply (at most
+ * *reply_len bytes, updated to the real size); handles carried in the
+ * reply are acquired before its buffer is freed.  Returns 0 on success.
+ */
+int binder_call(struct binder_state *bs, uint32_t handle, uint32_t code,
+		const void *data, size_t len,
+		const size_t *offs, size_t noffs,
+		void *reply, size_t *reply_len);
+
+/* Turn the calling thread into a looper and serve transactions */
+void binder_loop(struct binder_state *bs, binder_handler func);
+
+void binder_release(struct binder_state *bs, uint32_t handle);
+
+/* Register ptr as a local service with the context manager */
+int svcmgr_publish(struct binder_state *bs, const char *name, void *ptr);
+
+/* Returns a (strong) handle to the service, or 0 if it is not there */
+uint32_t svcmgr_lookup(struct binder_state *bs, const char *name);
+
+/* CLOCK_MONOTONIC in nanoseconds */
+uint64_t now_ns(void);
+
+#endif
@@ -0,0 +1,202 @@
+/*
+ * ion_bench - ION allocation and free latency by buffer size
+ *
+ * Copyright (C) 2012 Google, Inc.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * Allocates and frees -n buffers of each size from the heaps in the mask
+ * -H (bit n selects heap id n) and prints the median and 99th percentile
+ * ION_IOC_ALLOC and ION_IOC_FREE times in microseconds.  With -m every
+ * buffer is also mapped and written once before it is freed, as a
+ * graphics buffer would be, and the first-touch time is printed too.
+ * Allocations from a warm page pool should cost a fraction of ones that
+ * go to the page allocator and zero every page; run once with -d to
+ * drop the pools through the shrinker first for the cold numbers.
+ */
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+/* from include/linux/ion.h */
+struct ion_allocation_data {
+	size_t len;
+	size_t align;
+	unsigned int flags;
+	void *handle;
+};
+
+struct ion_fd_data {
+	void *handle;
+	int fd;
+	unsigned char cacheable;
+};
+
+struct ion_handle_data {
+	void *handle;
+};
+
+#define ION_IOC_MAGIC	'I'
+#define ION_IOC_ALLOC	_IOWR(ION_IOC_MAGIC, 0, struct ion_allocation_data)
+#define ION_IOC_FREE	_IOWR(ION_IOC_MAGIC, 1, struct ion_handle_data)
+#define ION_IOC_MAP	_IOWR(ION_IOC_MAGIC, 2, struct ion_fd_data)
+
+static const size_t sizes[] = {
+	4096, 65536, 1 << 20, 8 << 20,
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void print_stat(uint64_t *us, int n)
+{
+	qsort(us, n, sizeof(*us), cmp_u64);
+	printf(" %8llu %8llu", (unsigned long long)us[n / 2],
+	       (unsigned long long)us[n * 99 / 100]);
+}
+
+/* write to the buffer through a mapping, returns usecs or -1 */
+static int64_t touch(int ion_fd, void *handle, size_t len)
+{
+	struct ion_fd_data fd_data = { .handle = handle };
+	uint64_t start;
+	void *map;
+
+	if (ioctl(ion_fd, ION_IOC_MAP, &fd_data) < 0)
+		return -1;
+	map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED,
+		   fd_data.fd, 0);
+	if (map == MAP_FAILED) {
+		close(fd_data.fd);
+		return -1;
+	}
+	start = now_ns();
+	memset(map, 0x5a, len);
+	start = now_ns() - start;
+	munmap(map, len);
+	close(fd_data.fd);
+	return start / 1000;
+}
+
+static int drop_pools(void)
+{
+	int fd = open("/proc/sys/vm/drop_caches", O_WRONLY);
+	int ret = 0;
+
+	if (fd < 0 || write(fd, "2", 1) != 1) {
+		perror("/proc/sys/vm/drop_caches");
+		ret = -1;
+	}
+	if (fd >= 0)
+		close(fd);
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	struct ion_allocation_data alloc;
+	struct ion_handle_data free_data;
+	unsigned int heap_mask = 1;
+	int n = 200, map = 0, drop = 0;
+	uint64_t *alloc_us, *free_us, *touch_us, start;
+	int64_t t;
+	unsigned int s;
+	int opt, fd, i;
+
+	while ((opt = getopt(argc, argv, "H:n:md")) != -1) {
+		switch (opt) {
+		case 'H':
+			heap_mask = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			n = atoi(optarg);
+			break;
+		case 'm':
+			map = 1;
+			break;
+		case 'd':
+			drop = 1;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-H heap_mask] [-n count] "
+				"[-m] [-d]\n", argv[0]);
+			return 1;
+		}
+	}
+	alloc_us = calloc(n, sizeof(*alloc_us));
+	free_us = calloc(n, sizeof(*free_us));
+	touch_us = calloc(n, sizeof(*touch_us));
+	if (n < 1 || !alloc_us || !free_us || !touch_us)
+		return 1;
+
+	fd = open("/dev/ion", O_RDWR);
+	if (fd < 0) {
+		perror("/dev/ion");
+		return 1;
+	}
+
+	printf("    size  alloc50  alloc99   free50   free99%s\n",
+	       map ? "  touch50  touch99" : "");
+	for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		for (i = 0; i < n; i++) {
+			if (drop && drop_pools())
+				return 1;
+			memset(&alloc, 0, sizeof(alloc));
+			alloc.len = sizes[s];
+			alloc.align = 4096;
+			alloc.flags = heap_mask;
+			start = now_ns();
+			if (ioctl(fd, ION_IOC_ALLOC, &alloc) < 0) {
+				perror("ION_IOC_ALLOC");
+				return 1;
+			}
+			alloc_us[i] = (now_ns() - start) / 1000;
+
+			if (map) {
+				t = touch(fd, alloc.handle, sizes[s]);
+				if (t < 0) {
+					perror("ION_IOC_MAP");
+					return 1;
+				}
+				touch_us[i] = t;
+			}
+
+			free_data.handle = alloc.handle;
+			start = now_ns();
+			if (ioctl(fd, ION_IOC_FREE, &free_data) < 0) {
+				perror("ION_IOC_FREE");
+				return 1;
+			}
+			free_us[i] = (now_ns() - start) / 1000;
+		}
+		printf("%8zu", sizes[s]);
+		print_stat(alloc_us, n);
+		print_stat(free_us, n);
+		if (map)
+			print_stat(touch_us, n);
+		printf("\n");
+	}
+	close(fd);
+	return 0;
+}
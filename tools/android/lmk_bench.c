@@ -0,0 +1,197 @@
+/*
+ * lmk_bench - lowmemorykiller victim selection time versus process count
+ *
+ * Copyright (C) 2012 Google, Inc.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * Forks -n bystander processes spread over oom_adj 0 to 14 and -k victim
+ * processes at oom_adj 15, each touching -m KB, then sets the killer's
+ * only level to oom_adj 15 with an unreachable minfree and times one
+ * write to drop_caches.  The slab shrink loop keeps calling the killer
+ * until nothing at oom_adj 15 is left, so the time per victim is the
+ * cost of one shrinker call plus the kill; with per-oom_adj lists it
+ * should not grow with -n.  The killer's parameters are restored on
+ * exit.  Anything else at oom_adj 15 is killed too, so run it on a test
+ * device, as root.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LMK_PARAM	"/sys/module/lowmemorykiller/parameters/"
+#define DROP_CACHES	"/proc/sys/vm/drop_caches"
+#define MAX_PROCS	4096
+
+static pid_t pids[MAX_PROCS];
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int write_file(const char *path, const char *val)
+{
+	int fd = open(path, O_WRONLY);
+	ssize_t len = strlen(val);
+	int ret = 0;
+
+	if (fd < 0 || write(fd, val, len) != len) {
+		perror(path);
+		ret = -1;
+	}
+	if (fd >= 0)
+		close(fd);
+	return ret;
+}
+
+static int read_file(const char *path, char *buf, size_t size)
+{
+	int fd = open(path, O_RDONLY);
+	ssize_t len;
+
+	if (fd < 0) {
+		perror(path);
+		return -1;
+	}
+	len = read(fd, buf, size - 1);
+	close(fd);
+	if (len < 0)
+		return -1;
+	buf[len] = '\0';
+	return 0;
+}
+
+static pid_t spawn(int adj, size_t kb, int ready_fd)
+{
+	char path[64], val[16];
+	pid_t pid;
+	char *mem;
+
+	pid = fork();
+	if (pid == 0) {
+		mem = malloc(kb * 1024);
+		if (mem)
+			memset(mem, 1, kb * 1024);
+		if (write(ready_fd, "", 1) != 1)
+			exit(1);
+		for (;;)
+			pause();
+	}
+	if (pid < 0)
+		return pid;
+	snprintf(path, sizeof(path), "/proc/%d/oom_adj", pid);
+	snprintf(val, sizeof(val), "%d", adj);
+	if (write_file(path, val)) {
+		kill(pid, SIGKILL);
+		waitpid(pid, NULL, 0);
+		return -1;
+	}
+	return pid;
+}
+
+int main(int argc, char **argv)
+{
+	char old_adj[256], old_minfree[256];
+	int bystanders = 256, victims = 8;
+	size_t kb = 64;
+	int ready[2];
+	int opt, i, n = 0, killed = 0, ret = 1;
+	uint64_t start, elapsed;
+	pid_t pid;
+	char c;
+
+	while ((opt = getopt(argc, argv, "n:k:m:")) != -1) {
+		switch (opt) {
+		case 'n':
+			bystanders = atoi(optarg);
+			break;
+		case 'k':
+			victims = atoi(optarg);
+			break;
+		case 'm':
+			kb = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-n bystanders] [-k victims] "
+				"[-m kb_per_proc]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (bystanders < 0 || victims < 1 || !kb ||
+	    bystanders + victims > MAX_PROCS)
+		return 1;
+
+	if (read_file(LMK_PARAM "adj", old_adj, sizeof(old_adj)) ||
+	    read_file(LMK_PARAM "minfree", old_minfree, sizeof(old_minfree)))
+		return 1;
+	if (pipe(ready)) {
+		perror("pipe");
+		return 1;
+	}
+
+	for (i = 0; i < bystanders + victims; i++) {
+		pid = spawn(i < bystanders ? i % 15 : 15, kb, ready[1]);
+		if (pid < 0)
+			goto out;
+		pids[n++] = pid;
+		if (read(ready[0], &c, 1) != 1)
+			goto out;
+	}
+
+	/* get the other shrinkers' work out of the way first */
+	if (write_file(DROP_CACHES, "2"))
+		goto out;
+	if (write_file(LMK_PARAM "adj", "15") ||
+	    write_file(LMK_PARAM "minfree", "2147483647"))
+		goto restore;
+
+	start = now_ns();
+	if (write_file(DROP_CACHES, "2"))
+		goto restore;
+	elapsed = now_ns() - start;
+
+	/* the victims have been signalled, give them a second to exit */
+	start = now_ns();
+	while (killed < victims && now_ns() - start < 1000000000ULL) {
+		for (i = bystanders; i < n; i++) {
+			if (pids[i] &&
+			    waitpid(pids[i], NULL, WNOHANG) == pids[i]) {
+				pids[i] = 0;
+				killed++;
+			}
+		}
+		usleep(1000);
+	}
+	printf("%d bystanders, %d/%d victims killed in %.3f ms",
+	       bystanders, killed, victims, elapsed / 1e6);
+	if (killed)
+		printf(", %.3f ms each", elapsed / 1e6 / killed);
+	printf("\n");
+	ret = killed ? 0 : 1;
+
+restore:
+	write_file(LMK_PARAM "adj", old_adj);
+	write_file(LMK_PARAM "minfree", old_minfree);
+out:
+	for (i = 0; i < n; i++) {
+		if (!pids[i])
+			continue;
+		kill(pids[i], SIGKILL);
+		waitpid(pids[i], NULL, 0);
+	}
+	return ret;
+}
@@ -0,0 +1,175 @@
+/*
+ * logger_bench - log writes/sec versus concurrent writer threads
+ *
+ * Copyright (C) 2012 Google, Inc.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * For every thread count from 1 to -w, each thread writes -s byte
+ * messages to the log device -l for -t seconds, the same three element
+ * writev() that liblog issues, while -r reader threads drain the log.
+ * Writers that only serialise on a short reservation lock should scale
+ * with the thread count up to the number of cores; writers that sleep
+ * on a mutex held across the user copy do not.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#define MAX_THREADS	64
+#define READ_BUF	(5 * 1024)	/* LOGGER_ENTRY_MAX_LEN */
+
+static const char *log_dev = "/dev/log/main";
+static size_t msg_len = 64;
+static int seconds = 5;
+static volatile int start_flag, stop_flag;
+
+struct writer {
+	pthread_t thread;
+	unsigned long long count;
+	int error;
+};
+
+static void *writer_thread(void *arg)
+{
+	struct writer *w = arg;
+	unsigned char prio = 3;		/* ANDROID_LOG_DEBUG */
+	char tag[] = "logger_bench";
+	struct iovec vec[3];
+	char *msg;
+	int fd;
+
+	fd = open(log_dev, O_WRONLY);
+	msg = malloc(msg_len);
+	if (fd < 0 || !msg) {
+		w->error = 1;
+		return NULL;
+	}
+	memset(msg, 'x', msg_len - 1);
+	msg[msg_len - 1] = '\0';
+	vec[0].iov_base = &prio;
+	vec[0].iov_len = 1;
+	vec[1].iov_base = tag;
+	vec[1].iov_len = sizeof(tag);
+	vec[2].iov_base = msg;
+	vec[2].iov_len = msg_len;
+
+	while (!start_flag)
+		;
+	while (!stop_flag) {
+		if (writev(fd, vec, 3) < 0) {
+			w->error = 1;
+			break;
+		}
+		w->count++;
+	}
+	free(msg);
+	close(fd);
+	return NULL;
+}
+
+static void *reader_thread(void *arg)
+{
+	char buf[READ_BUF];
+	int fd = open(log_dev, O_RDONLY);
+
+	if (fd < 0)
+		return NULL;
+	/* cancelled in read() */
+	for (;;) {
+		if (read(fd, buf, sizeof(buf)) < 0 && errno != EINTR)
+			break;
+	}
+	close(fd);
+	return NULL;
+}
+
+static int run_round(int writers, int readers)
+{
+	struct writer w[MAX_THREADS];
+	pthread_t r[MAX_THREADS];
+	unsigned long long total = 0;
+	int i, ret = 0;
+
+	memset(w, 0, sizeof(w));
+	start_flag = stop_flag = 0;
+	for (i = 0; i < readers; i++)
+		pthread_create(&r[i], NULL, reader_thread, NULL);
+	for (i = 0; i < writers; i++)
+		pthread_create(&w[i].thread, NULL, writer_thread, &w[i]);
+
+	start_flag = 1;
+	sleep(seconds);
+	stop_flag = 1;
+
+	for (i = 0; i < writers; i++) {
+		pthread_join(w[i].thread, NULL);
+		total += w[i].count;
+		ret |= w[i].error;
+	}
+	for (i = 0; i < readers; i++) {
+		pthread_cancel(r[i]);
+		pthread_join(r[i], NULL);
+	}
+	if (ret) {
+		fprintf(stderr, "%s: write failed\n", log_dev);
+		return -1;
+	}
+	printf("%7d %12.0f %12.0f\n", writers, (double)total / seconds,
+	       (double)total / seconds / writers);
+	fflush(stdout);
+	return 0;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-l log_device] [-w max_writers] "
+		"[-r readers] [-s msg_bytes] [-t seconds]\n", prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	int max_writers = 4, readers = 1;
+	int opt, writers;
+
+	while ((opt = getopt(argc, argv, "l:w:r:s:t:")) != -1) {
+		switch (opt) {
+		case 'l':
+			log_dev = optarg;
+			break;
+		case 'w':
+			max_writers = atoi(optarg);
+			break;
+		case 'r':
+			readers = atoi(optarg);
+			break;
+		case 's':
+			msg_len = atoi(optarg);
+			break;
+		case 't':
+			seconds = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (max_writers < 1 || max_writers > MAX_THREADS || readers < 0 ||
+	    readers > MAX_THREADS || msg_len < 1 || seconds < 1)
+		usage(argv[0]);
+
+	printf("writers    writes/s  writes/s/thr  (%s, %zu byte messages, "
+	       "%d readers)\n", log_dev, msg_len, readers);
+	for (writers = 1; writers <= max_writers; writers++)
+		if (run_round(writers, readers))
+			return 1;
+	return 0;
+}
@@ -0,0 +1,230 @@
+/*
+ * qtaguid_bench - loopback TCP throughput with the qtaguid match installed
+ *
+ * Copyright (C) 2012 Google, Inc.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * For every thread count from 1 to -j, each thread streams data over its
+ * own TCP connection on 127.0.0.1 for -t seconds, iperf style, and the
+ * receiving ends just drain it.  Every round runs twice: once with no
+ * rules and once with "-m owner --socket-exists" on lo in INPUT and
+ * OUTPUT, the rules Android's bandwidth controller uses to get every
+ * packet accounted by xt_qtaguid.  With -T each sending socket is also
+ * tagged through /proc/net/xt_qtaguid/ctrl, with its own tag, so the
+ * packets go to a tag_stat of their own.  Loopback has no wire to wait
+ * for, so the gap between the two columns is the cost of the match and
+ * of the accounting behind it, and it should not grow with the thread
+ * count.  Needs iptables in the path and must run as root.
+ */
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define MAX_THREADS	64
+#define BUF_SIZE	65536
+
+static const char * const rules[] = {
+	"INPUT -i lo -m owner --socket-exists",
+	"OUTPUT -o lo -m owner --socket-exists",
+};
+
+static int seconds = 5;
+static int tag_sockets;
+static int listen_fd;
+static struct sockaddr_in addr;
+static volatile int start_flag, stop_flag;
+
+struct worker {
+	pthread_t thread, reader;
+	int index;
+	int rx_fd;
+	unsigned long long bytes;
+	int error;
+};
+
+static int tag_socket(int fd, unsigned int tag)
+{
+	char cmd[64];
+	FILE *ctrl;
+	int ret;
+
+	ctrl = fopen("/proc/net/xt_qtaguid/ctrl", "w");
+	if (!ctrl)
+		return -1;
+	snprintf(cmd, sizeof(cmd), "t %d %llu", fd,
+		 (unsigned long long)tag << 32);
+	ret = fputs(cmd, ctrl) < 0 ? -1 : 0;
+	if (fclose(ctrl))
+		ret = -1;
+	return ret;
+}
+
+static void *reader_thread(void *arg)
+{
+	struct worker *w = arg;
+	static char buf[BUF_SIZE];
+
+	while (read(w->rx_fd, buf, sizeof(buf)) > 0)
+		;
+	return NULL;
+}
+
+static void *worker_thread(void *arg)
+{
+	struct worker *w = arg;
+	char *buf;
+	ssize_t len;
+	int fd;
+
+	buf = malloc(BUF_SIZE);
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (!buf || fd < 0 ||
+	    (tag_sockets && tag_socket(fd, w->index + 1)) ||
+	    connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		w->error = 1;
+		goto out;
+	}
+	/* takes whichever connection is next, all that matters is one each */
+	w->rx_fd = accept(listen_fd, NULL, NULL);
+	if (w->rx_fd < 0 ||
+	    pthread_create(&w->reader, NULL, reader_thread, w)) {
+		w->error = 1;
+		goto out;
+	}
+	memset(buf, w->index, BUF_SIZE);
+
+	while (!start_flag)
+		;
+	while (!stop_flag) {
+		len = write(fd, buf, BUF_SIZE);
+		if (len < 0) {
+			w->error = 1;
+			break;
+		}
+		w->bytes += len;
+	}
+	shutdown(fd, SHUT_WR);
+	pthread_join(w->reader, NULL);
+	close(w->rx_fd);
+out:
+	if (fd >= 0)
+		close(fd);
+	free(buf);
+	return NULL;
+}
+
+static int set_rules(int install)
+{
+	char cmd[128];
+	unsigned int i;
+
+	for (i = 0; i < sizeof(rules) / sizeof(rules[0]); i++) {
+		snprintf(cmd, sizeof(cmd), "iptables %s %s", install ? "-I" : "-D",
+			 rules[i]);
+		if (system(cmd) != 0) {
+			fprintf(stderr, "'%s' failed\n", cmd);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* Runs 'threads' streams for a round, returns Mbit/s or -1 */
+static double run_round(int threads)
+{
+	struct worker w[MAX_THREADS];
+	unsigned long long bytes = 0;
+	int i, error = 0;
+
+	memset(w, 0, sizeof(w));
+	start_flag = stop_flag = 0;
+	for (i = 0; i < threads; i++) {
+		w[i].index = i;
+		pthread_create(&w[i].thread, NULL, worker_thread, &w[i]);
+	}
+	start_flag = 1;
+	sleep(seconds);
+	stop_flag = 1;
+	for (i = 0; i < threads; i++) {
+		pthread_join(w[i].thread, NULL);
+		bytes += w[i].bytes;
+		error |= w[i].error;
+	}
+	if (error) {
+		fprintf(stderr, "socket setup%s or write failed\n",
+			tag_sockets ? ", tagging" : "");
+		return -1;
+	}
+	return (double)bytes * 8 / 1e6 / seconds;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-j max_threads] [-t seconds] [-T]\n",
+		prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	int max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	double plain, matched;
+	socklen_t len = sizeof(addr);
+	int threads, opt;
+
+	while ((opt = getopt(argc, argv, "j:t:T")) != -1) {
+		switch (opt) {
+		case 'j':
+			max_threads = atoi(optarg);
+			break;
+		case 't':
+			seconds = atoi(optarg);
+			break;
+		case 'T':
+			tag_sockets = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (max_threads < 1 || max_threads > MAX_THREADS || seconds < 1)
+		usage(argv[0]);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (listen_fd < 0 ||
+	    bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    getsockname(listen_fd, (struct sockaddr *)&addr, &len) < 0 ||
+	    listen(listen_fd, MAX_THREADS) < 0) {
+		perror("127.0.0.1");
+		return 1;
+	}
+
+	printf("threads  no rule Mbit/s  matched Mbit/s  overhead%s\n",
+	       tag_sockets ? "  (tagged sockets)" : "");
+	for (threads = 1; threads <= max_threads; threads++) {
+		plain = run_round(threads);
+		if (plain < 0 || set_rules(1))
+			return 1;
+		matched = run_round(threads);
+		if (set_rules(0) || matched < 0)
+			return 1;
+		printf("%7d %15.0f %15.0f %8.1f%%\n", threads, plain, matched,
+		       (plain - matched) * 100 / plain);
+		fflush(stdout);
+	}
+	close(listen_fd);
+	return 0;
+}
@@ -0,0 +1,205 @@
+/*
+ * wakelock_bench - wake_lock/wake_unlock pairs per second
+ *
+ * Copyright (C) 2012 Google, Inc.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * For every thread count from 1 to -j, each thread takes and releases its
+ * own user wake lock through /sys/power/wake_lock and /sys/power/wake_unlock
+ * for -t seconds and the pairs per second of all threads are printed.
+ * Before the first round -l other user locks are created and released,
+ * so that name lookups go through a populated table, and -a of them are
+ * left held with a timeout that outlasts the run, so that every acquire
+ * and release happens with timed locks active as it would on a phone.
+ * With -T the benchmark locks take a timeout of that many ms too.  The
+ * numbers cover the sysfs write path, the user lock lookup and the
+ * wakelock core; more threads should not collapse them.  Must run as root.
+ * User wake locks are never freed, so the names stay listed afterwards.
+ */
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MAX_THREADS	64
+
+static const char *lock_path = "/sys/power/wake_lock";
+static const char *unlock_path = "/sys/power/wake_unlock";
+
+static int seconds = 5;
+static long timeout_ms;
+static volatile int start_flag, stop_flag;
+
+struct worker {
+	pthread_t thread;
+	int index;
+	unsigned long long pairs;
+	int error;
+};
+
+static int write_str(int fd, const char *buf)
+{
+	ssize_t len = strlen(buf);
+
+	return write(fd, buf, len) == len ? 0 : -1;
+}
+
+/* "name" or "name timeout_ns" as wake_lock takes it */
+static void lock_cmd(char *buf, size_t size, const char *name, long ms)
+{
+	if (ms)
+		snprintf(buf, size, "%s %lld", name, ms * 1000000LL);
+	else
+		snprintf(buf, size, "%s", name);
+}
+
+static void *worker_thread(void *arg)
+{
+	struct worker *w = arg;
+	char name[32], cmd[64];
+	int lock_fd, unlock_fd;
+
+	snprintf(name, sizeof(name), "wakelock_bench%d", w->index);
+	lock_cmd(cmd, sizeof(cmd), name, timeout_ms);
+	lock_fd = open(lock_path, O_WRONLY);
+	unlock_fd = open(unlock_path, O_WRONLY);
+	if (lock_fd < 0 || unlock_fd < 0) {
+		w->error = 1;
+		goto out;
+	}
+
+	while (!start_flag)
+		;
+	while (!stop_flag) {
+		if (write_str(lock_fd, cmd) || write_str(unlock_fd, name)) {
+			w->error = 1;
+			break;
+		}
+		w->pairs++;
+	}
+out:
+	if (lock_fd >= 0)
+		close(lock_fd);
+	if (unlock_fd >= 0)
+		close(unlock_fd);
+	return NULL;
+}
+
+/* creates 'nr' background locks and leaves the first 'active' held */
+static int setup_locks(int nr, int active)
+{
+	char name[32], cmd[64];
+	int lock_fd, unlock_fd, i, ret = 0;
+
+	lock_fd = open(lock_path, O_WRONLY);
+	unlock_fd = open(unlock_path, O_WRONLY);
+	if (lock_fd < 0 || unlock_fd < 0) {
+		perror(lock_fd < 0 ? lock_path : unlock_path);
+		ret = -1;
+		goto out;
+	}
+	for (i = 0; i < nr && !ret; i++) {
+		snprintf(name, sizeof(name), "wakelock_bench_bg%d", i);
+		if (i < active) {
+			/* outlive the run so they stay active throughout */
+			lock_cmd(cmd, sizeof(cmd), name,
+				 (long)seconds * MAX_THREADS * 2000);
+			ret = write_str(lock_fd, cmd);
+		} else {
+			ret = write_str(lock_fd, name) ||
+			      write_str(unlock_fd, name);
+		}
+	}
+	if (ret)
+		perror(lock_path);
+out:
+	if (lock_fd >= 0)
+		close(lock_fd);
+	if (unlock_fd >= 0)
+		close(unlock_fd);
+	return ret;
+}
+
+static int run_round(int threads)
+{
+	struct worker w[MAX_THREADS];
+	unsigned long long pairs = 0;
+	int i, error = 0;
+
+	memset(w, 0, sizeof(w));
+	start_flag = stop_flag = 0;
+	for (i = 0; i < threads; i++) {
+		w[i].index = i;
+		pthread_create(&w[i].thread, NULL, worker_thread, &w[i]);
+	}
+	start_flag = 1;
+	sleep(seconds);
+	stop_flag = 1;
+	for (i = 0; i < threads; i++) {
+		pthread_join(w[i].thread, NULL);
+		pairs += w[i].pairs;
+		error |= w[i].error;
+	}
+	if (error) {
+		fprintf(stderr, "%s: open or write failed\n", lock_path);
+		return -1;
+	}
+	printf("%7d %12.0f\n", threads, (double)pairs / seconds);
+	fflush(stdout);
+	return 0;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-j max_threads] [-t seconds] "
+		"[-l background_locks] [-a active_locks] [-T timeout_ms]\n",
+		prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	int max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	int nr_locks = 100, active = 10;
+	int threads, opt, ret = 0;
+
+	while ((opt = getopt(argc, argv, "j:t:l:a:T:")) != -1) {
+		switch (opt) {
+		case 'j':
+			max_threads = atoi(optarg);
+			break;
+		case 't':
+			seconds = atoi(optarg);
+			break;
+		case 'l':
+			nr_locks = atoi(optarg);
+			break;
+		case 'a':
+			active = atoi(optarg);
+			break;
+		case 'T':
+			timeout_ms = atol(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (max_threads < 1 || max_threads > MAX_THREADS || seconds < 1 ||
+	    nr_locks < 0 || active < 0 || active > nr_locks || timeout_ms < 0)
+		usage(argv[0]);
+
+	if (setup_locks(nr_locks, active))
+		return 1;
+
+	printf("threads      pairs/s  (%d user locks, %d active, %s)\n",
+	       nr_locks, active, timeout_ms ? "timed" : "untimed");
+	for (threads = 1; threads <= max_threads && !ret; threads++)
+		ret = run_round(threads);
+	return ret ? 1 : 0;
+}
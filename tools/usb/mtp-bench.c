@@ -0,0 +1,343 @@
+/*
+ * mtp-bench - MTP gadget file transfer throughput over dummy_hcd
+ *
+ * Copyright (C) 2012 Google, Inc.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * With dummy_hcd loaded and the android gadget's mtp function enabled,
+ * the gadget enumerates on the dummy host controller of the same machine
+ * and this program plays both ends of a transfer.  One thread issues
+ * MTP_SEND_FILE or MTP_RECEIVE_FILE on /dev/mtp_usb for a -s MB file,
+ * the way the MTP daemon does, while the main thread moves the data
+ * through usbfs on the device node -D, keeping -q bulk URBs of -b bytes
+ * in flight on the interface -i.  Each of the -n rounds prints the MB/s
+ * of a send and of a receive.  dummy_hcd copies straight between the
+ * host and gadget buffers, so the numbers show the gadget driver's own
+ * per-request and file I/O cost; compare them across values of the f_mtp
+ * mtp_tx_reqs, mtp_rx_reqs, mtp_tx_req_len, mtp_rx_req_len and
+ * mtp_zero_copy module parameters.  Must run as root.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/usbdevice_fs.h>
+
+/* from include/linux/usb/f_mtp.h */
+struct mtp_file_range {
+	int		fd;
+	int64_t		offset;
+	int64_t		length;
+	uint16_t	command;
+	uint32_t	transaction_id;
+};
+
+#define MTP_SEND_FILE		_IOW('M', 0, struct mtp_file_range)
+#define MTP_RECEIVE_FILE	_IOW('M', 1, struct mtp_file_range)
+
+#define MAX_URBS	64
+
+static const char *mtp_dev = "/dev/mtp_usb";
+static size_t urb_size = 16384;
+static int depth = 8;
+
+struct gadget_xfer {
+	pthread_t thread;
+	int mtp_fd;
+	int file_fd;
+	int64_t length;
+	int receive;
+	volatile int done;
+	int ret;
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void *gadget_thread(void *arg)
+{
+	struct gadget_xfer *g = arg;
+	struct mtp_file_range range;
+
+	memset(&range, 0, sizeof(range));
+	range.fd = g->file_fd;
+	range.length = g->length;
+	g->ret = ioctl(g->mtp_fd, g->receive ? MTP_RECEIVE_FILE : MTP_SEND_FILE,
+		       &range);
+	if (g->ret < 0)
+		g->ret = -errno;
+	g->done = 1;
+	return NULL;
+}
+
+/*
+ * Finds the bulk endpoints of altsetting 0 of interface 'iface' in the
+ * descriptors usbfs returns for the device, returns 0 if both are there.
+ */
+static int find_endpoints(int fd, int iface, unsigned char *ep_in,
+			  unsigned char *ep_out, unsigned int *maxp_in)
+{
+	unsigned char buf[4096], *d;
+	int len, pos, cur = -1;
+
+	*ep_in = *ep_out = 0;
+	len = read(fd, buf, sizeof(buf));
+	for (pos = 0; pos + 2 <= len && buf[pos] >= 2; pos += buf[pos]) {
+		d = buf + pos;
+		if (d[1] == 4 && d[0] >= 9)		/* interface */
+			cur = d[3] == 0 ? d[2] : -1;
+		else if (d[1] == 5 && d[0] >= 7 && cur == iface &&
+			 (d[3] & 3) == 2) {		/* bulk endpoint */
+			if (d[2] & 0x80) {
+				*ep_in = d[2];
+				*maxp_in = d[4] | (d[5] << 8);
+			} else {
+				*ep_out = d[2];
+			}
+		}
+	}
+	return *ep_in && *ep_out ? 0 : -1;
+}
+
+/* waits for the next URB to complete, giving up once the gadget side has */
+static struct usbdevfs_urb *reap_urb(int fd, struct gadget_xfer *g)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+	void *urb;
+
+	for (;;) {
+		if (ioctl(fd, USBDEVFS_REAPURBNDELAY, &urb) == 0)
+			return urb;
+		if (errno != EAGAIN || (g->done && g->ret < 0))
+			return NULL;
+		poll(&pfd, 1, 100);
+	}
+}
+
+/*
+ * Moves 'length' bytes over endpoint 'ep' with up to 'depth' URBs queued,
+ * plus one more to take the zero length packet that ends an IN transfer
+ * of a whole number of packets.  Returns the bytes moved or -1.
+ */
+static int64_t host_xfer(int fd, unsigned char ep, int64_t length, int zlp,
+			 struct gadget_xfer *g)
+{
+	struct usbdevfs_urb urbs[MAX_URBS], *idle[MAX_URBS], *urb;
+	static char *bufs[MAX_URBS];
+	int64_t left = length, moved = 0;
+	int i, nr_idle = 0, inflight = 0, error = 0;
+
+	memset(urbs, 0, sizeof(urbs));
+	for (i = 0; i < depth; i++) {
+		if (!bufs[i] && !(bufs[i] = malloc(urb_size)))
+			return -1;
+		if (!(ep & 0x80))
+			memset(bufs[i], i, urb_size);
+		urbs[i].type = USBDEVFS_URB_TYPE_BULK;
+		urbs[i].endpoint = ep;
+		urbs[i].buffer = bufs[i];
+		idle[nr_idle++] = &urbs[i];
+	}
+
+	for (;;) {
+		while (nr_idle && (left > 0 || zlp)) {
+			urb = idle[--nr_idle];
+			if (left > 0) {
+				urb->buffer_length = left > (int64_t)urb_size ?
+						     (int64_t)urb_size : left;
+				left -= urb->buffer_length;
+			} else {
+				urb->buffer_length = urb_size;
+				zlp = 0;
+			}
+			if (ioctl(fd, USBDEVFS_SUBMITURB, urb) < 0) {
+				error = 1;
+				break;
+			}
+			inflight++;
+		}
+		if (error || !inflight)
+			break;
+		urb = reap_urb(fd, g);
+		if (!urb || urb->status) {
+			error = 1;
+			break;
+		}
+		inflight--;
+		moved += urb->actual_length;
+		idle[nr_idle++] = urb;
+	}
+
+	if (error) {
+		for (i = 0; i < depth; i++)
+			ioctl(fd, USBDEVFS_DISCARDURB, &urbs[i]);
+		while (inflight-- > 0)
+			ioctl(fd, USBDEVFS_REAPURB, &urb);
+		return -1;
+	}
+	return moved;
+}
+
+/* One MTP_SEND_FILE or MTP_RECEIVE_FILE, returns MB/s or -1 */
+static double run_xfer(int usb_fd, int mtp_fd, int file_fd, unsigned char ep,
+		       int64_t length, int zlp, int receive)
+{
+	struct gadget_xfer g;
+	uint64_t start;
+	int64_t moved;
+
+	memset(&g, 0, sizeof(g));
+	g.mtp_fd = mtp_fd;
+	g.file_fd = file_fd;
+	g.length = length;
+	g.receive = receive;
+
+	start = now_ns();
+	if (pthread_create(&g.thread, NULL, gadget_thread, &g))
+		return -1;
+	moved = host_xfer(usb_fd, ep, length, zlp, &g);
+	pthread_join(g.thread, NULL);
+	start = now_ns() - start;
+
+	if (g.ret < 0) {
+		fprintf(stderr, "%s: %s\n", receive ? "MTP_RECEIVE_FILE" :
+			"MTP_SEND_FILE", strerror(-g.ret));
+		return -1;
+	}
+	if (moved != length) {
+		fprintf(stderr, "usbfs: moved %lld of %lld bytes\n",
+			(long long)moved, (long long)length);
+		return -1;
+	}
+	return (double)length / (1 << 20) / (start / 1e9);
+}
+
+static int fill_file(int fd, int64_t length)
+{
+	static char buf[1 << 20];
+	int64_t off;
+	size_t len;
+
+	for (off = 0; off < length; off += len) {
+		len = length - off > (int64_t)sizeof(buf) ? sizeof(buf) :
+		      (size_t)(length - off);
+		memset(buf, off >> 20, len);
+		if (write(fd, buf, len) != (ssize_t)len)
+			return -1;
+	}
+	return 0;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s -D /dev/bus/usb/BBB/DDD [-i interface] "
+		"[-f file] [-s size_mb] [-q urbs] [-b urb_bytes] [-n rounds]\n",
+		prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	const char *usb_dev = NULL, *path = "/tmp/mtp-bench.dat";
+	unsigned char ep_in, ep_out;
+	unsigned int maxp_in = 512;
+	int size_mb = 64, rounds = 3, iface = 0;
+	int opt, usb_fd, mtp_fd, file_fd, i;
+	double tx, rx;
+	int64_t length;
+
+	while ((opt = getopt(argc, argv, "D:i:f:s:q:b:n:")) != -1) {
+		switch (opt) {
+		case 'D':
+			usb_dev = optarg;
+			break;
+		case 'i':
+			iface = atoi(optarg);
+			break;
+		case 'f':
+			path = optarg;
+			break;
+		case 's':
+			size_mb = atoi(optarg);
+			break;
+		case 'q':
+			depth = atoi(optarg);
+			break;
+		case 'b':
+			urb_size = atoi(optarg);
+			break;
+		case 'n':
+			rounds = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (!usb_dev || size_mb < 1 || depth < 1 || depth > MAX_URBS ||
+	    !urb_size || rounds < 1)
+		usage(argv[0]);
+	length = (int64_t)size_mb << 20;
+
+	usb_fd = open(usb_dev, O_RDWR);
+	if (usb_fd < 0) {
+		perror(usb_dev);
+		return 1;
+	}
+	if (find_endpoints(usb_fd, iface, &ep_in, &ep_out, &maxp_in)) {
+		fprintf(stderr, "%s: no bulk endpoint pair on interface %d\n",
+			usb_dev, iface);
+		return 1;
+	}
+	if (ioctl(usb_fd, USBDEVFS_CLAIMINTERFACE, &iface) < 0) {
+		perror("USBDEVFS_CLAIMINTERFACE");
+		return 1;
+	}
+	mtp_fd = open(mtp_dev, O_RDWR);
+	if (mtp_fd < 0) {
+		perror(mtp_dev);
+		return 1;
+	}
+	file_fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (file_fd < 0 || fill_file(file_fd, length)) {
+		perror(path);
+		return 1;
+	}
+
+	printf("round   send MB/s  receive MB/s  (%d MB, %d x %zu byte URBs)\n",
+	       size_mb, depth, urb_size);
+	for (i = 0; i < rounds; i++) {
+		tx = run_xfer(usb_fd, mtp_fd, file_fd, ep_in, length,
+			      length % maxp_in == 0, 0);
+		if (tx < 0)
+			break;
+		rx = run_xfer(usb_fd, mtp_fd, file_fd, ep_out, length, 0, 1);
+		if (rx < 0)
+			break;
+		printf("%5d %11.1f %13.1f\n", i + 1, tx, rx);
+		fflush(stdout);
+	}
+
+	close(file_fd);
+	unlink(path);
+	close(mtp_fd);
+	ioctl(usb_fd, USBDEVFS_RELEASEINTERFACE, &iface);
+	close(usb_fd);
+	return i == rounds ? 0 : 1;
+}
@@ -0,0 +1,291 @@
+/*
+ * zram_bench - zram read and write throughput versus thread count
+ *
+ * Copyright (C) 2012 Google, Inc.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * Resets the zram device -d, sizes it to -s MB and, for every thread count
+ * from 1 to -j, has each thread write and then read back its own slice of
+ * the device one page at a time with O_DIRECT, the way swap does.  The
+ * pages hold text-like data that compresses about as well as anonymous
+ * memory, or pages from the file -f, such as a dump of a process's heap.
+ * With one compression stream per CPU both columns should grow with the
+ * thread count up to the number of cores.
+ *
+ * -a takes a comma separated list of compression algorithms to repeat the
+ * runs with; the compression ratio is orig_data_size over compr_data_size
+ * after the write pass.  Must run as root.
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PAGE_SZ		4096
+#define MAX_THREADS	64
+
+static const char *dev = "/dev/zram0";
+static char sysfs[128];
+static size_t pages;
+static char *corpus;
+static size_t corpus_pages;
+
+struct worker {
+	pthread_t thread;
+	int fd;
+	size_t first, nr;
+	int write;
+	int error;
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static unsigned long long read_attr(const char *attr)
+{
+	char path[192], val[32];
+	ssize_t len;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%s", sysfs, attr);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return 0;
+	len = read(fd, val, sizeof(val) - 1);
+	close(fd);
+	if (len <= 0)
+		return 0;
+	val[len] = '\0';
+	return strtoull(val, NULL, 0);
+}
+
+static int write_attr(const char *attr, const char *val)
+{
+	char path[192];
+	ssize_t len = strlen(val);
+	int fd, ret = 0;
+
+	snprintf(path, sizeof(path), "%s/%s", sysfs, attr);
+	fd = open(path, O_WRONLY);
+	if (fd < 0 || write(fd, val, len) != len) {
+		perror(path);
+		ret = -1;
+	}
+	if (fd >= 0)
+		close(fd);
+	return ret;
+}
+
+/* words from a small dictionary, so a page compresses to a third or so */
+static void fill_page(char *buf, size_t index)
+{
+	static const char * const words[] = {
+		"the ", "of ", "zram ", "page ", "swap ", "memory ", "0x0000 ",
+		"null ", "android ", "binder ", "1 ", "lock ", "cpu ", "\n",
+		"task ", "\t",
+	};
+	unsigned int seed = index * 2654435761u;
+	size_t off = 0, len;
+	const char *w;
+
+	if (corpus) {
+		memcpy(buf, corpus + index % corpus_pages * PAGE_SZ, PAGE_SZ);
+		return;
+	}
+	while (off < PAGE_SZ) {
+		w = words[rand_r(&seed) % (sizeof(words) / sizeof(words[0]))];
+		len = strlen(w);
+		if (len > PAGE_SZ - off)
+			len = PAGE_SZ - off;
+		memcpy(buf + off, w, len);
+		off += len;
+	}
+	memcpy(buf, &index, sizeof(index));
+}
+
+static void *worker_thread(void *arg)
+{
+	struct worker *w = arg;
+	char *buf;
+	size_t i;
+	ssize_t ret;
+
+	if (posix_memalign((void **)&buf, PAGE_SZ, PAGE_SZ)) {
+		w->error = 1;
+		return NULL;
+	}
+	for (i = w->first; i < w->first + w->nr; i++) {
+		if (w->write) {
+			fill_page(buf, i);
+			ret = pwrite(w->fd, buf, PAGE_SZ, (off_t)i * PAGE_SZ);
+		} else {
+			ret = pread(w->fd, buf, PAGE_SZ, (off_t)i * PAGE_SZ);
+		}
+		if (ret != PAGE_SZ) {
+			w->error = 1;
+			break;
+		}
+	}
+	free(buf);
+	return NULL;
+}
+
+/* Runs one pass over the device with 'threads' workers, returns MB/s */
+static double run_pass(int fd, int threads, int write)
+{
+	struct worker w[MAX_THREADS];
+	size_t per = pages / threads;
+	uint64_t start, elapsed;
+	int i, error = 0;
+
+	start = now_ns();
+	for (i = 0; i < threads; i++) {
+		w[i].fd = fd;
+		w[i].first = i * per;
+		w[i].nr = per;
+		w[i].write = write;
+		w[i].error = 0;
+		pthread_create(&w[i].thread, NULL, worker_thread, &w[i]);
+	}
+	for (i = 0; i < threads; i++) {
+		pthread_join(w[i].thread, NULL);
+		error |= w[i].error;
+	}
+	elapsed = now_ns() - start;
+	if (error)
+		return -1;
+	return (double)per * threads * PAGE_SZ / (1 << 20) /
+		(elapsed / 1e9);
+}
+
+static int load_corpus(const char *path)
+{
+	size_t size = pages * PAGE_SZ;
+	ssize_t len;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	corpus = malloc(size);
+	if (fd < 0 || !corpus) {
+		perror(path);
+		return -1;
+	}
+	len = read(fd, corpus, size);
+	close(fd);
+	if (len < PAGE_SZ) {
+		fprintf(stderr, "%s: shorter than a page\n", path);
+		return -1;
+	}
+	corpus_pages = len / PAGE_SZ;
+	return 0;
+}
+
+/* One row per thread count with the algorithm already chosen */
+static int run_algorithm(const char *algo, int max_threads)
+{
+	unsigned long long orig, compr;
+	double wr, rd;
+	int threads, fd;
+	char val[32];
+
+	for (threads = 1; threads <= max_threads; threads++) {
+		snprintf(val, sizeof(val), "%zu", pages * PAGE_SZ);
+		if (write_attr("reset", "1") ||
+		    (algo && write_attr("comp_algorithm", algo)) ||
+		    write_attr("disksize", val))
+			return -1;
+		fd = open(dev, O_RDWR | O_DIRECT);
+		if (fd < 0) {
+			perror(dev);
+			return -1;
+		}
+		wr = run_pass(fd, threads, 1);
+		orig = read_attr("orig_data_size");
+		compr = read_attr("compr_data_size");
+		rd = run_pass(fd, threads, 0);
+		close(fd);
+		if (wr < 0 || rd < 0) {
+			fprintf(stderr, "%s: I/O error\n", dev);
+			return -1;
+		}
+		printf("%-10s %7d %11.1f %11.1f %7.2f\n",
+		       algo ? algo : "default", threads, wr, rd,
+		       compr ? (double)orig / compr : 0.0);
+		fflush(stdout);
+	}
+	return 0;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-d device] [-s size_mb] [-j max_threads] "
+		"[-a algo,...] [-f corpus]\n", prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	int max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	int size_mb = 64;
+	char *algos = NULL, *corpus_path = NULL;
+	char *name, *algo;
+	int opt, ret = 0;
+
+	while ((opt = getopt(argc, argv, "d:s:j:a:f:")) != -1) {
+		switch (opt) {
+		case 'd':
+			dev = optarg;
+			break;
+		case 's':
+			size_mb = atoi(optarg);
+			break;
+		case 'j':
+			max_threads = atoi(optarg);
+			break;
+		case 'a':
+			algos = optarg;
+			break;
+		case 'f':
+			corpus_path = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (size_mb < 1 || max_threads < 1 || max_threads > MAX_THREADS)
+		usage(argv[0]);
+	pages = (size_t)size_mb * (1 << 20) / PAGE_SZ;
+	if (corpus_path && load_corpus(corpus_path))
+		return 1;
+
+	name = strdup(dev);
+	snprintf(sysfs, sizeof(sysfs), "/sys/block/%s", basename(name));
+	free(name);
+
+	printf("algorithm  threads  write MB/s   read MB/s   ratio  "
+	       "(%s, %d MB)\n", dev, size_mb);
+	if (!algos) {
+		ret = run_algorithm(NULL, max_threads);
+	} else {
+		for (algo = strtok(algos, ","); algo && !ret;
+		     algo = strtok(NULL, ","))
+			ret = run_algorithm(algo, max_threads);
+	}
+	write_attr("reset", "1");
+	return ret ? 1 : 0;
+}
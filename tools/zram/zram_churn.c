@@ -0,0 +1,188 @@
+/*
+ * zram_churn - zram allocator memory overhead over an allocation churn trace
+ *
+ * Copyright (C) 2012 Google, Inc.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * Fills the zram device -d of -s MB with pages that compress to anywhere
+ * between 64 bytes and 2 KB, then replays -n random operations: each one
+ * either frees a page, by overwriting it with zeroes, or rewrites it with
+ * a new compressed size, which moves it to another size class.  Every
+ * -i operations it prints the bytes of compressed data stored, the memory
+ * the allocator uses for them and the overhead between the two.  At the
+ * end it compacts the pool and prints the same again.  The same -S seed
+ * replays the same trace.  Must run as root.
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <libgen.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define PAGE_SZ		4096
+#define MIN_CSIZE	64
+#define MAX_CSIZE	2048	/* stays under max_zpage_size */
+
+static const char *dev = "/dev/zram0";
+static char sysfs[128];
+
+static unsigned long long read_attr(const char *attr)
+{
+	char path[192], val[32];
+	ssize_t len;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%s", sysfs, attr);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return 0;
+	len = read(fd, val, sizeof(val) - 1);
+	close(fd);
+	if (len <= 0)
+		return 0;
+	val[len] = '\0';
+	return strtoull(val, NULL, 0);
+}
+
+static int write_attr(const char *attr, const char *val)
+{
+	char path[192];
+	ssize_t len = strlen(val);
+	int fd, ret = 0;
+
+	snprintf(path, sizeof(path), "%s/%s", sysfs, attr);
+	fd = open(path, O_WRONLY);
+	if (fd < 0 || write(fd, val, len) != len) {
+		perror(path);
+		ret = -1;
+	}
+	if (fd >= 0)
+		close(fd);
+	return ret;
+}
+
+/* random bytes up to about the wanted compressed size, zeroes after */
+static void fill_page(char *buf, size_t csize)
+{
+	size_t i;
+
+	for (i = 0; i < csize; i++)
+		buf[i] = lrand48();
+	memset(buf + csize, 0, PAGE_SZ - csize);
+}
+
+static void report(unsigned long ops)
+{
+	unsigned long long stored = read_attr("compr_data_size");
+	unsigned long long used = read_attr("mem_used_total");
+	unsigned long long wasted = read_attr("mem_wasted_total");
+
+	printf("%10lu %12llu %12llu %12llu %8.1f%%\n", ops, stored, used,
+	       wasted, stored ? (double)(used - stored) * 100 / stored : 0.0);
+	fflush(stdout);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-d device] [-s size_mb] [-n ops] "
+		"[-i interval] [-f free_percent] [-S seed]\n", prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long ops = 1000000, interval = 100000, op;
+	int size_mb = 64, free_pct = 30;
+	long seed = 1;
+	size_t pages, i;
+	char val[32], *name, *buf;
+	int opt, fd;
+
+	while ((opt = getopt(argc, argv, "d:s:n:i:f:S:")) != -1) {
+		switch (opt) {
+		case 'd':
+			dev = optarg;
+			break;
+		case 's':
+			size_mb = atoi(optarg);
+			break;
+		case 'n':
+			ops = strtoul(optarg, NULL, 0);
+			break;
+		case 'i':
+			interval = strtoul(optarg, NULL, 0);
+			break;
+		case 'f':
+			free_pct = atoi(optarg);
+			break;
+		case 'S':
+			seed = atol(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (size_mb < 1 || !interval || free_pct < 0 || free_pct > 100)
+		usage(argv[0]);
+	pages = (size_t)size_mb * (1 << 20) / PAGE_SZ;
+	srand48(seed);
+
+	name = strdup(dev);
+	snprintf(sysfs, sizeof(sysfs), "/sys/block/%s", basename(name));
+	free(name);
+
+	snprintf(val, sizeof(val), "%zu", pages * PAGE_SZ);
+	if (write_attr("reset", "1") || write_attr("disksize", val))
+		return 1;
+	fd = open(dev, O_RDWR | O_DIRECT);
+	if (fd < 0) {
+		perror(dev);
+		return 1;
+	}
+	if (posix_memalign((void **)&buf, PAGE_SZ, PAGE_SZ))
+		return 1;
+
+	printf("       ops       stored         used       wasted  overhead\n");
+	for (i = 0; i < pages; i++) {
+		fill_page(buf, MIN_CSIZE + lrand48() % (MAX_CSIZE - MIN_CSIZE));
+		if (pwrite(fd, buf, PAGE_SZ, (off_t)i * PAGE_SZ) != PAGE_SZ)
+			goto err;
+	}
+	report(0);
+
+	for (op = 1; op <= ops; op++) {
+		i = lrand48() % pages;
+		if (lrand48() % 100 < free_pct)
+			fill_page(buf, 0);
+		else
+			fill_page(buf, MIN_CSIZE +
+				  lrand48() % (MAX_CSIZE - MIN_CSIZE));
+		if (pwrite(fd, buf, PAGE_SZ, (off_t)i * PAGE_SZ) != PAGE_SZ)
+			goto err;
+		if (op % interval == 0)
+			report(op);
+	}
+
+	if (write_attr("compact", "1"))
+		goto out;
+	printf("after compaction, %llu pages freed:\n",
+	       read_attr("pages_compacted"));
+	report(ops);
+
+out:
+	close(fd);
+	write_attr("reset", "1");
+	return 0;
+
+err:
+	perror(dev);
+	close(fd);
+	write_attr("reset", "1");
+	return 1;
+}